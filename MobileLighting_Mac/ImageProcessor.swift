@@ -136,6 +136,9 @@ func runRefine(allProj: Bool, allPosPairs: Bool, rectified: Bool, params: [Strin
         projs = getProjFromParam(param: params[1], inputDir: dirStruc.decoded(rectified), prefix: "proj", suffix: "")
     }
     
+    // collect all images first, then refine them concurrently
+    var outdirs: [[CChar]] = [], decodedIms: [[CChar]] = [], posIDs: [[CChar]] = []
+    var directions: [Int32] = [], angles: [Double] = []
     for proj in projs {
         var positionPairs: [(Int, Int)]
         if (allPosPairs) {
@@ -175,7 +178,11 @@ func runRefine(allProj: Bool, allPosPairs: Bool, rectified: Bool, params: [Strin
                             } else {
                                 posID = *"\(pos)"
                             }
-                            refineDecodedIm(&coutdir, Int32(direction), &cimg, angle, &posID)
+                            outdirs.append(coutdir)
+                            directions.append(Int32(direction))
+                            decodedIms.append(cimg)
+                            angles.append(angle)
+                            posIDs.append(posID)
                         }
                     } catch {
                         print("refine error: could not load metadata file \(metadatapath).")
@@ -184,6 +191,20 @@ func runRefine(allProj: Bool, allPosPairs: Bool, rectified: Bool, params: [Strin
             }
         }
     }
+    
+    guard decodedIms.count > 0 else {
+        return
+    }
+    var outdirPtrs = **outdirs
+    var decodedImPtrs = **decodedIms
+    var posIDPtrs = **posIDs
+    var status = [Int32](repeating: 0, count: decodedIms.count)
+    let nworkers: Int32 = 0 // one per core
+    let maxMemoryMB: Int32 = 4096 // limits number of images refined at once
+    let nfailed = refineDecodedImBatch(&outdirPtrs, &directions, &decodedImPtrs, &angles, &posIDPtrs, nil, Int32(decodedIms.count), nworkers, maxMemoryMB, &status)
+    if nfailed > 0 {
+        print("refine error: \(nfailed) of \(status.count) images could not be refined.")
+    }
 }
 
 func runDisparity(allProj: Bool, allPosPairs: Bool, params: [String]) {
@@ -207,6 +228,7 @@ func runDisparity(allProj: Bool, allPosPairs: Bool, params: [String]) {
             disparityMatch(proj: proj, leftpos: leftpos, rightpos: rightpos, rectified: true)
         }
     }
+    clearDisparityCache()
 }
 
 // refined: if true, run on the refined unrectified images. Otherwise run on the initial unrectified images.
@@ -363,14 +385,40 @@ func disparityMatch(proj: Int, leftpos: Int, rightpos: Int, rectified: Bool) {
         ymax = 0
     }
     
+    // only match, check and filter the pixels in the ROI of the scene settings, if any
+    var region = DisparityRegion(x: 0, y: 0, width: 0, height: 0, maskfile: nil)
+    if let roi = sceneSettings.disparityROI {
+        region.x = Int32(roi[0])
+        region.y = Int32(roi[1])
+        region.width = Int32(roi[2])
+        region.height = Int32(roi[3])
+    }
+    // the ROI is in the left image.  the right image needs the pixels the ROI pixels can match,
+    // i.e. the ROI shifted by the disparity range (left x matches right x - xmax ... x - xmin),
+    // or all of them without a range (unrectified images)
+    var rightRegion = region
+    if sceneSettings.disparityROI != nil {
+        if rectified {
+            rightRegion.x -= xmax
+            rightRegion.y -= ymax
+            rightRegion.width += xmax - xmin
+            rightRegion.height += ymax - ymin
+        } else {
+            rightRegion.width = 0
+        }
+    }
+    
     disparitiesOfRefinedImgs(&refinedDirLeft, &refinedDirRight,
                              &disparityDirLeft,
                              &disparityDirRight,
                              l, r, rectified ? 1 : 0,
-                             xmin, xmax, ymin, ymax)
+                             xmin, xmax, ymin, ymax,
+                             Int32(sceneSettings.disparityPyramidLevels),
+                             sceneSettings.disparityAutoRange ? 1 : 0,
+                             &region, &rightRegion)
     var in_suffix = "0initial".cString(using: .ascii)!
     var out_suffix = "1crosscheck1".cString(using: .ascii)!
-    crosscheckDisparities(&disparityDirLeft, &disparityDirRight, l, r, 1.5, 0, 0, &in_suffix, &out_suffix)
+    crosscheckDisparities(&disparityDirLeft, &disparityDirRight, l, r, 1.5, 0, 0, &in_suffix, &out_suffix, &region, &rightRegion)
     // if images are not rectified, do not perform filter disparities
     if !rectified {
         return
@@ -389,7 +437,7 @@ func disparityMatch(proj: Int, leftpos: Int, rightpos: Int, rectified: Bool) {
     outx = disparityDirLeft + out_suffix_x
     outy = disparityDirLeft + out_suffix_y
 //    filterDisparities(&dispx, &dispy, &outx, &outy, l, r, 1.5, 3, 0, 20, 200)
-    filterDisparities(&dispx, &dispy, &outx, &outy, l, r, Float(ythresh), 3, 0, 20, 200)
+    filterDisparities(&dispx, &dispy, &outx, &outy, l, r, Float(ythresh), 3, 0, 20, 200, &region)
 
     // Filter the RIGHT disparities
     dispx = disparityDirRight + in_suffix_x
@@ -397,10 +445,10 @@ func disparityMatch(proj: Int, leftpos: Int, rightpos: Int, rectified: Bool) {
     outx = disparityDirRight + out_suffix_x
     outy = disparityDirRight + out_suffix_y
 //    filterDisparities(&dispx, &dispy, &outx, &outy, l, r, 1.5, 3, 0, 20, 200)
-    filterDisparities(&dispx, &dispy, &outx, &outy, l, r, Float(ythresh), 3, 0, 20, 200)
+    filterDisparities(&dispx, &dispy, &outx, &outy, l, r, Float(ythresh), 3, 0, 20, 200, &rightRegion)
     in_suffix = "2filtered".cString(using: .ascii)!
     out_suffix = "3crosscheck2".cString(using: .ascii)!
-    crosscheckDisparities(&disparityDirLeft, &disparityDirRight, l, r, 1.5, 1, 0, &in_suffix, &out_suffix)
+    crosscheckDisparities(&disparityDirLeft, &disparityDirRight, l, r, 1.5, 1, 0, &in_suffix, &out_suffix, &region, &rightRegion)
 }
 
 
@@ -590,7 +638,7 @@ func merge(left leftpos: Int, right rightpos: Int, rectified: Bool) {
     var in_suffix = "0initial".cString(using: .ascii)!
     var out_suffix = "1crosscheck".cString(using: .ascii)!
     
-    crosscheckDisparities(&posdir0, &posdir1, l, r, thresh, xonly, halfocc, &in_suffix, &out_suffix)
+    crosscheckDisparities(&posdir0, &posdir1, l, r, thresh, xonly, halfocc, &in_suffix, &out_suffix, nil, nil)
 }
 
 //MARK: reproject
@@ -634,7 +682,7 @@ func reproject(left leftpos: Int, right rightpos: Int) {
             outx = dir + out_suffix_x
             outy = dir + out_suffix_y
             
-            filterDisparities(&dispx, nil, &outx, nil, Int32(leftpos), Int32(rightpos), -1, 3, 0, 0, 200)
+            filterDisparities(&dispx, nil, &outx, nil, Int32(leftpos), Int32(rightpos), -1, 3, 0, 0, 200, nil)
         }
     }
 }
@@ -675,7 +723,7 @@ func mergeReprojected(left leftpos: Int, right rightpos: Int) {
         // filter merged results
         var indispx = outdfile
         var outx = *(dirStruc.merged2(pos) + "/disp\(leftpos)\(rightpos)x-1filtered.pfm")
-        filterDisparities(&indispx, nil, &outx, nil, Int32(leftpos), Int32(rightpos), -1, 0, 0, 20, 20)
+        filterDisparities(&indispx, nil, &outx, nil, Int32(leftpos), Int32(rightpos), -1, 0, 0, 20, 20, nil)
 
     }
     
@@ -684,19 +732,19 @@ func mergeReprojected(left leftpos: Int, right rightpos: Int) {
     var rightdir = *(dirStruc.merged2(rightpos))
     var in_suffix = *"1filtered"
     var out_suffix = *"2crosscheck1"
-    crosscheckDisparities(&leftdir, &rightdir, Int32(leftpos), Int32(rightpos), 1.0, 1, -1, &in_suffix, &out_suffix)
+    crosscheckDisparities(&leftdir, &rightdir, Int32(leftpos), Int32(rightpos), 1.0, 1, -1, &in_suffix, &out_suffix, nil, nil)
     
     // filter again, this can fill small holes of cross-checked regions
     for pos in [leftpos, rightpos] {
         var indispx = *(dirStruc.merged2(pos) + "/disp\(leftpos)\(rightpos)x-2crosscheck1.pfm")
         var outx = *(dirStruc.merged2(pos) + "/disp\(leftpos)\(rightpos)x-3filtered.pfm")
-        filterDisparities(&indispx, nil, &outx, nil, Int32(leftpos), Int32(leftpos), -1, 0, 0, 20, 20)
+        filterDisparities(&indispx, nil, &outx, nil, Int32(leftpos), Int32(leftpos), -1, 0, 0, 20, 20, nil)
     }
     
     // crosscheck one last time
     in_suffix = *"3filtered"
     out_suffix = *"4crosscheck2"
-    crosscheckDisparities(&leftdir, &rightdir, Int32(leftpos), Int32(rightpos), 1, 1, -1, &in_suffix, &out_suffix)
+    crosscheckDisparities(&leftdir, &rightdir, Int32(leftpos), Int32(rightpos), 1, 1, -1, &in_suffix, &out_suffix, nil, nil)
 }
 
 func filterReliableReprojected(_ reprojDirs: [String], left leftpos: Int, right rightpos: Int) -> [String] {
@@ -28,6 +28,9 @@ class SceneSettings {
     var minSWfilepath: String
     var robotPathName: String
     var yDisparityThreshold: Double
+    var disparityPyramidLevels: Int     // coarse-to-fine disparity matching levels (0 = off)
+    var disparityROI: [Int]?            // [x, y, width, height] of the left pixels to match (nil = all)
+    var disparityAutoRange: Bool        // estimate disparity ranges from a sparse pre-pass
     
     // structured lighting
     var strucExposureDurations: [Double]
@@ -50,6 +53,9 @@ class SceneSettings {
             maindict[Yaml.string("minSWdataPath")] = Yaml.string("(value uninitialized)")
             maindict[Yaml.string("robotPathName")] = Yaml.string("(value uninitialized)")
             maindict[Yaml.string("yDisparityThreshold")] = Yaml.double(5.0)
+            maindict[Yaml.string("disparityPyramidLevels")] = Yaml.int(0)
+            maindict[Yaml.string("disparityROI")] = Yaml.array([])
+            maindict[Yaml.string("disparityAutoRange")] = Yaml.bool(false)
             var struclight = [Yaml : Yaml]()
             struclight[Yaml.string("exposureDurations")] = Yaml.array([0.01,0.03,0.10].map{return Yaml.double($0)})
             struclight[Yaml.string("exposureISOs")] = Yaml.array([50.0,150.0,500.0].map{ return Yaml.double($0)})
@@ -99,6 +105,11 @@ class SceneSettings {
         self.minSWfilepath = minSWfilepath
         self.robotPathName = robotPathName
         self.yDisparityThreshold = yDisparityThreshold
+        self.disparityPyramidLevels = mainDict[Yaml.string("disparityPyramidLevels")]?.int ?? 0
+        self.disparityAutoRange = mainDict[Yaml.string("disparityAutoRange")]?.bool ?? false
+        if let roi = mainDict[Yaml.string("disparityROI")]?.array?.compactMap({ return $0.int }), roi.count == 4 {
+            self.disparityROI = roi
+        }
         
         self.strucExposureDurations = (mainDict[Yaml.string("struclight")]?.dictionary?[Yaml.string("exposureDurations")]?.array?.filter({return $0.double != nil}).map{
             (val: Yaml) -> Double in
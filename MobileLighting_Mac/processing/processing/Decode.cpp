@@ -16,85 +16,226 @@
 ///////////////////////////////////////////////////////////////////////////
 
 #include <math.h>
+#include <limits.h>
 #include "imageLib.h"
 #include <iostream>
 #include <fstream>
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <sys/stat.h>
 #include "Utils.h"
-#include "Debug.h"
+#include "Parallel.h"
+#include "RefineSIMD.h"
+#include "DecodeSIMD.h"
+#include "Decode.h"
 
 #define MAXCODES 1024
 
-int pixelToCode[MAXCODES];
-int codeToPixel[MAXCODES];
-
-// load code file
-/*
-void loadCodes(char* file){
-    int ncodes;
-    ifstream in(file, ios::binary | ios::in);
+// load the code table of a code file (e.g. minSW.dat): the number of codes n,
+// followed by pixelToCode[n] and codeToPixel[n], all as 4-byte ints.
+// returns codeToPixel, the stripe position of each code
+vector<int> loadCodeTable(const char *codefile)
+{
+    int ncodes = 0;
+    ifstream in(codefile, ios::binary | ios::in);
     if (! in.is_open())
-	throw CError("cannot open file %s\n", file);
+	throw CError("cannot open file %s", codefile);
 
     in.read((char*)&ncodes, 4);
-    if (ncodes > MAXCODES)
-	throw CError("too many codes\n");
+    if (! in || ncodes <= 0 || ncodes > MAXCODES)
+	throw CError("%s: bad number of codes %d", codefile, ncodes);
 
-    for (int i = 0; i < ncodes; i++) {
-	in.read((char*)&pixelToCode[i], 4);
-    }
-    for (int i =0 ; i < ncodes; i++) {
-	in.read((char*)&codeToPixel[i], 4);
-    }
+    vector<int> codeToPixel(ncodes);
+    in.seekg(4 + 4 * ncodes); // skip pixelToCode
+    in.read((char*)&codeToPixel[0], 4 * ncodes);
+    if (! in)
+	throw CError("%s: file too short", codefile);
+    return codeToPixel;
 }
-*/
-// store image 'im' as k-th bit in 'val'  (k==0 means least-significant bit)
-// if a pixel in 'im' has label 128 (unknown), mark corresponding pixel in 'unk'
-/*
-void store_bit(CByteImage im, CIntImage val, CIntImage unk, int k)
+
+// look up the stripe positions of n codes; codes not in the table (including CODE_UNKNOWN) give UNK
+static void codesToPixels(const unsigned int *code, int n, const vector<int> &codeToPixel, float *r)
 {
-    CShape sh = im.Shape();
-    int x, y, w = sh.width, h = sh.height;
+    unsigned int ncodes = (unsigned int)codeToPixel.size(); // < CODE_UNKNOWN
+    const int *table = &codeToPixel[0];
+    for (int x = 0; x < n; x++)
+	r[x] = (code[x] < ncodes) ? (float)table[code[x]] : UNK;
+}
 
-    unsigned int bit = (1 << k);
-    for (y = 0; y < h; y++) {
-        uchar *p = (uchar *)&im.Pixel(0, y, 0);
-        unsigned int *v = (unsigned int *)&val.Pixel(0, y, 0);
-        unsigned int *u = (unsigned int *)&unk.Pixel(0, y, 0);
-
-        for (x = 0; x < w; x++) {
-	    if (p[x] == 255)
-		v[x] |= bit;
-	    else if (p[x] == 128)
-		u[x] |= bit;
+// decode a stack of thresholded images, each labeled 0 (b), 128 (unknown), 255 (w),
+// where image k gives bit k of the code (k==0 means least-significant bit).
+// pixels with an unknown bit, or whose code is not in the table, get UNK.
+// replaces the old store_bit / decodeCode, which needed a pass over int images per bit
+void decodeCodeImages(vector<CByteImage> &ims, const vector<int> &codeToPixel, CFloatImage &result)
+{
+    int numIm = (int)ims.size();
+    if (numIm < 1 || numIm > MAXCODEBITS)
+	throw CError("decode: need between 1 and %d images", MAXCODEBITS);
+
+    CShape sh = ims[0].Shape();
+    for (int k = 0; k < numIm; k++) {
+	if (sh != ims[k].Shape() || sh.nBands != 1)
+	    throw CError("decode: all images need to have same size and 1 band");
+    }
+    result.ReAllocate(sh);
+
+    int w = sh.width, h = sh.height;
+    parallelFor(h, [&](int y0, int y1) {
+	vector<const unsigned char *> rows(numIm);
+	vector<unsigned int> code(w);
+	for (int y = y0; y < y1; y++) {
+	    for (int k = 0; k < numIm; k++)
+		rows[k] = &ims[k].Pixel(0, y, 0);
+	    packCodeBitsSIMD(&rows[0], numIm, w, &code[0]);
+	    codesToPixels(&code[0], w, codeToPixel, &result.Pixel(0, y, 0));
 	}
+    }, 16);
+}
+
+// threshold the difference of the normal and inverted exposures (1 band) of code bit k,
+// and OR the result into bit k of val (white) or unk (unknown), in one pass and without
+// a 0/128/255 image.  CPU version of smartThreshold.cikernel on the phone: pixels whose
+// neighbors across the stripes are clearly on opposite sides are stripe edges, and only
+// need the sign of their difference.  angle is the stripe angle (as in the metadata and
+// refine()), thresh is a fraction of 255 (the phone uses 0.035).
+// val and unk are (re)allocated and cleared if they don't have the image size
+void thresholdCodeBit(CByteImage &normal, CByteImage &inverted, double angle, float thresh, int k,
+		      CIntImage &val, CIntImage &unk)
+{
+    CShape sh = normal.Shape();
+    if (sh != inverted.Shape() || sh.nBands != 1)
+	throw CError("thresholdCodeBit: exposures need to have same size and 1 band");
+    if (k < 0 || k >= MAXCODEBITS)
+	throw CError("thresholdCodeBit: bit %d out of range", k);
+    if (val.Shape() != sh || unk.Shape() != sh) {
+	val.ReAllocate(sh);
+	val.ClearPixels();
+	unk.ReAllocate(sh);
+	unk.ClearPixels();
     }
+
+    // neighbor offset across the stripes, rounded as in smartThreshold.cikernel.
+    // the phone uses the direction of brightness change, which is angle + pi/2
+    double cx = -sin(angle), cy = cos(angle);
+    int dx = (fabs(cx) >= 0.5) ? (cx > 0 ? 1 : -1) : 0;
+    int dy = (fabs(cy) >= 0.5) ? (cy > 0 ? 1 : -1) : 0;
+    int t = (int)ceil(thresh * 255 - 1e-4); // differences are integers
+
+    int w = sh.width, h = sh.height;
+    parallelFor(h, [&](int y0, int y1) {
+	for (int y = y0; y < y1; y++) {
+	    ThresholdRows rows;
+	    rows.norm = &normal.Pixel(0, y, 0);
+	    rows.inv = &inverted.Pixel(0, y, 0);
+	    int inside = (y - abs(dy) >= 0 && y + abs(dy) < h);
+	    for (int i = 0; i < 2; i++) {
+		int yn = (i == 0) ? y + dy : y - dy;
+		rows.normNb[i] = inside ? &normal.Pixel(0, yn, 0) : NULL;
+		rows.invNb[i] = inside ? &inverted.Pixel(0, yn, 0) : NULL;
+	    }
+	    thresholdCodeBitSIMD(rows, dx, w, t, k,
+				 (unsigned int *)&val.Pixel(0, y, 0), (unsigned int *)&unk.Pixel(0, y, 0));
+	}
+    }, 16);
 }
-*/
-/*
-// decode binary codes.  val contains the code, unk contains the set of unknown bits.
-// TODO: could be smarter here by trying to disambiguate pixels where only one bit is 
-// uncertain
-void decodeCode(CIntImage val, CIntImage unk, CFloatImage &result)
+
+// decode the bit planes of thresholdCodeBit: pixels with an unknown bit, or whose code is
+// not in the table, get UNK
+void decodeCodeBits(CIntImage &val, CIntImage &unk, const vector<int> &codeToPixel, CFloatImage &result)
 {
     CShape sh = val.Shape();
+    if (sh != unk.Shape() || sh.nBands != 1)
+	throw CError("decodeCodeBits: val and unk need to have same size and 1 band");
     result.ReAllocate(sh);
 
-    int x, y, w = sh.width, h = sh.height;
-	
-    for (y = 0; y < h; y++) {
-	int *v = (int *)&val.Pixel(0, y, 0);
-	int *u = (int *)&unk.Pixel(0, y, 0);
-	float *r = (float *)&result.Pixel(0, y, 0);
-	for (x = 0; x < w; x++) {
-	    if (u[x] == 0)
-		r[x] = codeToPixel[v[x]];
-	    else
-		r[x] = UNK; // uncertain pixel
+    int w = sh.width, h = sh.height;
+    parallelFor(h, [&](int y0, int y1) {
+	vector<unsigned int> code(w);
+	for (int y = y0; y < y1; y++) {
+	    unsigned int *v = (unsigned int *)&val.Pixel(0, y, 0);
+	    unsigned int *u = (unsigned int *)&unk.Pixel(0, y, 0);
+	    for (int x = 0; x < w; x++)
+		code[x] = u[x] ? CODE_UNKNOWN : v[x];
+	    codesToPixels(&code[0], w, codeToPixel, &result.Pixel(0, y, 0));
 	}
+    }, 16);
+}
+
+// read numIm thresholded images (bit 0 first), decode them with the code table in codefile,
+// and save the result as outdir/result<posID><u|v>-0initial.pfm, the input of refine()
+CFloatImage decodeThresholded(char *outdir, char *codefile, int direction, char **imList, int numIm, char *posID)
+{
+    int verbose = 1;
+    char filename[1000];
+    CFloatImage fval;
+
+    vector<int> codeToPixel = loadCodeTable(codefile);
+
+    vector<CByteImage> ims(numIm);
+    parallelFor(numIm, [&](int i0, int i1) {
+	for (int i = i0; i < i1; i++)
+	    ReadImageVerb(ims[i], imList[i], verbose);
+    });
+
+    decodeCodeImages(ims, codeToPixel, fval);
+
+    sprintf(filename, "%s/result%s%c-0initial.pfm", outdir, posID, direction == 0 ? 'u' : 'v');
+    WriteImageVerb(fval, filename, verbose);
+    return fval;
+}
+
+// gray image as the equal average of R, G and B, matching the grayscale step on the
+// phone (rgbWeights 1/3, 1/3, 1/3) rather than the luma weights of ConvertToGray
+static CByteImage averageGray(CByteImage &src)
+{
+    CShape sh = src.Shape();
+    if (sh.nBands < 3)
+	throw CError("averageGray: need a color image");
+    CByteImage dst(sh.width, sh.height, 1);
+    for (int y = 0; y < sh.height; y++) {
+	unsigned char *s = &src.Pixel(0, y, 0);
+	unsigned char *d = &dst.Pixel(0, y, 0);
+	for (int x = 0; x < sh.width; x++, s += sh.nBands)
+	    d[x] = (unsigned char)((s[0] + s[1] + s[2] + 1) / 3);
     }
+    return dst;
 }
 
-*/
+// same from the raw exposures: normalList[k] and invertedList[k] are the normal and inverted
+// exposure of bit k (color images are averaged to gray like on the phone).  they are
+// thresholded with thresholdCodeBit one pair at a time, so only one pair is in memory
+CFloatImage decodeExposures(char *outdir, char *codefile, int direction, char **normalList, char **invertedList,
+			    int numIm, double angle, float thresh, char *posID)
+{
+    int verbose = 1;
+    char filename[1000];
+    CIntImage val, unk;
+    CFloatImage fval;
+
+    if (numIm < 1 || numIm > MAXCODEBITS)
+	throw CError("decode: need between 1 and %d exposure pairs", MAXCODEBITS);
+    vector<int> codeToPixel = loadCodeTable(codefile);
+
+    for (int k = 0; k < numIm; k++) {
+	CByteImage ims[2];
+	parallelFor(2, [&](int i0, int i1) {
+	    for (int i = i0; i < i1; i++) {
+		ReadImageVerb(ims[i], i == 0 ? normalList[k] : invertedList[k], verbose);
+		if (ims[i].Shape().nBands != 1)
+		    ims[i] = averageGray(ims[i]);
+	    }
+	});
+	thresholdCodeBit(ims[0], ims[1], angle, thresh, k, val, unk);
+    }
+    decodeCodeBits(val, unk, codeToPixel, fval);
+
+    sprintf(filename, "%s/result%s%c-0initial.pfm", outdir, posID, direction == 0 ? 'u' : 'v');
+    WriteImageVerb(fval, filename, verbose);
+    return fval;
+}
 
 // fill holes in a line of code map
 void fillCodeHolesLine(float *val, int stride, int n, int maxwidth, int maxborderdiff)
@@ -122,22 +263,41 @@ void fillCodeHolesLine(float *val, int stride, int n, int maxwidth, int maxborde
     }
 }
 
+#define FILL_STRIP 32 // number of columns transposed at once by fillCodeHoles
+
 // fill holes in code map. if directon==0, in x direction, else in y direction
+// columns are filled in strips of FILL_STRIP columns that are transposed into
+// contiguous rows first, rather than walking down each column of a wide image
 void fillCodeHoles(CFloatImage im0, int maxwidth, float maxborderdiff, int direction)
 {
     CShape sh = im0.Shape();
-    int x, y, w = sh.width, h = sh.height;
+    int w = sh.width, h = sh.height;
     int stride;
 
     if (direction==0) { // x direction
 	stride = 1;
-	for (y = 0; y < h; y++) {
-	    float *val = &im0.Pixel(0, y, 0);
-	    fillCodeHolesLine(val, stride, w, maxwidth, maxborderdiff);
-	}
-    } else { // y direction
+	parallelFor(h, [&](int y0, int y1) {
+	    for (int y = y0; y < y1; y++) {
+		float *val = &im0.Pixel(0, y, 0);
+		fillCodeHolesLine(val, stride, w, maxwidth, maxborderdiff);
+	    }
+	});
+    } else if (sh.nBands == 1) { // y direction
         stride = (int) (&im0.Pixel(0, 1, 0) - &im0.Pixel(0, 0, 0));
-	for (x = 0; x < w; x++) {
+	parallelFor(w, [&](int x0, int x1) {
+	    vector<float> buf(FILL_STRIP * h);
+	    for (int xs = x0; xs < x1; xs += FILL_STRIP) {
+		int nx = min(FILL_STRIP, x1 - xs);
+		float *val = &im0.Pixel(xs, 0, 0);
+		transposeBlock(val, stride, &buf[0], h, nx, h);
+		for (int k = 0; k < nx; k++)
+		    fillCodeHolesLine(&buf[k * h], 1, h, maxwidth, maxborderdiff);
+		transposeBlock(&buf[0], h, val, stride, h, nx);
+	    }
+	}, FILL_STRIP);
+    } else { // y direction, bands interleaved
+        stride = (int) (&im0.Pixel(0, 1, 0) - &im0.Pixel(0, 0, 0));
+	for (int x = 0; x < w; x++) {
 	    float *val = &im0.Pixel(x, 0, 0);
 	    fillCodeHolesLine(val, stride, h, maxwidth, maxborderdiff);
 	}
@@ -208,7 +368,8 @@ void refineCodesLine(float *v, float *f, int stride, int n0, int rad, float maxg
 
 // refine codes using a planar fitting approach
 // created by Nicholas Mosier, 06/05/2018
-void refineCodesPlanePixel(CFloatImage val, CFloatImage &fval, int x0, int y0, int rad, float maxdiff, int minsupport)
+// (reference version for a single pixel; refineCodesPlanar below does the whole image)
+void refineCodesPlanePixel(CFloatImage &val, CFloatImage &fval, int x0, int y0, int rad, float maxdiff, int minsupport)
 {
 	CShape sh = val.Shape();
 	int w = sh.width, h = sh.height;
@@ -246,15 +407,212 @@ void refineCodesPlanePixel(CFloatImage val, CFloatImage &fval, int x0, int y0, i
 	}
 }
 
+// per-column sums over the rows of the current window, used by refineCodesPlanar
+struct PlaneColSums
+{
+    double n, sy, syy, sz, syz;
+};
+
+// planar refinement of all pixels (same as refineCodesPlanePixel for each pixel), traversing
+// the image row by row.  the plane fit uses running sums that are updated incrementally as
+// the window slides: column sums when moving down a row, window sums when moving right.
+// only the support count needs to visit the window pixels, and nothing is allocated per pixel.
+// sums use coordinates relative to the image origin, fit is done relative to the center pixel.
+void refineCodesPlanar(CFloatImage &val, CFloatImage &fval, int rad, float maxdiff, int minsupport)
+{
+    CShape sh = val.Shape();
+    int w = sh.width, h = sh.height;
+
+    // split into bands of rows, each with its own column sums
+    parallelFor(h, [&](int ystart, int yend) {
+        vector<PlaneColSums> col(w);
+        for (int x = 0; x < w; x++)
+            col[x].n = col[x].sy = col[x].syy = col[x].sz = col[x].syz = 0;
+
+        // add (sign=1) or remove (sign=-1) row y to/from column sums
+        auto updateRow = [&](int y, double sign) {
+            float *v = &val.Pixel(0, y, 0);
+            for (int x = 0; x < w; x++) {
+                float z = v[x];
+                if (z == UNK)
+                    continue;
+                PlaneColSums &c = col[x];
+                c.n += sign;
+                c.sy += sign * y;
+                c.syy += sign * y * y;
+                c.sz += sign * z;
+                c.syz += sign * y * z;
+            }
+        };
+
+        for (int y = max(0, ystart-rad); y < min(h, ystart+rad); y++)
+            updateRow(y, 1);
+
+        for (int y0 = ystart; y0 < yend; y0++) {
+            // column sums now cover rows y0-rad .. y0+rad
+            if (y0 + rad < h)
+                updateRow(y0 + rad, 1);
+            if (y0 > ystart && y0 - rad - 1 >= 0)
+                updateRow(y0 - rad - 1, -1);
+            int ya = max(0, y0-rad), yb = min(h-1, y0+rad);
+
+            double s1 = 0, sx = 0, sy = 0, sz = 0, sxx = 0, sxy = 0, sxz = 0, syy = 0, syz = 0;
+            // add (sign=1) or remove (sign=-1) column x to/from window sums
+            auto updateCol = [&](int x, double sign) {
+                PlaneColSums &c = col[x];
+                if (c.n == 0)
+                    return;
+                s1 += sign * c.n;
+                sx += sign * x * c.n;
+                sxx += sign * x * x * c.n;
+                sy += sign * c.sy;
+                sxy += sign * x * c.sy;
+                syy += sign * c.syy;
+                sz += sign * c.sz;
+                sxz += sign * x * c.sz;
+                syz += sign * c.syz;
+            };
+            for (int x = 0; x < min(w, rad); x++)
+                updateCol(x, 1);
+
+            float *f = &fval.Pixel(0, y0, 0);
+            float *v0 = &val.Pixel(0, y0, 0);
+            for (int x0 = 0; x0 < w; x0++) {
+                if (x0 + rad < w)
+                    updateCol(x0 + rad, 1);
+                if (x0 - rad - 1 >= 0)
+                    updateCol(x0 - rad - 1, -1);
+                int xa = max(0, x0-rad), xb = min(w-1, x0+rad);
+
+                // shift sums to coordinates relative to center pixel (x0, y0)
+                double su = sx - s1 * x0;
+                double sv = sy - s1 * y0;
+                double suu = sxx - 2 * x0 * sx + s1 * x0 * x0;
+                double svv = syy - 2 * y0 * sy + s1 * y0 * y0;
+                double suv = sxy - x0 * sy - y0 * sx + s1 * x0 * y0;
+                double suz = sxz - x0 * sz;
+                double svz = syz - y0 * sz;
+
+                float a, b, c;	// constants for fitted plane z = ax + by + c
+                fitPlaneSums(s1, su, sv, sz, suu, suv, suz, svv, svz, a, b, c);
+
+                int cnt = 0;
+                for (int y = ya; y <= yb; y++) {
+                    float *v = &val.Pixel(0, y, 0);
+                    float zy = b * (y - y0) + c;
+                    for (int x = xa; x <= xb; x++) {
+                        float z = v[x];
+                        if (z != UNK && fabs(z - (a * (x - x0) + zy)) <= maxdiff)
+                            cnt++;
+                    }
+                }
+
+                f[x0] = (cnt >= minsupport) ? c : v0[x0];
+            }
+        }
+    }, 2 * rad + 1);
+}
+
+// refine all rows (direction 0) or all columns (direction 1) with refineCodesLine
+// if pixels are contiguous, use the vectorized version, which refines several
+// pixels of a row (or several columns, going down row by row) at once
+static void refineCodesRowsCols(CFloatImage &val, CFloatImage &fval, int direction, int rad, float maxgrad)
+{
+    CShape sh = val.Shape();
+    int w = sh.width, h = sh.height;
+    int pixstride = (int) (&val.Pixel(1, 0, 0) - &val.Pixel(0, 0, 0));
+    int rowstride = (int) (&val.Pixel(0, 1, 0) - &val.Pixel(0, 0, 0));
+    // assume that f has same stride!
+    RefineTaps taps(rad, maxgrad);
+
+    if (direction == 0) {
+        parallelFor(h, [&](int y0, int y1) {
+            for (int y = y0; y < y1; y++) {
+                float *v = &val.Pixel(0, y, 0);
+                float *f = &fval.Pixel(0, y, 0);
+                if (pixstride == 1)
+                    refineCodesRowSIMD(v, f, w, taps);
+                else
+                    refineCodesLine(v, f, pixstride, w, rad, maxgrad);
+            }
+        });
+    } else if (pixstride == 1) {
+        // blocks of columns, each processed row by row
+        parallelFor(w, [&](int x0, int x1) {
+            for (int y = 0; y < h; y++)
+                refineCodesColumnsSIMD(&val.Pixel(x0, y, 0), &fval.Pixel(x0, y, 0), rowstride, x1 - x0, y, h, taps);
+        }, 64);
+    } else {
+        parallelFor(w, [&](int x0, int x1) {
+            for (int x = x0; x < x1; x++) {
+                float *v = &val.Pixel(x, 0, 0);
+                float *f = &fval.Pixel(x, 0, 0);
+                refineCodesLine(v, f, rowstride, h, rad, maxgrad);
+            }
+        });
+    }
+}
+
+#define DIAG_BAND 32 // number of diagonals gathered at once by refineCodesDiagonals
+
+// refine all diagonals (dir = 1: x - y = const, dir = -1: x + y = const) with refineCodesLine,
+// going down each diagonal.  Diagonals c0..c0+DIAG_BAND-1 share contiguous runs of pixels
+// in each row, so a band of them is gathered row by row into contiguous buffers, refined
+// with the vectorized row version, and scattered back the same way
+static void refineCodesDiagonals(CFloatImage &val, CFloatImage &fval, int dir, int rad, float maxgrad)
+{
+    CShape sh = val.Shape();
+    int w = sh.width, h = sh.height;
+    RefineTaps taps(rad, maxgrad);
+    int len = min(w, h);        // maximal length of a diagonal
+    int cmin = (dir == 1) ? -(h-1) : 0;
+    // pixel (c + dir*y, y) is on diagonal c; it spans rows ystart(c) .. yend(c)-1
+    auto ystart = [&](int c) { return (dir == 1) ? max(0, -c) : max(0, c - w + 1); };
+    auto yend = [&](int c) { return (dir == 1) ? min(h, w - c) : min(h, c + 1); };
+
+    parallelFor(w + h - 1, [&](int i0, int i1) {
+        vector<float> vbuf(DIAG_BAND * len), fbuf(DIAG_BAND * len);
+        for (int b0 = i0; b0 < i1; b0 += DIAG_BAND) {
+            int c0 = cmin + b0;
+            int c1 = cmin + min(i1, b0 + DIAG_BAND);
+            int y0 = ystart(dir == 1 ? c1 - 1 : c0);
+            int y1 = yend(dir == 1 ? c0 : c1 - 1);
+            // diagonals of the band that are in row y: 0 <= c + dir*y < w
+            auto crange = [&](int y, int &ca, int &cb) {
+                ca = max(c0, (dir == 1) ? -y : y);
+                cb = min(c1, (dir == 1) ? w - y : w + y);
+            };
+            for (int y = y0; y < y1; y++) {
+                int ca, cb;
+                crange(y, ca, cb);
+                float *v = &val.Pixel(0, y, 0);
+                for (int c = ca; c < cb; c++)
+                    vbuf[(c - c0) * len + y - ystart(c)] = v[c + dir * y];
+            }
+            for (int c = c0; c < c1; c++)
+                refineCodesRowSIMD(&vbuf[(c - c0) * len], &fbuf[(c - c0) * len], yend(c) - ystart(c), taps);
+            for (int y = y0; y < y1; y++) {
+                int ca, cb;
+                crange(y, ca, cb);
+                float *f = &fval.Pixel(0, y, 0);
+                for (int c = ca; c < cb; c++)
+                    f[c + dir * y] = fbuf[(c - c0) * len + y - ystart(c)];
+            }
+        }
+    }, DIAG_BAND);
+}
+
 // refine codes using angle of prominent stripe direction
-// - mode: determines refinement algorithm to use
-void refineCodes(CFloatImage val, CFloatImage &fval, int rad, float maxgrad, double angle)
+// - params.mode: determines refinement algorithm to use
+// lines (rows, columns, diagonals) and planar windows are independent, so they are
+// split across threads with parallelFor; the result is the same as the serial version
+void refineCodes(CFloatImage val, CFloatImage &fval, int rad, float maxgrad, double angle, const RefineParams &params)
 {
     CShape sh = val.Shape();
     fval.ReAllocate(sh);
-    int x, y, w = sh.width, h = sh.height;
+    int w = sh.width, h = sh.height;
 	
-	switch (refine_mode) {
+	switch (params.mode) {
 	case refine_old:
 	{
 		double dx, dy;
@@ -266,25 +624,7 @@ void refineCodes(CFloatImage val, CFloatImage &fval, int rad, float maxgrad, dou
 		else
 			direction = 1;
 		
-		if (direction == 0) {
-			for (y = 0; y < h; y++) {
-		    float *v = &val.Pixel(0, y, 0);
-		    float *f = &fval.Pixel(0, y, 0);
-		        int stride = (int) (&val.Pixel(1, 0, 0) - &val.Pixel(0, 0, 0));
-		        // assume that f has same stride!
-		    //int debugy = (y == 617) ? y : 0;
-		        refineCodesLine(v, f, stride, w, rad, maxgrad); //, debugy);
-		    }
-		} else {
-			for (x = 0; x < w; x++) {
-		    float *v = &val.Pixel(x, 0, 0);
-		    float *f = &fval.Pixel(x, 0, 0);	
-	        int stride = (int) (&val.Pixel(0, 1, 0) - &val.Pixel(0, 0, 0));
-		        // assume that f has same stride!
-		    //int debugy = (x == 998) ? x : 0;
-	        refineCodesLine(v, f, stride, h, rad, maxgrad); //, debugy);
-		    }
-		}
+		refineCodesRowsCols(val, fval, direction, rad, maxgrad);
 		break;
 	}
     case refine_angle:
@@ -295,55 +635,48 @@ void refineCodes(CFloatImage val, CFloatImage &fval, int rad, float maxgrad, dou
 			dy = -dy;
 		}
 		
-		int stride;
-		float *v, *f;
 		if (dx == 1 && dy == 0) {
-			stride = (int) (&val.Pixel(1, 0, 0) - &val.Pixel(0, 0, 0));
-			for (y = 0; y < h; ++y) {
-				v = &val.Pixel(0, y, 0);
-				f = &fval.Pixel(0, y, 0);
-				refineCodesLine(v, f, stride, w, rad, maxgrad);
-			}	
+			refineCodesRowsCols(val, fval, 0, rad, maxgrad);
 		} else if (dx == 0 && dy == 1) {
-			stride = (int) (&val.Pixel(0, 1, 0) - &val.Pixel(0, 0, 0));
-			for (x = 0; x < w; ++x) {
-				v = &val.Pixel(x, 0, 0);
-				f = &fval.Pixel(x, 0, 0);
-				refineCodesLine(v, f, stride, h, rad, maxgrad);
-			}
+			refineCodesRowsCols(val, fval, 1, rad, maxgrad);
 		} else if (dx == 1 && dy == 1) {
 			int rad_adj = round(rad / sqrt(2));	// adjust rad & maxgrad, since compared pixels are now sqrt(2) distance apart
 			float maxgrad_adj = maxgrad * 2;//sqrt(2);
-			stride = (int) (&val.Pixel(1, 1, 0) - &val.Pixel(0, 0, 0));
-			for (x = 0; x < w; ++x) {
-				v = &val.Pixel(x, 0, 0);
-				f = &fval.Pixel(x, 0, 0);
-				int n = min(w-x, h);	// the maximum number of windows (center pixels) to consider
-				refineCodesLine(v, f, stride, n, rad_adj, maxgrad_adj);
-			}
-			for (y = 1; y < h; ++y) {		// don't count (0,0) twice
-				v = &val.Pixel(0, y, 0);
-				f = &fval.Pixel(0, y, 0);
-				int n = min(w, h-y);
-				refineCodesLine(v, f, stride, n, rad_adj, maxgrad_adj);
+			int stride = (int) (&val.Pixel(1, 1, 0) - &val.Pixel(0, 0, 0));
+			if (sh.nBands == 1) {
+				refineCodesDiagonals(val, fval, 1, rad_adj, maxgrad_adj);
+				break;
 			}
+			// diagonals start at (x, 0) for x = 0..w-1 and at (0, y) for y = 1..h-1
+			parallelFor(w + h - 1, [&](int i0, int i1) {
+				for (int i = i0; i < i1; ++i) {
+					int x = (i < w) ? i : 0;
+					int y = (i < w) ? 0 : i - w + 1;
+					float *v = &val.Pixel(x, y, 0);
+					float *f = &fval.Pixel(x, y, 0);
+					int n = min(w-x, h-y);	// the maximum number of windows (center pixels) to consider
+					refineCodesLine(v, f, stride, n, rad_adj, maxgrad_adj);
+				}
+			});
 		} else if (dx == -1 && dy == 1) {
 			int rad_adj = round(rad / sqrt(2));	// adjust rad & maxgrad, since compared pixels are now sqrt(2) distance apart
 			float maxgrad_adj = maxgrad * 2; //sqrt(2);
-			stride = (int) (&val.Pixel(0, 1, 0) - &val.Pixel(1, 0, 0));
-			for (x = 0; x < w; ++x) {
-				v = &val.Pixel(x, 0, 0);
-				f = &fval.Pixel(x, 0, 0);
-				int n = min(x+1, h);	// the maximum number of windows (center pixels) to consider
-				refineCodesLine(v, f, stride, n, rad_adj, maxgrad_adj);
-			}
-			for (y = 1; y < h; ++y) {
-				//printf("refining line %d\n", y);
-				v = &val.Pixel(w-1, y, 0);
-				f = &fval.Pixel(w-1, y, 0);
-				int n = min(w, h-y);
-				refineCodesLine(v, f, stride, n, rad_adj, maxgrad_adj);
+			int stride = (int) (&val.Pixel(0, 1, 0) - &val.Pixel(1, 0, 0));
+			if (sh.nBands == 1) {
+				refineCodesDiagonals(val, fval, -1, rad_adj, maxgrad_adj);
+				break;
 			}
+			// anti-diagonals start at (x, 0) for x = 0..w-1 and at (w-1, y) for y = 1..h-1
+			parallelFor(w + h - 1, [&](int i0, int i1) {
+				for (int i = i0; i < i1; ++i) {
+					int x = (i < w) ? i : w-1;
+					int y = (i < w) ? 0 : i - w + 1;
+					float *v = &val.Pixel(x, y, 0);
+					float *f = &fval.Pixel(x, y, 0);
+					int n = min(x+1, h-y);	// the maximum number of windows (center pixels) to consider
+					refineCodesLine(v, f, stride, n, rad_adj, maxgrad_adj);
+				}
+			});
 		} else {
 			char error[100];
 			sprintf(error, "refine: unsupported direction (%d, %d)", dx, dy);
@@ -353,15 +686,11 @@ void refineCodes(CFloatImage val, CFloatImage &fval, int rad, float maxgrad, dou
 	}
 	case refine_planar:
 	{
-		// refine_plane_windowsize is height & width of window
-		int rad = (refine_plane_windowsize-1)/2;
-		float maxdiff = refine_plane_maxdiff;
-		int minsupport = refine_plane_minsupport;
-		for (x = 0; x < w; ++x) {
-			for (y = 0; y < h; ++y) {
-				refineCodesPlanePixel(val, fval, x, y, rad, maxdiff, minsupport);
-			}
-		}
+		// plane_windowsize is height & width of window
+		int rad = (params.plane_windowsize-1)/2;
+		float maxdiff = params.plane_maxdiff;
+		int minsupport = params.plane_minsupport;
+		refineCodesPlanar(val, fval, rad, maxdiff, minsupport);
 		break;
 	}
 	default:
@@ -405,7 +734,9 @@ void fval2rgb(int N, CFloatImage val, CByteImage &result)
 // new filter with different idea: require certain fraction (1/4?) of pixels with almost identical 
 // code (+/- maxdiff) in window.  should better filter out isolated pixels.
 // DS 11/25/2013
-void filter(CFloatImage val, int radius, float fraction, float maxdiff)
+// (direct version, scans whole window for each pixel.  filter() below gives the same
+// results much faster; this one is still used for tiny windows and huge code ranges)
+void filter_slow(CFloatImage val, int radius, float fraction, float maxdiff, int verbose = 1)
 {
     CShape sh = val.Shape();
     int w = sh.width, h = sh.height;
@@ -450,7 +781,217 @@ void filter(CFloatImage val, int radius, float fraction, float maxdiff)
             val.Pixel(x, y, 0) = tmp.Pixel(x, y, 0);
         }
     }
-    printf("%d pixels filtered (%.3f%%)\n", nfiltered, (float)nfiltered * 100.0 / (w * h));
+    if (verbose)
+        printf("%d pixels filtered (%.3f%%)\n", nfiltered, (float)nfiltered * 100.0 / (w * h));
+}
+
+#define FILTER_SEGBINS 32	// number of histogram bins brought up to date together
+#define FILTER_KEEPBINS (1 << 20)	// larger column histogram buffers are freed after each call (2MB)
+
+// histogram state for filter(): per-column histograms of quantized code values over the
+// current rows y-radius..y+radius, and a window histogram over columns x-radius..x+radius
+// that is kept in segments of FILTER_SEGBINS bins, each updated only when it is needed
+struct FilterHist
+{
+    int w, nbins, radius;
+    unsigned short *colhist;		// colhist[x * nbins + b]
+    vector<int> winhist;			// window histogram
+    vector<int> stamp;				// column x each segment of winhist is valid for
+
+    // bring segment seg of the window histogram up to date for window centered at x
+    void sync(int seg, int x) {
+        int s = stamp[seg];
+        if (s == x)
+            return;
+        int *hb = &winhist[seg * FILTER_SEGBINS];
+        if (x - s <= radius) { // cheaper to add and remove the columns that moved in and out
+            for (int t = s+1; t <= x; t++) {
+                if (t + radius < w) {
+                    unsigned short *c = &colhist[(t + radius) * nbins + seg * FILTER_SEGBINS];
+                    for (int k = 0; k < FILTER_SEGBINS; k++)
+                        hb[k] += c[k];
+                }
+                if (t - radius - 1 >= 0) {
+                    unsigned short *c = &colhist[(t - radius - 1) * nbins + seg * FILTER_SEGBINS];
+                    for (int k = 0; k < FILTER_SEGBINS; k++)
+                        hb[k] -= c[k];
+                }
+            }
+        } else { // rebuild from all columns in window
+            for (int k = 0; k < FILTER_SEGBINS; k++)
+                hb[k] = 0;
+            for (int t = max(0, x - radius); t <= min(w-1, x + radius); t++) {
+                unsigned short *c = &colhist[t * nbins + seg * FILTER_SEGBINS];
+                for (int k = 0; k < FILTER_SEGBINS; k++)
+                    hb[k] += c[k];
+            }
+        }
+        stamp[seg] = x;
+    }
+};
+
+// same as filter_slow, but the number of values within maxdiff of p0 is found at a fixed cost
+// per pixel, independent of radius, using sliding column histograms with bins of width maxdiff/8.
+// bins that are certainly within maxdiff of p0 give a lower bound on the count, bins that
+// possibly are give an upper bound; only if the two bounds lead to different decisions is
+// the window scanned directly.  results are identical to filter_slow.
+void filter(CFloatImage val, int radius, float fraction, float maxdiff, int verbose = 1)
+{
+    CShape sh = val.Shape();
+    int w = sh.width, h = sh.height;
+
+    if (radius <= 2) { // direct scan is faster for tiny windows
+        filter_slow(val, radius, fraction, maxdiff, verbose);
+        return;
+    }
+
+    // range of code values determines number of bins
+    float vmin = INFINITY, vmax = -INFINITY;
+    for (int y = 0; y < h; y++) {
+        float *v = &val.Pixel(0, y, 0);
+        for (int x = 0; x < w; x++) {
+            if (v[x] != UNK) {
+                vmin = min(vmin, v[x]);
+                vmax = max(vmax, v[x]);
+            }
+        }
+    }
+    // use bin width maxdiff/8, or wider to limit column histograms to 64MB.  need
+    // at most maxdiff/4 so that the center pixel is always among the certain bins
+    double maxbins = min(1 << 16, (1 << 25) / max(1, w));
+    float q = max(maxdiff / 8, (float)((vmax - vmin) / (maxbins - 2)));
+    double nb = (vmax - vmin) / q + 1;
+    if (!(maxdiff > 0) || !isfinite(vmin) || !isfinite(vmax) || q > maxdiff / 4 || nb > maxbins
+        || 2 * radius + 1 > 65535) {
+        filter_slow(val, radius, fraction, maxdiff, verbose);
+        return;
+    }
+    int nseg = ((int)nb + FILTER_SEGBINS) / FILTER_SEGBINS;
+
+    FilterHist hist;
+    hist.w = w;
+    hist.radius = radius;
+    hist.nbins = nseg * FILTER_SEGBINS;
+    // the column histograms live in a per-thread buffer that is all zero between calls (the rows
+    // still counted are removed again at the end), so it only needs clearing when it grows.
+    // this matters when filter is called for many small tiles (see refineTiled).  buffers for
+    // large images are freed at the end, so that they don't stay allocated in every thread
+    static thread_local vector<unsigned short> colhistbuf;
+    if (colhistbuf.size() < (size_t)w * hist.nbins)
+        colhistbuf.assign((size_t)w * hist.nbins, 0);
+    hist.colhist = &colhistbuf[0];
+    hist.winhist.assign(hist.nbins, 0);
+    hist.stamp.resize(nseg);
+
+    // keep a copy of the input (which the window counts refer to), and bin index of each pixel
+    CFloatImage src(sh);
+    CIntImage bin(w, h, 1);
+    for (int y = 0; y < h; y++) {
+        float *v = &val.Pixel(0, y, 0);
+        memcpy(&src.Pixel(0, y, 0), v, w * sizeof(float));
+        int *b = &bin.Pixel(0, y, 0);
+        for (int x = 0; x < w; x++)
+            b[x] = (v[x] == UNK) ? -1 : (int)floor((v[x] - vmin) / q);
+    }
+
+    vector<int> colcnt(w, 0); // number of non-UNK values in each column
+    int ylo = 0, yhi = -1;    // rows currently included in column histograms
+    int nfiltered = 0;
+
+    for (int y = 0; y < h; y++) {
+        // slide column histograms down to rows y-radius .. y+radius
+        while (yhi < min(h-1, y + radius)) {
+            yhi++;
+            int *b = &bin.Pixel(0, yhi, 0);
+            for (int x = 0; x < w; x++) {
+                if (b[x] >= 0) {
+                    hist.colhist[x * hist.nbins + b[x]]++;
+                    colcnt[x]++;
+                }
+            }
+        }
+        while (ylo < y - radius) {
+            int *b = &bin.Pixel(0, ylo, 0);
+            for (int x = 0; x < w; x++) {
+                if (b[x] >= 0) {
+                    hist.colhist[x * hist.nbins + b[x]]--;
+                    colcnt[x]--;
+                }
+            }
+            ylo++;
+        }
+        for (int s = 0; s < nseg; s++)
+            hist.stamp[s] = INT_MIN / 2; // all segments need rebuilding
+
+        int wintotal = 0; // number of non-UNK values in window
+        for (int x = 0; x < min(w, radius); x++)
+            wintotal += colcnt[x];
+
+        float *p = &src.Pixel(0, y, 0);
+        float *out = &val.Pixel(0, y, 0);
+        for (int x = 0; x < w; x++) {
+            if (x + radius < w)
+                wintotal += colcnt[x + radius];
+            if (x - radius - 1 >= 0)
+                wintotal -= colcnt[x - radius - 1];
+
+            float p0 = p[x];
+            if (p0 == UNK)
+                continue;
+            int total = wintotal - 1; // don't count center pixel
+
+            // bins k1+2 .. k2-2 are certainly within maxdiff of p0, k1-1 .. k2+1 possibly
+            int k1 = (int)floor((p0 - maxdiff - vmin) / q);
+            int k2 = (int)floor((p0 + maxdiff - vmin) / q);
+            int b1 = max(0, k1 - 1), b2 = min(hist.nbins - 1, k2 + 1);
+            for (int s = b1 / FILTER_SEGBINS; s <= b2 / FILTER_SEGBINS; s++)
+                hist.sync(s, x);
+            int lo = 0, hi = 0;
+            for (int k = b1; k <= b2; k++) {
+                int c = hist.winhist[k];
+                hi += c;
+                if (k >= k1 + 2 && k <= k2 - 2)
+                    lo += c;
+            }
+            lo--; // center pixel is always counted
+            hi--;
+
+            int cut;
+            if (hi < fraction * total || hi < 3)
+                cut = 1;
+            else if (!(lo < fraction * total || lo < 3))
+                cut = 0;
+            else { // undecided, count directly
+                int cnt = 0;
+                for (int py = max(0, y-radius); py <= min(h-1, y+radius); py++) {
+                    float *pr = &src.Pixel(0, py, 0);
+                    for (int px = max(0, x-radius); px <= min(w-1, x+radius); px++) {
+                        if (px == x && py == y)
+                            continue;
+                        float pp = pr[px];
+                        if (pp != UNK && fabs(pp-p0) <= maxdiff)
+                            cnt++;
+                    }
+                }
+                cut = (cnt < fraction * total || cnt < 3);
+            }
+            if (cut) {
+                out[x] = UNK;
+                nfiltered++;
+            }
+        }
+    }
+    for (; ylo <= yhi; ylo++) { // leave column histograms cleared
+        int *b = &bin.Pixel(0, ylo, 0);
+        for (int x = 0; x < w; x++) {
+            if (b[x] >= 0)
+                hist.colhist[x * hist.nbins + b[x]]--;
+        }
+    }
+    if (colhistbuf.size() > FILTER_KEEPBINS)
+        vector<unsigned short>().swap(colhistbuf);
+    if (verbose)
+        printf("%d pixels filtered (%.3f%%)\n", nfiltered, (float)nfiltered * 100.0 / (w * h));
 }
 
 //erases foreground object from fval
@@ -471,66 +1012,252 @@ void foregroundErase(CFloatImage fval, CByteImage mask)
 }
 
 
+RefineParams defaultRefineParams(void)
+{
+	RefineParams p;
+	p.filter_radius = 4;
+	p.filter_fraction = 0.25;
+	p.filter_maxdiff = 4.0;
+	//p.fill_maxwidth = 7; // since higher resolution, try filling larger holes
+	p.fill_maxwidth = 5; // nope, back to 5 pixels, seems to be a good compromise
+	p.fill_maxborderdiff[0] = 2; // still sometimes need 2, e.g. Newkuba/P4 on the lamp
+	p.fill_maxborderdiff[1] = 0;
+	p.fill_maxborderdiff[2] = 1;
+	p.mode = refine_old;
+	//p.refine_radius = 3;
+	p.refine_radius = 7; // try larger radius since higher resolution
+	p.maxgrad0 = 1.0;
+	p.maxgrad1 = 0.1;
+	p.plane_windowsize = 5;
+	p.plane_minsupport = 20;
+	p.plane_maxdiff = 2.0;
+	// run refine() tile by tile: same results, and each tile stays in cache, but the halos are
+	// computed twice.  pays off only when many cores make the whole-image passes memory bound
+	p.tiled = 0;
+	p.artifacts = artifacts_all;
+	p.async_writes = 1;
+	return p;
+}
+
+// each pixel of the result of refineStages only depends on pixels at most this far away:
+// filter, three hole-filling passes (holes of up to fill_maxwidth pixels plus their borders),
+// and two refinement passes
+static int refineHalo(const RefineParams &params)
+{
+	int refinerad = max(params.refine_radius, (params.plane_windowsize-1)/2);
+	return params.filter_radius + 3 * (params.fill_maxwidth + 1) + 2 * refinerad;
+}
+
+#define REFINE_TILE 256 // size of tiles of fused refine pipeline (without halo)
+
+// filter, fill holes, and refine codes in fval; fval1 and fval2 are the results of the
+// first and second refinement.  stageDone(1, fval) is called after filtering,
+// stageDone(2, fval) after filling holes
+static void refineStages(CFloatImage &fval, CFloatImage &fval1, CFloatImage &fval2, int direction, double angle,
+                         const RefineParams &params, int verbose, const function<void(int, CFloatImage &)> &stageDone)
+{
+	// FILTER
+	// filter to remove isolated pixels with different code values
+	if (verbose) printf("Filtering image with radius %d, fraction %g, and maxdiff %g\n", params.filter_radius, params.filter_fraction, params.filter_maxdiff);
+	filter(fval, params.filter_radius, params.filter_fraction, params.filter_maxdiff, verbose);
+	stageDone(1, fval);
+
+	// FILL CODE HOLES
+	if (verbose) printf("filling holes\n");
+	fillCodeHoles(fval, params.fill_maxwidth, params.fill_maxborderdiff[0], direction);
+	fillCodeHoles(fval, params.fill_maxwidth, params.fill_maxborderdiff[1], 1-direction);
+	fillCodeHoles(fval, params.fill_maxwidth, params.fill_maxborderdiff[2], direction);
+	stageDone(2, fval);
+
+	// REFINE CODES
+	if (verbose) printf("refining code values\n");
+	refineCodes(fval,  fval1, params.refine_radius, params.maxgrad0, angle, params);
+	refineCodes(fval1, fval2, params.refine_radius, params.maxgrad1, M_PI/2.0 - angle, params); // also refine in perpendicular direction
+}
+
+// copy rectangle of size w x h from (sx, sy) in src to (dx, dy) in dst (single band)
+static void copyRect(CFloatImage &src, int sx, int sy, CFloatImage &dst, int dx, int dy, int w, int h)
+{
+	for (int y = 0; y < h; y++)
+		memcpy(&dst.Pixel(dx, dy + y, 0), &src.Pixel(sx, sy + y, 0), w * sizeof(float));
+}
+
+// same as refineStages on the whole image, but runs all stages on one tile (plus halo) at a
+// time, so that the tile stays in cache, rather than streaming the whole image through each
+// stage.  the tiles are processed in parallel.  filtered and holefilled receive the
+// intermediate results unless they are NULL.  fval itself is not modified
+static void refineTiled(CFloatImage &fval, CFloatImage *filtered, CFloatImage *holefilled,
+                        CFloatImage &fval1, CFloatImage &fval2, int direction, double angle,
+                        const RefineParams &params)
+{
+	CShape sh = fval.Shape();
+	int w = sh.width, h = sh.height;
+	int halo = refineHalo(params);
+	if (filtered != NULL)
+		filtered->ReAllocate(sh);
+	if (holefilled != NULL)
+		holefilled->ReAllocate(sh);
+	fval1.ReAllocate(sh);
+	fval2.ReAllocate(sh);
+
+	printf("Filtering image with radius %d, fraction %g, and maxdiff %g\n", params.filter_radius, params.filter_fraction, params.filter_maxdiff);
+	printf("filling holes and refining code values in %dx%d tiles\n", REFINE_TILE, REFINE_TILE);
+	int ntx = (w + REFINE_TILE - 1) / REFINE_TILE;
+	int nty = (h + REFINE_TILE - 1) / REFINE_TILE;
+	atomic<int> nfiltered(0);
+	parallelFor(ntx * nty, [&](int i0, int i1) {
+		for (int i = i0; i < i1; i++) {
+			// core of tile, and tile with halo
+			int x0 = (i % ntx) * REFINE_TILE, x1 = min(w, x0 + REFINE_TILE);
+			int y0 = (i / ntx) * REFINE_TILE, y1 = min(h, y0 + REFINE_TILE);
+			int hx0 = max(0, x0 - halo), hx1 = min(w, x1 + halo);
+			int hy0 = max(0, y0 - halo), hy1 = min(h, y1 + halo);
+			int cw = x1 - x0, ch = y1 - y0;
+
+			CFloatImage tile(hx1 - hx0, hy1 - hy0, 1), tile1, tile2;
+			copyRect(fval, hx0, hy0, tile, 0, 0, hx1 - hx0, hy1 - hy0);
+			refineStages(tile, tile1, tile2, direction, angle, params, 0, [&](int stage, CFloatImage &t) {
+				if (stage == 1) {
+					int cnt = 0;
+					for (int y = y0; y < y1; y++) {
+						for (int x = x0; x < x1; x++)
+							cnt += (fval.Pixel(x, y, 0) != UNK && t.Pixel(x - hx0, y - hy0, 0) == UNK);
+					}
+					nfiltered += cnt;
+				}
+				CFloatImage *dst = (stage == 1) ? filtered : holefilled;
+				if (dst != NULL)
+					copyRect(t, x0 - hx0, y0 - hy0, *dst, x0, y0, cw, ch);
+			});
+			copyRect(tile1, x0 - hx0, y0 - hy0, fval1, x0, y0, cw, ch);
+			copyRect(tile2, x0 - hx0, y0 - hy0, fval2, x0, y0, cw, ch);
+		}
+	});
+	printf("%d pixels filtered (%.3f%%)\n", (int)nfiltered, (float)nfiltered * 100.0 / (w * h));
+}
+
+static void writeArtifact(CFloatImage &img, const char *filename, const RefineParams &params, int verbose)
+{
+	if (params.async_writes)
+		writeImageAsync(img, filename, verbose);
+	else
+		WriteImageVerb(img, filename, verbose);
+}
+
 // *** MobileLighting (Mac) currently calls this to do post-decoding refinement ***
 // edited 07/2018 by NHM to use position identifiers in filenames
-CFloatImage refine(char *outdir, int direction, char* decodedIm, double angle, char *posID) {
+// writes the final result (-4refined2) and the intermediate images depending on params.artifacts;
+// with asynchronous writes, call flushImageWrites() before reading them
+CFloatImage refine(char *outdir, int direction, char* decodedIm, double angle, char *posID, const RefineParams &params) {
 	CFloatImage fval, fval1, fval2;
-	CShape sh;
 	int verbose = 1;
 	char filename[1000];
     char uv = direction == 0 ? 'u' : 'v';
+	int all = (params.artifacts == artifacts_all);
 	
 	// read in PFM
 	ReadImageVerb(fval, decodedIm, verbose);
-	
-	// FILTER
-	// filter to remove isolated pixels with different code values
-    if (1) {
-	int rad = 4;
-	float fraction = 0.25;
-	float maxdiff = 4.0;
-	printf("Filtering image with radius %d, fraction %g, and maxdiff %g\n", rad, fraction, maxdiff);
-	filter(fval, rad, fraction, maxdiff);
-    }	
-	
-    if (1) { // save filtered image
-	sprintf(filename, "%s/result%s%c-1filtered.pfm", outdir, posID, uv);
-	WriteImageVerb(fval, filename, verbose);
-    }
-	
-	// FILL CODE HOLES
-	if (1) {
-	if (verbose) printf("filling holes\n");
-	//int maxwidth = 7; // since higher resolution, try filling larger holes
-	int maxwidth = 5; // nope, back to 5 pixels, seems to be a good compromise
-	float maxborderdiff = 2; // still sometimes need 2, e.g. Newkuba/P4 on the lamp
-	fillCodeHoles(fval, maxwidth, maxborderdiff, direction);
-	maxborderdiff = 0;
-	fillCodeHoles(fval, maxwidth, maxborderdiff, 1-direction);
-	maxborderdiff = 1;
-	fillCodeHoles(fval, maxwidth, maxborderdiff, direction);
-    }
-
-    if (1) { // save hole-filled image
-	sprintf(filename, "%s/result%s%c-2holefilled.pfm", outdir, posID, uv);
-	WriteImageVerb(fval, filename, verbose);
-    }
-	
-	// REFINE CODES
-	if (verbose) printf("refining code values\n");
-    //int radius = 3;
-    int radius = 7;// try larger radius since higher resolution
-    refineCodes(fval,  fval1, radius, maxgrad0, angle);
-    refineCodes(fval1, fval2, radius, maxgrad1, M_PI/2.0 - angle); // also refine in perpendicular direction
 
+	if (params.tiled && fval.Shape().nBands == 1) {
+		CFloatImage filtered, holefilled;
+		refineTiled(fval, all ? &filtered : NULL, all ? &holefilled : NULL, fval1, fval2, direction, angle, params);
+		if (all) { // save filtered and hole-filled images
+			sprintf(filename, "%s/result%s%c-1filtered.pfm", outdir, posID, uv);
+			writeArtifact(filtered, filename, params, verbose);
+			sprintf(filename, "%s/result%s%c-2holefilled.pfm", outdir, posID, uv);
+			writeArtifact(holefilled, filename, params, verbose);
+		}
+	} else {
+		refineStages(fval, fval1, fval2, direction, angle, params, verbose, [&](int stage, CFloatImage &img) {
+			if (all) { // save filtered / hole-filled image
+				sprintf(filename, "%s/result%s%c-%s.pfm", outdir, posID, uv, stage == 1 ? "1filtered" : "2holefilled");
+				writeArtifact(img, filename, params, verbose);
+			}
+		});
+	}
 
-    if (1) { // save refined image
+    if (all) { // save refined image
 	sprintf(filename, "%s/result%s%c-3refined1.pfm", outdir, posID, uv);
-	WriteImageVerb(fval1, filename, verbose);
+	writeArtifact(fval1, filename, params, verbose);
+    }
+    if (params.artifacts != artifacts_none) { // save final image
 	sprintf(filename, "%s/result%s%c-4refined2.pfm", outdir, posID, uv);
-	WriteImageVerb(fval2, filename, verbose);
+	writeArtifact(fval2, filename, params, verbose);
     }
 	
 	return fval2;
 }
+
+// rough estimate of peak memory of refine() on a decoded image, in MB: the input and
+// results, filter copies and histograms, and copies queued for writing
+static double refineMemoryMB(const char *decodedIm)
+{
+	struct stat st;
+	if (stat(decodedIm, &st) != 0)
+		return 0;
+	return 10.0 * st.st_size / (1 << 20);
+}
+
+vector<int> refineBatch(const vector<RefineJob> &jobs, int nworkers, double maxMemoryMB)
+{
+	int n = (int)jobs.size();
+	vector<int> status(n, 0);
+	vector<double> mem(n);
+	for (int i = 0; i < n; i++)
+		mem[i] = refineMemoryMB(jobs[i].decodedIm.c_str());
+	if (nworkers <= 0)
+		nworkers = max(1, (int)thread::hardware_concurrency());
+	nworkers = max(1, min(nworkers, n));
+
+	// jobs are started in order, each as soon as a worker is free and its memory fits
+	mutex mtx;
+	condition_variable cv;
+	int next = 0, running = 0;
+	double used = 0;
+	auto work = [&]() {
+		while (true) {
+			int i;
+			{
+				unique_lock<mutex> lock(mtx);
+				while (next < n && running > 0 && maxMemoryMB > 0 && used + mem[next] > maxMemoryMB)
+					cv.wait(lock);
+				if (next >= n)
+					return;
+				i = next++;
+				running++;
+				used += mem[i];
+			}
+			const RefineJob &job = jobs[i];
+			// with several jobs running, write images directly, so that write errors belong to their job
+			RefineParams params = job.params;
+			params.async_writes = 0;
+			try {
+				refine((char *)job.outdir.c_str(), job.direction, (char *)job.decodedIm.c_str(),
+				       job.angle, (char *)job.posID.c_str(), params);
+			} catch (CError &err) {
+				fprintf(stderr, "refine %s: %s\n", job.decodedIm.c_str(), err.message);
+				status[i] = -1;
+			} catch (exception &err) {
+				fprintf(stderr, "refine %s: %s\n", job.decodedIm.c_str(), err.what());
+				status[i] = -1;
+			}
+			{
+				lock_guard<mutex> lock(mtx);
+				running--;
+				used -= mem[i];
+			}
+			cv.notify_all();
+		}
+	};
+	vector<thread> workers;
+	for (int k = 1; k < nworkers; k++)
+		workers.push_back(thread(work));
+	work();
+	for (int k = 0; k < (int)workers.size(); k++)
+		workers[k].join();
+
+	int nfailed = (int)count(status.begin(), status.end(), -1);
+	printf("refined %d images, %d failed\n", n - nfailed, nfailed);
+	return status;
+}
  // end
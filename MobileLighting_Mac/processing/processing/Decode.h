@@ -9,7 +9,40 @@
 #ifndef Decode_h
 #define Decode_h
 
-CFloatImage refine(char *outdir, int direction, char* decodedIm, double angle, char *posID);
+#include <string>
+#include <vector>
+#include "RefineParams.h"
+
+// code tables and decoding of thresholded images
+std::vector<int> loadCodeTable(const char *codefile);
+void decodeCodeImages(std::vector<CByteImage> &ims, const std::vector<int> &codeToPixel, CFloatImage &result);
+CFloatImage decodeThresholded(char *outdir, char *codefile, int direction, char **imList, int numIm, char *posID);
+void thresholdCodeBit(CByteImage &normal, CByteImage &inverted, double angle, float thresh, int k,
+                      CIntImage &val, CIntImage &unk);
+void decodeCodeBits(CIntImage &val, CIntImage &unk, const std::vector<int> &codeToPixel, CFloatImage &result);
+CFloatImage decodeExposures(char *outdir, char *codefile, int direction, char **normalList, char **invertedList,
+                            int numIm, double angle, float thresh, char *posID);
+
+CFloatImage refine(char *outdir, int direction, char* decodedIm, double angle, char *posID,
+                   const RefineParams &params = defaultRefineParams());
+
+// arguments of one refine() call
+struct RefineJob
+{
+    std::string outdir;
+    int direction;
+    std::string decodedIm;
+    double angle;
+    std::string posID;
+    RefineParams params;
+
+    RefineJob() : direction(0), angle(0), params(defaultRefineParams()) {}
+};
+
+// refine images concurrently, running up to nworkers jobs at once (<= 0: one per core), but
+// only as many as fit into maxMemoryMB (<= 0: no limit; a job always runs if no other one is).
+// returns status of each job: 0 = done, -1 = failed (the error is printed)
+std::vector<int> refineBatch(const std::vector<RefineJob> &jobs, int nworkers, double maxMemoryMB);
 
 #endif /* Decode_h */
  // end
@@ -0,0 +1,302 @@
+///////////////////////////////////////////////////////////////////////////
+//
+// NAME
+//  DecodeSIMD.cpp -- vectorized kernels of the decoder
+//
+// DESCRIPTION
+//  Each kernel packs a block of pixels at a time, looping over the bits
+//  (images) of the stack.  Pixels equal to 255 get bit k set in their
+//  32-bit code, pixels equal to 128 mark the code as unknown; any other
+//  value (normally 0) leaves the bit cleared, as in the old store_bit.
+//
+//  AVX-512: 16 pixels; the byte compare is turned into a 16-bit mask with
+//           movemask, which is used directly as write mask for the OR.
+//  AVX2:    8 pixels, bytes widened to 32-bit lanes before the compare.
+//  SSE2:    16 pixels, the byte compare mask is widened by unpacking.
+//
+//  The threshold kernels work on 16-bit differences (16 pixels with AVX2,
+//  which is also used for AVX-512, and 8 with SSE2), and widen the white
+//  and unknown masks to OR the bit into the 32-bit planes.  Pixels whose
+//  neighbors are outside the image are done by the scalar version.
+//
+// SEE ALSO
+//  DecodeSIMD.h          definition and explanation
+//
+///////////////////////////////////////////////////////////////////////////
+
+#include <stdlib.h>
+#include <algorithm>
+#include "RefineSIMD.h"
+#include "DecodeSIMD.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define DECODE_X86 1
+#include <immintrin.h>
+#endif
+
+// plain version for pixels x0..n-1, used for leftover pixels and on other architectures
+static void packBitsScalar(const unsigned char *const *rows, int nbits, int x0, int n, unsigned int *code)
+{
+    for (int x = x0; x < n; x++) {
+        unsigned int c = 0;
+        int unk = 0;
+        for (int k = 0; k < nbits; k++) {
+            unsigned char p = rows[k][x];
+            if (p == 255)
+                c |= (1u << k);
+            else if (p == 128)
+                unk = 1;
+        }
+        code[x] = unk ? CODE_UNKNOWN : c;
+    }
+}
+
+static inline int sgn(int d)
+{
+    return (d > 0) - (d < 0);
+}
+
+// plain version for pixels x0..x1-1 of a row
+static void thresholdScalar(const ThresholdRows &r, int dx, int x0, int x1, int n, int t, unsigned int bit,
+                            unsigned int *val, unsigned int *unk)
+{
+    int ax = abs(dx);
+    int nb = (r.normNb[0] != NULL && r.normNb[1] != NULL);
+    for (int x = x0; x < x1; x++) {
+        int d = r.norm[x] - r.inv[x];
+        int edge = 0;
+        if (nb && x - ax >= 0 && x + ax < n) {
+            int dl = r.normNb[0][x + dx] - r.invNb[0][x + dx];
+            int dr = r.normNb[1][x - dx] - r.invNb[1][x - dx];
+            edge = (sgn(dl) != sgn(dr) && std::min(abs(dl), abs(dr)) >= t);
+        }
+        int white, unknown;
+        if (edge) { // stripe edge: only the sign counts
+            white = (d > 0);
+            unknown = (d == 0);
+        } else {
+            white = (d >= t);
+            unknown = (!white && d > -t);
+        }
+        if (white)
+            val[x] |= bit;
+        else if (unknown)
+            unk[x] |= bit;
+    }
+}
+
+#ifdef DECODE_X86
+
+// the kernels return the position up to which they did the pixels
+
+__attribute__((target("avx512f")))
+static int packBitsAVX512(const unsigned char *const *rows, int nbits, int n, unsigned int *code)
+{
+    const __m128i white = _mm_set1_epi8((char)255);
+    const __m128i gray = _mm_set1_epi8((char)128);
+    int x = 0;
+    for (; x + 16 <= n; x += 16) {
+        __m512i acc = _mm512_setzero_si512();
+        int unk = 0;
+        for (int k = 0; k < nbits; k++) {
+            __m128i p = _mm_loadu_si128((const __m128i *)(rows[k] + x));
+            __mmask16 w = (__mmask16)_mm_movemask_epi8(_mm_cmpeq_epi8(p, white));
+            acc = _mm512_mask_or_epi32(acc, w, acc, _mm512_set1_epi32((int)(1u << k)));
+            unk |= _mm_movemask_epi8(_mm_cmpeq_epi8(p, gray));
+        }
+        acc = _mm512_mask_mov_epi32(acc, (__mmask16)unk, _mm512_set1_epi32((int)CODE_UNKNOWN));
+        _mm512_storeu_si512((void *)(code + x), acc);
+    }
+    return x;
+}
+
+__attribute__((target("avx2")))
+static int packBitsAVX2(const unsigned char *const *rows, int nbits, int n, unsigned int *code)
+{
+    const __m256i white = _mm256_set1_epi32(255);
+    const __m256i gray = _mm256_set1_epi32(128);
+    int x = 0;
+    for (; x + 8 <= n; x += 8) {
+        __m256i acc = _mm256_setzero_si256();
+        __m256i unk = _mm256_setzero_si256();
+        for (int k = 0; k < nbits; k++) {
+            __m256i p = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)(rows[k] + x)));
+            __m256i bit = _mm256_set1_epi32((int)(1u << k));
+            acc = _mm256_or_si256(acc, _mm256_and_si256(_mm256_cmpeq_epi32(p, white), bit));
+            unk = _mm256_or_si256(unk, _mm256_cmpeq_epi32(p, gray));
+        }
+        // unknown lanes are all ones, i.e. CODE_UNKNOWN
+        _mm256_storeu_si256((__m256i *)(code + x), _mm256_or_si256(acc, unk));
+    }
+    return x;
+}
+
+// widen a mask of 16 bytes into 4 masks of 4 ints each
+static inline void widenMaskSSE(__m128i m, __m128i w[4])
+{
+    __m128i lo = _mm_unpacklo_epi8(m, m);
+    __m128i hi = _mm_unpackhi_epi8(m, m);
+    w[0] = _mm_unpacklo_epi16(lo, lo);
+    w[1] = _mm_unpackhi_epi16(lo, lo);
+    w[2] = _mm_unpacklo_epi16(hi, hi);
+    w[3] = _mm_unpackhi_epi16(hi, hi);
+}
+
+__attribute__((target("sse2")))
+static int packBitsSSE2(const unsigned char *const *rows, int nbits, int n, unsigned int *code)
+{
+    const __m128i white = _mm_set1_epi8((char)255);
+    const __m128i gray = _mm_set1_epi8((char)128);
+    int x = 0;
+    for (; x + 16 <= n; x += 16) {
+        __m128i acc[4], w[4];
+        for (int i = 0; i < 4; i++)
+            acc[i] = _mm_setzero_si128();
+        __m128i unk = _mm_setzero_si128();
+        for (int k = 0; k < nbits; k++) {
+            __m128i p = _mm_loadu_si128((const __m128i *)(rows[k] + x));
+            __m128i bit = _mm_set1_epi32((int)(1u << k));
+            widenMaskSSE(_mm_cmpeq_epi8(p, white), w);
+            for (int i = 0; i < 4; i++)
+                acc[i] = _mm_or_si128(acc[i], _mm_and_si128(w[i], bit));
+            unk = _mm_or_si128(unk, _mm_cmpeq_epi8(p, gray));
+        }
+        widenMaskSSE(unk, w);
+        for (int i = 0; i < 4; i++)
+            _mm_storeu_si128((__m128i *)(code + x + 4 * i), _mm_or_si128(acc[i], w[i]));
+    }
+    return x;
+}
+
+__attribute__((target("avx2")))
+static inline __m256i diffAVX2(const unsigned char *norm, const unsigned char *inv)
+{
+    return _mm256_sub_epi16(_mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)norm)),
+                            _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)inv)));
+}
+
+// OR bit into the 16 plane values at p where the 16-bit mask m is set
+__attribute__((target("avx2")))
+static inline void orBitAVX2(__m256i m, __m256i bit, unsigned int *p)
+{
+    __m256i lo = _mm256_cvtepi16_epi32(_mm256_castsi256_si128(m));
+    __m256i hi = _mm256_cvtepi16_epi32(_mm256_extracti128_si256(m, 1));
+    __m256i *q = (__m256i *)p;
+    _mm256_storeu_si256(q, _mm256_or_si256(_mm256_loadu_si256(q), _mm256_and_si256(lo, bit)));
+    _mm256_storeu_si256(q + 1, _mm256_or_si256(_mm256_loadu_si256(q + 1), _mm256_and_si256(hi, bit)));
+}
+
+__attribute__((target("avx2")))
+static int thresholdAVX2(const ThresholdRows &r, int dx, int edges, int x0, int x1, int t, unsigned int bit,
+                         unsigned int *val, unsigned int *unk)
+{
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i tm1 = _mm256_set1_epi16((short)(t - 1));
+    const __m256i negt = _mm256_set1_epi16((short)-t);
+    const __m256i bits = _mm256_set1_epi32((int)bit);
+    int x = x0;
+    for (; x + 16 <= x1; x += 16) {
+        __m256i d = diffAVX2(r.norm + x, r.inv + x);
+        __m256i white = _mm256_cmpgt_epi16(d, tm1);
+        __m256i unknown = _mm256_andnot_si256(white, _mm256_cmpgt_epi16(d, negt));
+        if (edges) {
+            __m256i dl = diffAVX2(r.normNb[0] + x + dx, r.invNb[0] + x + dx);
+            __m256i dr = diffAVX2(r.normNb[1] + x - dx, r.invNb[1] + x - dx);
+            __m256i sl = _mm256_sub_epi16(_mm256_cmpgt_epi16(zero, dl), _mm256_cmpgt_epi16(dl, zero));
+            __m256i sr = _mm256_sub_epi16(_mm256_cmpgt_epi16(zero, dr), _mm256_cmpgt_epi16(dr, zero));
+            __m256i minabs = _mm256_min_epi16(_mm256_abs_epi16(dl), _mm256_abs_epi16(dr));
+            __m256i edge = _mm256_andnot_si256(_mm256_cmpeq_epi16(sl, sr), _mm256_cmpgt_epi16(minabs, tm1));
+            white = _mm256_blendv_epi8(white, _mm256_cmpgt_epi16(d, zero), edge);
+            unknown = _mm256_blendv_epi8(unknown, _mm256_cmpeq_epi16(d, zero), edge);
+        }
+        orBitAVX2(white, bits, val + x);
+        orBitAVX2(unknown, bits, unk + x);
+    }
+    return x;
+}
+
+__attribute__((target("sse2")))
+static inline __m128i diffSSE2(const unsigned char *norm, const unsigned char *inv)
+{
+    const __m128i zero = _mm_setzero_si128();
+    return _mm_sub_epi16(_mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)norm), zero),
+                         _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)inv), zero));
+}
+
+__attribute__((target("sse2")))
+static inline void orBitSSE2(__m128i m, __m128i bit, unsigned int *p)
+{
+    __m128i *q = (__m128i *)p;
+    _mm_storeu_si128(q, _mm_or_si128(_mm_loadu_si128(q), _mm_and_si128(_mm_unpacklo_epi16(m, m), bit)));
+    _mm_storeu_si128(q + 1, _mm_or_si128(_mm_loadu_si128(q + 1), _mm_and_si128(_mm_unpackhi_epi16(m, m), bit)));
+}
+
+__attribute__((target("sse2")))
+static int thresholdSSE2(const ThresholdRows &r, int dx, int edges, int x0, int x1, int t, unsigned int bit,
+                         unsigned int *val, unsigned int *unk)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i tm1 = _mm_set1_epi16((short)(t - 1));
+    const __m128i negt = _mm_set1_epi16((short)-t);
+    const __m128i bits = _mm_set1_epi32((int)bit);
+    int x = x0;
+    for (; x + 8 <= x1; x += 8) {
+        __m128i d = diffSSE2(r.norm + x, r.inv + x);
+        __m128i white = _mm_cmpgt_epi16(d, tm1);
+        __m128i unknown = _mm_andnot_si128(white, _mm_cmpgt_epi16(d, negt));
+        if (edges) {
+            __m128i dl = diffSSE2(r.normNb[0] + x + dx, r.invNb[0] + x + dx);
+            __m128i dr = diffSSE2(r.normNb[1] + x - dx, r.invNb[1] + x - dx);
+            __m128i sl = _mm_sub_epi16(_mm_cmpgt_epi16(zero, dl), _mm_cmpgt_epi16(dl, zero));
+            __m128i sr = _mm_sub_epi16(_mm_cmpgt_epi16(zero, dr), _mm_cmpgt_epi16(dr, zero));
+            __m128i absl = _mm_max_epi16(dl, _mm_sub_epi16(zero, dl));
+            __m128i absr = _mm_max_epi16(dr, _mm_sub_epi16(zero, dr));
+            __m128i edge = _mm_andnot_si128(_mm_cmpeq_epi16(sl, sr), _mm_cmpgt_epi16(_mm_min_epi16(absl, absr), tm1));
+            white = _mm_or_si128(_mm_and_si128(edge, _mm_cmpgt_epi16(d, zero)), _mm_andnot_si128(edge, white));
+            unknown = _mm_or_si128(_mm_and_si128(edge, _mm_cmpeq_epi16(d, zero)), _mm_andnot_si128(edge, unknown));
+        }
+        orBitSSE2(white, bits, val + x);
+        orBitSSE2(unknown, bits, unk + x);
+    }
+    return x;
+}
+
+#endif // DECODE_X86
+
+void packCodeBitsSIMD(const unsigned char *const *rows, int nbits, int n, unsigned int *code)
+{
+    int x = 0;
+#ifdef DECODE_X86
+    switch (getSIMDLevel()) {
+        case simd_avx512: x = packBitsAVX512(rows, nbits, n, code); break;
+        case simd_avx2:   x = packBitsAVX2(rows, nbits, n, code); break;
+        case simd_sse2:   x = packBitsSSE2(rows, nbits, n, code); break;
+        default: break;
+    }
+#endif
+    packBitsScalar(rows, nbits, x, n, code);
+}
+
+void thresholdCodeBitSIMD(const ThresholdRows &rows, int dx, int n, int t, int k,
+                          unsigned int *val, unsigned int *unk)
+{
+    unsigned int bit = (1u << k);
+    t = std::min(t, 256); // differences are within +-255; keeps t in 16 bits
+    // the kernels do the pixels whose neighbors are all inside the image, or all outside
+    int ax = abs(dx);
+    int edges = (rows.normNb[0] != NULL && rows.normNb[1] != NULL);
+    int x0 = edges ? std::min(ax, n) : 0;
+    int x1 = edges ? std::max(x0, n - ax) : n;
+    thresholdScalar(rows, dx, 0, x0, n, t, bit, val, unk);
+    int x = x0;
+#ifdef DECODE_X86
+    switch (getSIMDLevel()) {
+        case simd_avx512:
+        case simd_avx2: x = thresholdAVX2(rows, dx, edges, x0, x1, t, bit, val, unk); break;
+        case simd_sse2: x = thresholdSSE2(rows, dx, edges, x0, x1, t, bit, val, unk); break;
+        default: break;
+    }
+#endif
+    thresholdScalar(rows, dx, x, n, n, t, bit, val, unk);
+}
+ // end
@@ -0,0 +1,52 @@
+///////////////////////////////////////////////////////////////////////////
+//
+// NAME
+//  DecodeSIMD.h -- vectorized kernels of the decoder (see Decode.cpp)
+//
+// DESCRIPTION
+//  Combines the rows of a stack of thresholded images (0 = black, 128 =
+//  unknown, 255 = white) into one binary code per pixel, image k giving
+//  bit k (k == 0 is the least-significant bit).
+//
+//  Also thresholds the difference of a normal and an inverted exposure of
+//  a code bit directly into bit planes, with the rule of the phone's
+//  smartThreshold.cikernel: a pixel whose neighbors across the stripes
+//  (at +-(dx, dy)) are clearly on opposite sides of 0 is a stripe edge and
+//  only needs the sign of its own difference; other pixels need a
+//  difference of at least t in magnitude, and are unknown otherwise.
+//
+//  Uses the SIMD level of getSIMDLevel() (see RefineSIMD.h), and plain C++
+//  on other architectures.
+//
+// SEE ALSO
+//  DecodeSIMD.cpp        Implementation
+//  RefineSIMD.h          SIMD level detection
+//
+///////////////////////////////////////////////////////////////////////////
+
+#ifndef DecodeSIMD_h
+#define DecodeSIMD_h
+
+// pixels with an unknown bit get this code
+#define CODE_UNKNOWN 0xffffffffu
+
+// maximal number of images (bits) in a stack
+#define MAXCODEBITS 32
+
+// pack the n pixels of rows[0..nbits-1] into code[0..n-1]
+void packCodeBitsSIMD(const unsigned char *const *rows, int nbits, int n, unsigned int *code);
+
+// rows of a normal and an inverted exposure (1 band) used for one image row
+struct ThresholdRows
+{
+    const unsigned char *norm, *inv;            // the row itself
+    const unsigned char *normNb[2], *invNb[2];  // rows y + dy and y - dy, NULL if outside the image
+};
+
+// threshold the n differences norm - inv of a row, with neighbors at columns x + dx (row y + dy)
+// and x - dx (row y - dy), and OR bit k into val (white) or unk (unknown)
+void thresholdCodeBitSIMD(const ThresholdRows &rows, int dx, int n, int t, int k,
+                          unsigned int *val, unsigned int *unk);
+
+#endif /* DecodeSIMD_h */
+ // end
@@ -20,12 +20,76 @@
 #include <iostream>
 #include <math.h>
 #include <algorithm>
+#include <atomic>
+#include <memory>
+#include <climits>
 #include "imageLib.h"
 #include "Utils.h"
 #include "flowIO.h"
+#include "Parallel.h"
+#include "MatchSIMD.h"
 #include "assert.h"
 
 
+// Regions
+
+// pixels inside the rectangle x, y, width, height (width <= 0: whole image) where mask (if
+// not NULL) is nonzero, as for foregroundErase.  255 inside, 0 outside
+CByteImage regionMask(CShape sh, int x, int y, int width, int height, CByteImage *mask)
+{
+    int w = sh.width, h = sh.height;
+    if (mask && (mask->Shape().width != w || mask->Shape().height != h))
+        throw CError("regionMask: mask needs to have the size of the image");
+    if (width <= 0) {
+        x = y = 0;
+        width = w;
+        height = h;
+    }
+    CByteImage region(CShape(w, h, 1));
+    for (int yy = 0; yy < h; yy++) {
+        for (int xx = 0; xx < w; xx++) {
+            int inside = (xx >= x && xx < x + width && yy >= y && yy < y + height);
+            if (inside && mask)
+                inside = (mask->Pixel(xx, yy, 0) != 0);
+            region.Pixel(xx, yy, 0) = inside ? 255 : 0;
+        }
+    }
+    return region;
+}
+
+// whether region has the width and height of img
+int sameSize(CByteImage &region, CFloatImage &img)
+{
+    return region.Shape().width == img.Shape().width && region.Shape().height == img.Shape().height;
+}
+
+// bounding box x0..x1-1, y0..y1-1 of region, the whole w x h image if region is NULL
+void regionBounds(CByteImage *region, int w, int h, int &x0, int &x1, int &y0, int &y1)
+{
+    if (region == NULL) {
+        x0 = y0 = 0;
+        x1 = w;
+        y1 = h;
+        return;
+    }
+    x0 = w;
+    y0 = h;
+    x1 = y1 = 0;
+    for (int y = 0; y < h; y++) {
+        for (int x = 0; x < w; x++) {
+            if (region->Pixel(x, y, 0)) {
+                x0 = min(x0, x);
+                x1 = max(x1, x + 1);
+                y0 = min(y0, y);
+                y1 = max(y1, y + 1);
+            }
+        }
+    }
+    if (x0 >= x1) // empty
+        x0 = x1 = y0 = y1 = 0;
+}
+
+
 // Cross checking
 
 // bilinear interpolation.  vr is the nearest-neighbor value at the rounded location
@@ -52,103 +116,106 @@ float linearInterp(float fx, float fy, float vr, float v00, float v01, float v10
 
 // new cross-checking code, DS 1/15/2014
 // added linear interpolation 1/28/2014
-// input: 
-//  flo images im0, im1
+// cross check row y of the disparities x0, y0 of one image against those (x1, y1) of the other
+// image, storing the disparities that pass in the rows outx, outy (others UNK)
+// input:
+//  x0, y0, x1, y1 -- x and y disparities (1 band); y0 and y1 are NULL if xonly
 //  thresh -- allowable Euclidean distance of forward and backward flow vectors (usually 0.5)
 //  xonly  -- whether to ignore ydisps
 //  halfocc -- whether to allow half occlusions (assumes xonly==1), and pixels mapping out of bounds or on UNK
 //   if halfocc == -1 (L -> R), allow half occlusion where d0 < d1 and also where d1 is UNK
 //   if halfocc ==  1 (R -> L), allow half occlusion where d0 > d1 and also where d1 is UNK
-CFloatImage floatCrossCheck(CFloatImage im0, CFloatImage im1, float thresh, int xonly, int halfocc)
+//  region -- if not NULL, only pixels of x0 where it is nonzero (within bounds bx0..bx1-1,
+//   by0..by1-1) are checked, others fail
+void crossCheckRow(CFloatImage &x0, CFloatImage *y0, CFloatImage &x1, CFloatImage *y1, int y,
+                   float thresh, int halfocc, CByteImage *region, int bx0, int bx1, int by0, int by1,
+                   float *outx, float *outy)
 {
-    CShape sh = im0.Shape();
-    CFloatImage out(sh);
+    CShape sh = x0.Shape();
     int w = sh.width, h = sh.height;
-    
-    for(int y = 0; y < h; y++){
-        for(int x = 0; x < w; x++){
-            // fail cross checking by default
-            out.Pixel(x, y, 0) = UNK;
-            if (! xonly)
-                out.Pixel(x, y, 1) = UNK;
-            
-            float dx0 = im0.Pixel(x, y, 0);
-            float dy0 = im0.Pixel(x, y, 1);
-            float dy0orig = dy0;
-            
-            if (dx0 == UNK)
-                continue;
-            if (xonly || dy0 == UNK)
-                dy0 = 0; // if only y component is unknown, assume 0
-            
-            float xx = x + dx0;
-            float yy = y + dy0;
-            
-            int ixr = (int)round(xx);
-            int iyr = (int)round(yy);
-            
-            if (ixr < 0 || ixr >= w || iyr < 0 || iyr >= h) {
-                if (halfocc != 0) { // out of bounds counts as half-occlusion, so crosschecking succeeds:
-                    out.Pixel(x, y, 0) = dx0;
-                }
-                continue;
+    int xonly = (y0 == NULL);
+    const float *rx0 = &x0.Pixel(0, y, 0);
+    const float *ry0 = xonly ? NULL : &y0->Pixel(0, y, 0);
+    
+    for(int x = 0; x < w; x++){
+        // fail cross checking by default
+        outx[x] = UNK;
+        outy[x] = UNK;
+        
+        if (y < by0 || y >= by1 || x < bx0 || x >= bx1 || (region && !region->Pixel(x, y, 0)))
+            continue;
+        
+        float dx0 = rx0[x];
+        float dy0 = xonly ? UNK : ry0[x];
+        float dy0orig = dy0;
+        
+        if (dx0 == UNK)
+            continue;
+        if (xonly || dy0 == UNK)
+            dy0 = 0; // if only y component is unknown, assume 0
+        
+        float xx = x + dx0;
+        float yy = y + dy0;
+        
+        int ixr = (int)round(xx);
+        int iyr = (int)round(yy);
+        
+        if (ixr < 0 || ixr >= w || iyr < 0 || iyr >= h) {
+            if (halfocc != 0) { // out of bounds counts as half-occlusion, so crosschecking succeeds:
+                outx[x] = dx0;
             }
-            
-            int ix0 = max(0, (int)floor(xx));
-            int iy0 = max(0, (int)floor(yy));
-            int ix1 = min(w-1, ix0 + 1);
-            int iy1 = min(h-1, iy0 + 1);
-            
-            float fx = xx - ix0;
-            float fy = yy - iy0;
-            
-            //fx = round(fx); // should produce original non-interpolated (nearest-neighbor) results
-            //fy = round(fy);
-            
-            float dx1i = im1.Pixel(ixr, iyr, 0); // nearest neighbor
-            float dy1i = im1.Pixel(ixr, iyr, 1);
-            
-            float dx1 = linearInterp(fx, fy, dx1i,
-                                     im1.Pixel(ix0, iy0, 0),
-                                     im1.Pixel(ix0, iy1, 0),
-                                     im1.Pixel(ix1, iy0, 0),
-                                     im1.Pixel(ix1, iy1, 0));
-            float dy1 = linearInterp(fx, fy, dy1i,
-                                     im1.Pixel(ix0, iy0, 1),
-                                     im1.Pixel(ix0, iy1, 1),
-                                     im1.Pixel(ix1, iy0, 1),
-                                     im1.Pixel(ix1, iy1, 1));
-            
-            if (dx1 == UNK) {
-                if (halfocc != 0) { // also allow UNK match when allowing half-occlusion, so crosschecking succeeds:
-                    out.Pixel(x, y, 0) = dx0;
-                }
-                continue;
+            continue;
+        }
+        
+        int ix0 = max(0, (int)floor(xx));
+        int iy0 = max(0, (int)floor(yy));
+        int ix1 = min(w-1, ix0 + 1);
+        int iy1 = min(h-1, iy0 + 1);
+        
+        float fx = xx - ix0;
+        float fy = yy - iy0;
+        
+        //fx = round(fx); // should produce original non-interpolated (nearest-neighbor) results
+        //fy = round(fy);
+        
+        // rows iyr (nearest neighbor), iy0 and iy1 of the other image
+        const float *rx1r = &x1.Pixel(0, iyr, 0), *rx10 = &x1.Pixel(0, iy0, 0), *rx11 = &x1.Pixel(0, iy1, 0);
+        float dx1i = rx1r[ixr]; // nearest neighbor
+        float dx1 = linearInterp(fx, fy, dx1i, rx10[ix0], rx11[ix0], rx10[ix1], rx11[ix1]);
+        float dy1i = UNK, dy1 = UNK;
+        if (! xonly) {
+            const float *ry1r = &y1->Pixel(0, iyr, 0), *ry10 = &y1->Pixel(0, iy0, 0), *ry11 = &y1->Pixel(0, iy1, 0);
+            dy1i = ry1r[ixr];
+            dy1 = linearInterp(fx, fy, dy1i, ry10[ix0], ry11[ix0], ry10[ix1], ry11[ix1]);
+        }
+        
+        if (dx1 == UNK) {
+            if (halfocc != 0) { // also allow UNK match when allowing half-occlusion, so crosschecking succeeds:
+                outx[x] = dx0;
             }
-            if (xonly || dy1 == UNK)
-                dy1 = 0; // if only y component is unknown, assume 0
-            
-            float dx = fabs(dx0 + dx1); // should have opposite signs
-            float dy = fabs(dy0 + dy1); // 0 if xonly==1
-            float dxi = fabs(dx0 + dx1i); // same with nearest neighbor values
-            float dyi = fabs(dy0 + dy1i);
-            dx = min(dx, dxi); // use smaller of the two, in case interpolated values includes outlier
-            dy = min(dy, dyi); // use smaller of the two, in case interpolated values includes outlier
-            float dd = dx*dx + dy*dy;
-            
-            if (dd >= thresh * thresh && ((halfocc == 0)
-                                          || (halfocc < 0 &&  -dx0 > dx1)
-                                          || (halfocc > 0 &&  -dx0 < dx1)))
-                continue; // crosschecking fails
-            
-            // crosschecking succeeds:
-            out.Pixel(x, y, 0) = dx0;
-            if (! xonly)
-                out.Pixel(x, y, 1) = dy0orig;  // perhaps was UNK
+            continue;
         }
+        if (xonly || dy1 == UNK)
+            dy1 = 0; // if only y component is unknown, assume 0
+        
+        float dx = fabs(dx0 + dx1); // should have opposite signs
+        float dy = fabs(dy0 + dy1); // 0 if xonly==1
+        float dxi = fabs(dx0 + dx1i); // same with nearest neighbor values
+        float dyi = fabs(dy0 + dy1i);
+        dx = min(dx, dxi); // use smaller of the two, in case interpolated values includes outlier
+        dy = min(dy, dyi); // use smaller of the two, in case interpolated values includes outlier
+        float dd = dx*dx + dy*dy;
+        
+        if (dd >= thresh * thresh && ((halfocc == 0)
+                                      || (halfocc < 0 &&  -dx0 > dx1)
+                                      || (halfocc > 0 &&  -dx0 < dx1)))
+            continue; // crosschecking fails
+        
+        // crosschecking succeeds:
+        outx[x] = dx0;
+        if (! xonly)
+            outy[x] = dy0orig;  // perhaps was UNK
     }
-    
-    return out;
 }
 
 
@@ -258,296 +325,941 @@ void subpix2d(float vx, float vy, float fx[3][3], float fy[3][3], float &corx, f
 
 
 
-void printstats(CIntImage rmin, CIntImage rmax)
+// cells of rounded code values: rounded codes u0 .. u0+nu-1 and v0 .. v0+nv-1, the range of
+// the known codes of the code image the cells were made for.  other codes are clamped
+struct CodeCells
 {
-    CShape sh = rmin.Shape();
-    int ncodes = sh.width;
-    
-    int sumx = 0, sumy = 0;
-    int maxx = 0, maxy = 0;
-    int nx = 0, ny = 0;
-    
-    for(int vy = 0; vy < ncodes; vy++){
-        for(int vx = 0; vx < ncodes; vx++){
-            int dx = rmax.Pixel(vx, vy, 0) - rmin.Pixel(vx, vy, 0);
-            int dy = rmax.Pixel(vx, vy, 1) - rmin.Pixel(vx, vy, 1);
-            if (dx >= 0) {
-                sumx += dx;
-                maxx = max(maxx, dx);
-                nx++;
-            }
-            if (dy >= 0) {
-                sumy += dy;
-                maxy = max(maxy, dy);
-                ny++;
-            }
+    int u0, v0, nu, nv;
+
+    int cellu(float u) const { return max(0, min(nu-1, (int)round(u) - u0)); }
+    int cellv(float v) const { return max(0, min(nv-1, (int)round(v) - v0)); }
+    int cell(float u, float v) const { return cellv(v) * nu + cellu(u); }
+};
+
+CodeCells codeCells(CFloatImage &code)
+{
+    CShape sh = code.Shape();
+    int w = sh.width, h = sh.height;
+    int umin = INT_MAX, umax = INT_MIN, vmin = INT_MAX, vmax = INT_MIN;
+    for (int y = 0; y < h; y++) {
+        for (int x = 0; x < w; x++) {
+            float u = code.Pixel(x, y, 0), v = code.Pixel(x, y, 1);
+            if (u == UNK || v == UNK)
+                continue;
+            umin = min(umin, (int)round(u));
+            umax = max(umax, (int)round(u));
+            vmin = min(vmin, (int)round(v));
+            vmax = max(vmax, (int)round(v));
         }
     }
-    float f = 100.0 / (ncodes * ncodes);
-    printf("avg range x = %.2f, max = %d (%.1f%% of code pairs)\n", (float)sumx / nx, maxx, f * nx);
-    printf("avg range y = %.2f, max = %d (%.1f%% of code pairs)\n", (float)sumy / ny, maxy, f * ny);
+    CodeCells c;
+    c.u0 = (umin <= umax) ? umin : 0;
+    c.v0 = (vmin <= vmax) ? vmin : 0;
+    c.nu = (umin <= umax) ? umax - umin + 1 : 1;
+    c.nv = (vmin <= vmax) ? vmax - vmin + 1 : 1;
+    return c;
 }
 
-// store location range of each rounded code value in rmin, rmax to speed up search
-void initRange(CFloatImage code, int ncodes, CIntImage& rmin, CIntImage& rmax)
+// location range of the pixels of a cell
+struct CellRange
+{
+    short xmin, xmax, ymin, ymax;
+};
+
+// store location range of each cell and its 8 neighbors in range, to speed up search
+void initRange(CFloatImage &code, const CodeCells &cells, vector<CellRange> &range)
 {
     CShape sh = code.Shape();
     int w = sh.width, h = sh.height;
+    if (w + h > SHRT_MAX)
+        throw CError("initRange: image too large (width + height = %d)", w + h);
+    int nu = cells.nu, nv = cells.nv;
     
-    CShape sh2(ncodes, ncodes, 2);
-    rmin.ReAllocate(sh2);
-    rmax.ReAllocate(sh2);
-    
-    // initial range images (first pass)
-    CIntImage rmin0(sh2);
-    CIntImage rmax0(sh2);
-    rmin0.FillPixels(w+h); // large value
-    rmax0.FillPixels(-1);  // small value
-    
-    printf("precomputing ranges\n");
-    
-    // determine initial ranges rmin0, rmax0
+    // initial ranges of the cells themselves (first pass)
+    CellRange empty = {(short)(w+h), -1, (short)(w+h), -1}; // large and small values
+    vector<CellRange> range0(nu * nv, empty);
     for(int y = 0; y < h; y++){
         for(int x = 0; x < w; x++){
             float valx = code.Pixel(x, y, 0);
             float valy = code.Pixel(x, y, 1);
             if (valx == UNK || valy == UNK)
                 continue;
-            int vx = max(0, min(ncodes-1, (int)round(valx)));
-            int vy = max(0, min(ncodes-1, (int)round(valy)));
-            rmin0.Pixel(vx, vy, 0) = min(x, rmin0.Pixel(vx, vy, 0));
-            rmin0.Pixel(vx, vy, 1) = min(y, rmin0.Pixel(vx, vy, 1));
-            rmax0.Pixel(vx, vy, 0) = max(x, rmax0.Pixel(vx, vy, 0));
-            rmax0.Pixel(vx, vy, 1) = max(y, rmax0.Pixel(vx, vy, 1));
+            CellRange &r = range0[cells.cell(valx, valy)];
+            r.xmin = min((int)r.xmin, x);
+            r.xmax = max((int)r.xmax, x);
+            r.ymin = min((int)r.ymin, y);
+            r.ymax = max((int)r.ymax, y);
         }
     }
-    printstats(rmin0, rmax0);
-    
-    int neigh = 8; // 1, 4, or 8
-    printf("blurring with %d neighbors\n", neigh);
-    
-    // "blur" ranges to include 1, 4, or 8 neighbors into rmin, rmax
-    for(int y = 0; y < ncodes; y++){
-        int ym = max(0, y-1);
-        int yp = min(y+1, ncodes-1);
-        for(int x = 0; x < ncodes; x++){
-            int xm = max(0, x-1);
-            int xp = min(x+1, ncodes-1);
-            
-            int *rmi = &rmin.Pixel(x, y, 0);
-            int *mi1 = &rmin0.Pixel(xm, ym, 0), *mi2 = &rmin0.Pixel(x, ym, 0), *mi3 = &rmin0.Pixel(xp, ym, 0);
-            int *mi4 = &rmin0.Pixel(xm, y,  0), *mi5 = &rmin0.Pixel(x, y,  0), *mi6 = &rmin0.Pixel(xp, y,  0);
-            int *mi7 = &rmin0.Pixel(xm, yp, 0), *mi8 = &rmin0.Pixel(x, yp, 0), *mi9 = &rmin0.Pixel(xp, yp, 0);
-            
-            int *rma = &rmax.Pixel(x, y, 0);
-            int *ma1 = &rmax0.Pixel(xm, ym, 0), *ma2 = &rmax0.Pixel(x, ym, 0), *ma3 = &rmax0.Pixel(xp, ym, 0);
-            int *ma4 = &rmax0.Pixel(xm, y,  0), *ma5 = &rmax0.Pixel(x, y,  0), *ma6 = &rmax0.Pixel(xp, y,  0);
-            int *ma7 = &rmax0.Pixel(xm, yp, 0), *ma8 = &rmax0.Pixel(x, yp, 0), *ma9 = &rmax0.Pixel(xp, yp, 0);
-            
-            for (int b = 0; b < 2; b++) {
-                rmi[b] = mi5[b];
-                rma[b] = ma5[b];
-                if (neigh >= 4) { // blur with 4-neighbors
-                    rmi[b] = min(rmi[b], min(min(mi2[b], mi4[b]), min(mi6[b], mi8[b])));
-                    rma[b] = max(rma[b], max(max(ma2[b], ma4[b]), max(ma6[b], ma8[b])));
-                }
-                if (neigh == 8) { // blur with diagonal vals as well to get 8-neighbors
-                    rmi[b] = min(rmi[b], min(min(mi1[b], mi3[b]), min(mi7[b], mi9[b])));
-                    rma[b] = max(rma[b], max(max(ma1[b], ma3[b]), max(ma7[b], ma9[b])));
+    
+    // "blur" ranges to include the 8 neighbors
+    range.resize(nu * nv);
+    parallelFor(nv, [&](int cy0, int cy1) {
+        for(int cy = cy0; cy < cy1; cy++){
+            for(int cx = 0; cx < nu; cx++){
+                CellRange r = empty;
+                for(int ny = max(0, cy-1); ny <= min(cy+1, nv-1); ny++){
+                    for(int nx = max(0, cx-1); nx <= min(cx+1, nu-1); nx++){
+                        const CellRange &n = range0[ny * nu + nx];
+                        r.xmin = min(r.xmin, n.xmin);
+                        r.xmax = max(r.xmax, n.xmax);
+                        r.ymin = min(r.ymin, n.ymin);
+                        r.ymax = max(r.ymax, n.ymax);
+                    }
                 }
+                range[cy * nu + cx] = r;
             }
         }
+    }, 64);
+}
+
+
+// code -> pixel index of a code image: the pixels whose rounded codes (u, v) fall into
+// cell c (see CodeCells) are entries start[c] .. start[c+1]-1 (CSR layout).  the codes
+// and locations of the entries are stored with them so matching reads them sequentially
+struct CodeIndex
+{
+    vector<int> start;      // nu * nv + 1 offsets
+    vector<float> u, v;     // codes of the entries
+    vector<unsigned short> uv;  // and packed (see MatchSIMD.h)
+    vector<int> x, y;       // pixel locations of the entries
+};
+
+// build the index of all pixels of 'code' with known u and v
+void buildCodeIndex(CFloatImage &code, const CodeCells &cells, CodeIndex &index)
+{
+    CShape sh = code.Shape();
+    int w = sh.width, h = sh.height;
+    int ncells = cells.nu * cells.nv;
+
+    index.start.assign(ncells + 1, 0);
+
+    // count the pixels of each cell, then turn counts into offsets
+    for (int y = 0; y < h; y++) {
+        for (int x = 0; x < w; x++) {
+            float valx = code.Pixel(x, y, 0);
+            float valy = code.Pixel(x, y, 1);
+            if (valx == UNK || valy == UNK)
+                continue;
+            index.start[cells.cell(valx, valy) + 1]++;
+        }
+    }
+    for (int c = 0; c < ncells; c++)
+        index.start[c + 1] += index.start[c];
+
+    int n = index.start[ncells];
+    index.u.resize(n);
+    index.v.resize(n);
+    index.uv.resize(2 * n);
+    index.x.resize(n);
+    index.y.resize(n);
+    vector<int> next(index.start.begin(), index.start.end() - 1);
+    for (int y = 0; y < h; y++) {
+        for (int x = 0; x < w; x++) {
+            float valx = code.Pixel(x, y, 0);
+            float valy = code.Pixel(x, y, 1);
+            if (valx == UNK || valy == UNK)
+                continue;
+            int i = next[cells.cell(valx, valy)]++;
+            index.u[i] = valx;
+            index.v[i] = valy;
+            index.uv[2*i] = packCode(valx);
+            index.uv[2*i+1] = packCode(valy);
+            index.x[i] = x;
+            index.y[i] = y;
+        }
     }
-    printstats(rmin, rmax);
 }
 
+// pixels of a code image with known u and v, row by row, each row sorted by u.  for rectified
+// pairs, whose matches lie in nearly the same row, the candidates of a pixel are found by binary
+// search in the few rows of its y range
+struct ScanlineIndex
+{
+    vector<int> start;      // h + 1 offsets
+    vector<float> u, v;     // codes of the entries
+    vector<int> x;          // columns of the entries
+};
+
+void buildScanlineIndex(CFloatImage &code, ScanlineIndex &index)
+{
+    CShape sh = code.Shape();
+    int w = sh.width, h = sh.height;
+
+    index.start.assign(h + 1, 0);
+    for (int y = 0; y < h; y++) {
+        int cnt = 0;
+        for (int x = 0; x < w; x++)
+            cnt += (code.Pixel(x, y, 0) != UNK && code.Pixel(x, y, 1) != UNK);
+        index.start[y + 1] = index.start[y] + cnt;
+    }
+
+    int n = index.start[h];
+    index.u.resize(n);
+    index.v.resize(n);
+    index.x.resize(n);
+    parallelFor(h, [&](int y0, int y1) {
+        vector<int> xs;
+        for (int y = y0; y < y1; y++) {
+            float *cu = &code.Pixel(0, y, 0); // bands are interleaved
+            xs.clear();
+            for (int x = 0; x < w; x++)
+                if (cu[2*x] != UNK && cu[2*x+1] != UNK)
+                    xs.push_back(x);
+            std::sort(xs.begin(), xs.end(), [cu](int a, int b) { return cu[2*a] < cu[2*b]; });
+            for (int k = 0, i = index.start[y]; k < (int)xs.size(); k++, i++) {
+                index.u[i] = cu[2*xs[k]];
+                index.v[i] = cu[2*xs[k]+1];
+                index.x[i] = xs[k];
+            }
+        }
+    }, 16);
+}
+
+// whether matchImages preselects candidates on packed codes (see MatchSIMD.h), which it only
+// does for runs of at least PACKED_MINRUN candidates
+static int packedMatching = 1;
+#define PACKED_MINRUN 16
+
+void setPackedCodeMatching(int on)
+{
+    packedMatching = on;
+}
+
+// pack the codes of a 2-band code image into w * h interleaved u, v pairs
+void packCodeImage(CFloatImage &code, vector<unsigned short> &packed)
+{
+    CShape sh = code.Shape();
+    int w = sh.width, h = sh.height;
+    packed.resize(2 * w * h);
+    parallelFor(h, [&](int y0, int y1) {
+        for (int y = y0; y < y1; y++) {
+            unsigned short *p = &packed[2 * w * y];
+            for (int x = 0; x < w; x++) {
+                float u = code.Pixel(x, y, 0), v = code.Pixel(x, y, 1);
+                int unk = (u == UNK || v == UNK);
+                p[2*x] = unk ? PACKED_UNK : packCode(u);
+                p[2*x+1] = unk ? PACKED_UNK : packCode(v);
+            }
+        }
+    }, 16);
+}
+
+// squared smallest distance of value val from the values rounded (and clamped) to cell c of
+// the n cells of codes c0 .. c0+n-1
+static inline float cellDistSq(float val, int c, int c0, int n)
+{
+    float d = 0;
+    if (c > 0)
+        d = max(d, (c0 + c - 0.5f) - val);
+    if (c < n-1)
+        d = max(d, val - (c0 + c + 0.5f));
+    return d * d;
+}
+
+// search structures of a code image, see Disparities.h
+struct MatchIndex
+{
+    int scanline;                   // rows (for rectified pairs) or cells (see matchImages)
+    CodeCells cells;
+    vector<CellRange> range;        // location range of the pixels of each cell and its neighbors
+    CodeIndex index;                // if !scanline
+    ScanlineIndex rows;             // if scanline
+    vector<unsigned short> packed;  // codes of all pixels, packed (see MatchSIMD.h)
+};
+
+std::shared_ptr<const MatchIndex> buildMatchIndex(CFloatImage &code, int scanline)
+{
+    std::shared_ptr<MatchIndex> mi = std::make_shared<MatchIndex>();
+    mi->scanline = scanline;
+    mi->cells = codeCells(code);
+    printf("indexing %d x %d code cells\n", mi->cells.nu, mi->cells.nv);
+    initRange(code, mi->cells, mi->range);
+    if (scanline)
+        buildScanlineIndex(code, mi->rows);
+    else
+        buildCodeIndex(code, mi->cells, mi->index);
+    packCodeImage(code, mi->packed);
+    return mi;
+}
+
+// keep track of the best code difference and the (summed) offsets of the pixels having it
+static inline void updateBest(float diffsq, int dx, int dy, float &bestdiffsq, int &bestx, int &besty, int &bestcnt)
+{
+    if (diffsq <= bestdiffsq) {
+        if (diffsq < bestdiffsq) {
+            bestdiffsq = diffsq;
+            bestx = dx;
+            besty = dy;
+            bestcnt = 1;
+        } else { // found another equally good value
+            bestx += dx;
+            besty += dy;
+            bestcnt++;
+        }
+    }
+}
+
+// unique best matches x0, y0 -> x0 + dx, y0 + dy found by matchImages, whose subpixel
+// corrections are computed afterwards (see refineMatches)
+struct UniqueMatches
+{
+    vector<int> x0, y0, dx, dy;
+
+    void clear() { x0.clear(); y0.clear(); dx.clear(); dy.clear(); }
+};
+
+#define SUBPIX_BATCH 256    // matches whose neighborhoods are gathered at once
+
+// store the disparities of the unique matches m from fim0 to fim1 in dim, with subpixel
+// corrections.  in batches, the codes of the pixels and the 3x3 codes around their matches
+// are gathered into arrays, whose corrections are computed by subpixBatchSIMD, and by
+// subpix2d for the rest
+void refineMatches(CFloatImage &fim0, CFloatImage &fim1, CFloatImage &dim, const UniqueMatches &m)
+{
+    CShape sh = fim1.Shape();
+    int w = sh.width, h = sh.height;
+    const int B = SUBPIX_BATCH;
+    vector<float> vx(B), vy(B), fx(9*B), fy(9*B), corx(B), cory(B);
+    int nm = (int)m.x0.size();
+    for (int i0 = 0; i0 < nm; i0 += B) {
+        int n = min(B, nm - i0);
+        for (int i = 0; i < n; i++) {
+            int x0 = m.x0[i0 + i], y0 = m.y0[i0 + i];
+            int x1 = x0 + m.dx[i0 + i];
+            int y1 = y0 + m.dy[i0 + i];
+            int xs[3] = {max(0, x1-1), x1, min(w-1, x1+1)};
+            int ys[3] = {max(0, y1-1), y1, min(h-1, y1+1)};
+            vx[i] = fim0.Pixel(x0, y0, 0);
+            vy[i] = fim0.Pixel(x0, y0, 1);
+            for (int k = 0; k < 9; k++) {
+                fx[k*B + i] = fim1.Pixel(xs[k/3], ys[k%3], 0);
+                fy[k*B + i] = fim1.Pixel(xs[k/3], ys[k%3], 1);
+            }
+        }
+        int done = subpixBatchSIMD(n, B, &vx[0], &vy[0], &fx[0], &fy[0], &corx[0], &cory[0]);
+        for (int i = done; i < n; i++) {
+            // 3x3 float arrays, indexed [x][y]!!!
+            float fx3[3][3], fy3[3][3];
+            for (int k = 0; k < 9; k++) {
+                fx3[k/3][k%3] = fx[k*B + i];
+                fy3[k/3][k%3] = fy[k*B + i];
+            }
+            subpix2d(vx[i], vy[i], fx3, fy3, corx[i], cory[i]);
+        }
+        for (int i = 0; i < n; i++) {
+            int x0 = m.x0[i0 + i], y0 = m.y0[i0 + i];
+            dim.Pixel(x0, y0, 0) = m.dx[i0 + i] + corx[i];
+            dim.Pixel(x0, y0, 1) = m.dy[i0 + i] + cory[i];
+            
+            if (isnan(dim.Pixel(x0, y0, 0)))
+                printf("error: dx(%d, %d) = %f\n", x0, y0, dim.Pixel(x0, y0, 0));
+            if (isnan(dim.Pixel(x0, y0, 1))) {
+                printf("error: dy(%d, %d) = %f\n", x0, y0, dim.Pixel(x0, y0, 1));
+                printf("valy=%f besty=%d cory=%f\n", vy[i], m.dy[i0 + i], cory[i]);
+                printf("%f %f %f\n", fy[1*B + i], fy[4*B + i], fy[7*B + i]);
+            }
+        }
+    }
+}
 
 // new fast code for matching images DS 2/6/2014
 // preprocesses code map to find search range for each code value
 // find matches between code images fim0 and fim1, store in flow image dim
 // if search range is now known, pass in dmin = dmax = 0
-void matchImages(CFloatImage fim0, CFloatImage fim1, CFloatImage dim, int dmin, int dmax, int ymin, int ymax)
+// the candidates within the ranges are taken from a code index of fim1: only the cells
+// near the code of a pixel can hold codes within maxdiff.  (the float difference of codes
+// within maxdiff can be rounded down to maxdiff, so 1 more cell is considered, and cells
+// are skipped by their distance.)  this gives the same matches as scanning the ranges,
+// which is still done where the ranges hold fewer pixels than the cells (smooth surfaces).
+// if window is given, each pixel is further restricted to its window (see windowsFromCoarse)
+// if scanline is set and ranges are given (rectified pairs), the candidates are instead taken
+// from the rows of the y range, sorted by u (see ScanlineIndex), again with the same matches
+// the scan of ranges and of index cells first preselects candidates on packed codes (unless
+// turned off by setPackedCodeMatching), which again gives the same matches
+// the search structures of fim1 are taken from index1 if it fits, and built otherwise
+// the subpixel corrections of the unique matches of a row are computed after its search, in
+// batches (see refineMatches)
+// if region0 is given, only its pixels (see regionMask) are matched; the others are UNK
+// rows are split across threads; images are passed by reference since CImage reference
+// counts are not thread-safe and computeDisparities runs both directions at once
+void matchImages(CFloatImage &fim0, CFloatImage &fim1, CFloatImage &dim, int dmin, int dmax, int ymin, int ymax,
+                 CIntImage *window = NULL, int scanline = 0, std::shared_ptr<const MatchIndex> index1 = nullptr,
+                 CByteImage *region0 = NULL)
 {
     CShape sh = fim0.Shape();
     int w = sh.width, h = sh.height;
+    int bx0, bx1, by0, by1;
+    regionBounds(region0, w, h, bx0, bx1, by0, by1);
     
     // maximal allowable code difference:
     float maxdiff = 1.0; // changed from 0.5 to 1.0 on 6/25/19
     float maxdiffsq = maxdiff * maxdiff;
     
-    int ncodes = 1024;
-    CIntImage rmin, rmax;
-    initRange(fim1, ncodes, rmin, rmax);
-    
     int userange = (dmin < dmax);
     if (userange) // further restrict to given search range
         printf("restricting to given ranges %d..%d, %d..%d\n", dmin, dmax, ymin, ymax);
     else
         printf("ignoring given ranges\n");
     
-    int good = 0;
-    int unique = 0;
-    
-    for(int y0 = 0; y0 < h; y0++){
-        if (y0 % 100 == 0) printf(".");
-        fflush(stdout);
-        
-        for(int x0 = 0; x0 < w; x0++){
-            //        std::cout << "" << std::endl;
-            
-            dim.Pixel(x0, y0, 0) = UNK;
-            dim.Pixel(x0, y0, 1) = UNK;
+    scanline = scanline && userange; // need a y range
+    if (!index1 || index1->scanline != scanline)
+        index1 = buildMatchIndex(fim1, scanline);
+    const CodeCells &cells = index1->cells;
+    const vector<CellRange> &range = index1->range;
+    const CodeIndex &index = index1->index;
+    const ScanlineIndex &rows = index1->rows;
+    const vector<unsigned short> &packed1 = index1->packed;
+    int crad = (int)ceil(maxdiff) + 1;          // cells considered around the code of a pixel
+    float maxcelldistsq = maxdiffsq * 1.001f;   // cells farther away can't hold a match
+    float maxudiff = maxdiff * 1.001f;          // entries farther away in u can't hold a match
+    
+    int packed = packedMatching;
+    int ptol = (int)ceil(maxudiff * PACKED_SCALE) + 1; // packed codes are rounded
+    
+    std::atomic<int> good(0);
+    std::atomic<int> unique(0);
+    
+    parallelFor(h, [&](int ystart, int yend) {
+        int cgood = 0, cunique = 0; // counts of this chunk of rows
+        vector<int> rbegin(2*crad+1), rend(2*crad+1);
+        vector<int> cursor(scanline ? ymax - ymin + 1 : 0); // per row of the y range (scanline)
+        vector<int> sel(packed ? max(w, 256) : 0);          // preselected candidates
+        UniqueMatches matches;
+        for(int y0 = ystart; y0 < yend; y0++){
+            for(int k = 0; k < (int)cursor.size(); k++)
+                cursor[k] = (y0 + ymin + k >= 0 && y0 + ymin + k < h) ? rows.start[y0 + ymin + k] : 0;
+            for(int x0 = 0; x0 < w; x0++){
+                //        std::cout << "" << std::endl;
             
-            float valx = fim0.Pixel(x0, y0, 0);
-            float valy = fim0.Pixel(x0, y0, 1);
+                dim.Pixel(x0, y0, 0) = UNK;
+                dim.Pixel(x0, y0, 1) = UNK;
             
-            if (valx == UNK || valy == UNK)
-                continue;
+                if (y0 < by0 || y0 >= by1 || x0 < bx0 || x0 >= bx1 || (region0 && !region0->Pixel(x0, y0, 0)))
+                    continue;
             
-            int vx = max(0, min(ncodes-1, (int)round(valx)));
-            int vy = max(0, min(ncodes-1, (int)round(valy)));
+                float valx = fim0.Pixel(x0, y0, 0);
+                float valy = fim0.Pixel(x0, y0, 1);
             
-            int rxmin = rmin.Pixel(vx, vy, 0);
-            int rymin = rmin.Pixel(vx, vy, 1);
-            int rxmax = rmax.Pixel(vx, vy, 0);
-            int rymax = rmax.Pixel(vx, vy, 1);
-            if (userange) { // further restrict to given search range
-                rxmin = max(rxmin, x0 + dmin);
-                rxmax = min(rxmax, x0 + dmax);
-                rymin = max(rymin, y0 + ymin);
-                rymax = min(rymax, y0 + ymax);
-            }
+                if (valx == UNK || valy == UNK)
+                    continue;
             
-            int bestx = 0;
-            int besty = 0;
-            int bestcnt = 0;
-            float bestdiffsq = 2 * maxdiffsq; // no need updating min unless close to allowable value
+                int vx = cells.cellu(valx);
+                int vy = cells.cellv(valy);
             
-            for(int y1 = rymin; y1 <= rymax; y1++){
-                if (y1 < 0 || y1 >= h) {
-                    printf("y = %d shouldn't happen\n", y1);
-                    continue;
+                const CellRange &r = range[vy * cells.nu + vx];
+                int rxmin = r.xmin;
+                int rymin = r.ymin;
+                int rxmax = r.xmax;
+                int rymax = r.ymax;
+                if (userange) { // further restrict to given search range
+                    rxmin = max(rxmin, x0 + dmin);
+                    rxmax = min(rxmax, x0 + dmax);
+                    rymin = max(rymin, y0 + ymin);
+                    rymax = min(rymax, y0 + ymax);
                 }
-                
-                for(int x1 = rxmin; x1 <= rxmax; x1++){
-                    if (x1 < 0 || x1 >= w) {
-                        printf("x shouldn't happen\n");
-                        continue;
+                if (window) { // and to the window of this pixel, if it has one
+                    int *win = &window->Pixel(x0, y0, 0);
+                    if (win[0] <= win[1]) {
+                        rxmin = max(rxmin, x0 + win[0]);
+                        rxmax = min(rxmax, x0 + win[1]);
+                        rymin = max(rymin, y0 + win[2]);
+                        rymax = min(rymax, y0 + win[3]);
+                    }
+                }
+            
+                int bestx = 0;
+                int besty = 0;
+                int bestcnt = 0;
+                float bestdiffsq = 2 * maxdiffsq; // no need updating min unless close to allowable value
+            
+                if (scanline) {
+                    for(int y1 = max(0, rymin); y1 <= min(h-1, rymax); y1++){
+                        // first entry with u >= ulo, usually a few steps from that of the previous pixel
+                        int b = rows.start[y1], e = rows.start[y1+1];
+                        float ulo = valx - maxudiff;
+                        int &i0 = cursor[y1 - (y0 + ymin)];
+                        for (int steps = 0; i0 > b && rows.u[i0-1] >= ulo && steps < 8; steps++)
+                            i0--;
+                        for (int steps = 0; i0 < e && rows.u[i0] < ulo && steps < 8; steps++)
+                            i0++;
+                        if ((i0 > b && rows.u[i0-1] >= ulo) || (i0 < e && rows.u[i0] < ulo))
+                            i0 = (int)(std::lower_bound(&rows.u[0] + b, &rows.u[0] + e, ulo) - &rows.u[0]);
+                        for(int i = i0; i < e && rows.u[i] <= valx + maxudiff; i++){
+                            int x1 = rows.x[i];
+                            if (x1 < rxmin || x1 > rxmax)
+                                continue;
+                            
+                            float difx = valx - rows.u[i];
+                            float dify = valy - rows.v[i];
+                            float diffsq = difx * difx + dify * dify;
+                            updateBest(diffsq, x1 - x0, y1 - y0, bestdiffsq, bestx, besty, bestcnt);
+                        }
                     }
-                    
-                    float valx1 = fim1.Pixel(x1, y1, 0);
-                    float valy1 = fim1.Pixel(x1, y1, 1);
-                    
-                    float difx = valx - valx1;
-                    float dify = valy - valy1;
-                    float diffsq = difx * difx + dify * dify;
-                    
-                    if (diffsq <= bestdiffsq) {
-                        int dx = x1 - x0;
-                        int dy = y1 - y0;
-                        if (diffsq < bestdiffsq) {
-                            bestdiffsq = diffsq;
-                            bestx = dx;
-                            besty = dy;
-                            bestcnt = 1;
-                        } else { // found another equally good value
-                            bestx += dx;
-                            besty += dy;
-                            bestcnt++;
+                } else {
+                    // the cells of each row of cells are consecutive in the index, so the
+                    // candidates are ranges of entries, one per row
+                    int nranges = 0, ncand = 0;
+                    for(int cy = max(0, vy-crad); cy <= min(cells.nv-1, vy+crad); cy++){
+                        float maxcdxsq = maxcelldistsq - cellDistSq(valy, cy, cells.v0, cells.nv);
+                        int cx0 = max(0, vx-crad), cx1 = min(cells.nu-1, vx+crad);
+                        while (cx0 <= cx1 && cellDistSq(valx, cx0, cells.u0, cells.nu) > maxcdxsq)
+                            cx0++;
+                        while (cx0 <= cx1 && cellDistSq(valx, cx1, cells.u0, cells.nu) > maxcdxsq)
+                            cx1--;
+                        if (cx0 > cx1)
+                            continue;
+                        rbegin[nranges] = index.start[cy * cells.nu + cx0];
+                        rend[nranges] = index.start[cy * cells.nu + cx1 + 1];
+                        ncand += rend[nranges] - rbegin[nranges];
+                        nranges++;
+                    }
+                
+                    unsigned short qu = packCode(valx), qv = packCode(valy);
+                    if (ncand <= (rxmax - rxmin + 1) * (rymax - rymin + 1) && packed) {
+                        for(int r = 0; r < nranges; r++){
+                            for(int b = rbegin[r]; b < rend[r]; b += 256){
+                                int n = min(256, rend[r] - b);
+                                int pre = (n >= PACKED_MINRUN); // short runs are faster without
+                                int nsel = pre ? selectCandidatesSIMD(&index.uv[2*b], n, qu, qv, ptol, &sel[0]) : n;
+                                for(int k = 0; k < nsel; k++){
+                                    int i = b + (pre ? sel[k] : k);
+                                    int x1 = index.x[i];
+                                    int y1 = index.y[i];
+                                    if (x1 < rxmin || x1 > rxmax || y1 < rymin || y1 > rymax)
+                                        continue;
+                                    
+                                    float difx = valx - index.u[i];
+                                    float dify = valy - index.v[i];
+                                    float diffsq = difx * difx + dify * dify;
+                                    updateBest(diffsq, x1 - x0, y1 - y0, bestdiffsq, bestx, besty, bestcnt);
+                                }
+                            }
+                        }
+                    } else if (ncand <= (rxmax - rxmin + 1) * (rymax - rymin + 1)) {
+                        for(int r = 0; r < nranges; r++){
+                            for(int i = rbegin[r]; i < rend[r]; i++){
+                                int x1 = index.x[i];
+                                int y1 = index.y[i];
+                                if (x1 < rxmin || x1 > rxmax || y1 < rymin || y1 > rymax)
+                                    continue;
+                            
+                                float difx = valx - index.u[i];
+                                float dify = valy - index.v[i];
+                                float diffsq = difx * difx + dify * dify;
+                                updateBest(diffsq, x1 - x0, y1 - y0, bestdiffsq, bestx, besty, bestcnt);
+                            }
+                        }
+                    } else if (packed) {
+                        for(int y1 = rymin; y1 <= rymax; y1++){
+                            if (y1 < 0 || y1 >= h) {
+                                printf("y = %d shouldn't happen\n", y1);
+                                continue;
+                            }
+                            
+                            int xs = max(0, rxmin), n = min(w-1, rxmax) - xs + 1;
+                            int pre = (n >= PACKED_MINRUN);
+                            int nsel = pre ? selectCandidatesSIMD(&packed1[2 * (w * y1 + xs)], n, qu, qv, ptol, &sel[0]) : n;
+                            for(int k = 0; k < nsel; k++){
+                                int x1 = xs + (pre ? sel[k] : k);
+                                float difx = valx - fim1.Pixel(x1, y1, 0);
+                                float dify = valy - fim1.Pixel(x1, y1, 1);
+                                float diffsq = difx * difx + dify * dify;
+                                updateBest(diffsq, x1 - x0, y1 - y0, bestdiffsq, bestx, besty, bestcnt);
+                            }
+                        }
+                    } else {
+                        for(int y1 = rymin; y1 <= rymax; y1++){
+                            if (y1 < 0 || y1 >= h) {
+                                printf("y = %d shouldn't happen\n", y1);
+                                continue;
+                            }
+                        
+                            for(int x1 = rxmin; x1 <= rxmax; x1++){
+                                if (x1 < 0 || x1 >= w) {
+                                    printf("x shouldn't happen\n");
+                                    continue;
+                                }
+                            
+                                float valx1 = fim1.Pixel(x1, y1, 0);
+                                float valy1 = fim1.Pixel(x1, y1, 1);
+                            
+                                float difx = valx - valx1;
+                                float dify = valy - valy1;
+                                float diffsq = difx * difx + dify * dify;
+                                updateBest(diffsq, x1 - x0, y1 - y0, bestdiffsq, bestx, besty, bestcnt);
+                            }
                         }
                     }
                 }
-            }
             
             
-            if (bestdiffsq <= maxdiffsq){ // found a good match
-                good++;
-                if (bestcnt == 1) { // unique best value, attempt subpixel estimation:
-                    unique++;
-                    int x1 = (int)round(x0 + bestx);
-                    int y1 = (int)round(y0 + besty);
-                    int x1m = max(0, x1-1), x1p = min(w-1, x1+1);
-                    int y1m = max(0, y1-1), y1p = min(h-1, y1+1);
-                    // old: 2 separate 1D corrections
-                    //float corx = subpix(valx, fim1.Pixel(x1m, y1, 0), fim1.Pixel(x1, y1, 0), fim1.Pixel(x1p, y1, 0));
-                    //float cory = subpix(valy, fim1.Pixel(x1, y1m, 1), fim1.Pixel(x1, y1, 1), fim1.Pixel(x1, y1p, 1));
-                    // new: combined 2D correction
-                    float corx, cory;
-                    // 3x3 float arrays, indexed [x][y]!!!
-                    float fx[3][3] = {{fim1.Pixel(x1m, y1m, 0), fim1.Pixel(x1m, y1, 0), fim1.Pixel(x1m, y1p, 0)},
-                        {fim1.Pixel(x1,  y1m, 0), fim1.Pixel(x1,  y1, 0), fim1.Pixel(x1,  y1p, 0)},
-                        {fim1.Pixel(x1p, y1m, 0), fim1.Pixel(x1p, y1, 0), fim1.Pixel(x1p, y1p, 0)}};
-                    float fy[3][3] = {{fim1.Pixel(x1m, y1m, 1), fim1.Pixel(x1m, y1, 1), fim1.Pixel(x1m, y1p, 1)},
-                        {fim1.Pixel(x1,  y1m, 1), fim1.Pixel(x1,  y1, 1), fim1.Pixel(x1,  y1p, 1)},
-                        {fim1.Pixel(x1p, y1m, 1), fim1.Pixel(x1p, y1, 1), fim1.Pixel(x1p, y1p, 1)}};
-                    subpix2d(valx, valy, fx, fy, corx, cory);
-                    //corx = 0;
-                    //cory = 0;
-                    dim.Pixel(x0, y0, 0) = bestx + corx;
-                    dim.Pixel(x0, y0, 1) = besty + cory;
-                    
-                    if (isnan(dim.Pixel(x0, y0, 0)))
-                        printf("error: dx(%d, %d) = %f\n", x0, y0, dim.Pixel(x0, y0, 0));
-                    if (isnan(dim.Pixel(x0, y0, 1))) {
-                        printf("error: dy(%d, %d) = %f\n", x0, y0, dim.Pixel(x0, y0, 1));
-                        printf("valy=%f besty=%d cory=%f\n", valy, besty, cory);
-                        printf("%f %f %f\n", fim1.Pixel(x1, y1m, 1), fim1.Pixel(x1, y1, 1), fim1.Pixel(x1, y1p, 1));
+                if (bestdiffsq <= maxdiffsq){ // found a good match
+                    cgood++;
+                    if (bestcnt == 1) { // unique best value, subpixel estimation after the search
+                        cunique++;
+                        matches.x0.push_back(x0);
+                        matches.y0.push_back(y0);
+                        matches.dx.push_back(bestx);
+                        matches.dy.push_back(besty);
+                    } else { // more than one equally good code, don't interpolate, just use average
+                        float scale = 1.0 / bestcnt;
+                        dim.Pixel(x0, y0, 0) = scale * bestx;
+                        dim.Pixel(x0, y0, 1) = scale * besty;
                     }
-                } else { // more than one equally good code, don't interpolate, just use average
-                    float scale = 1.0 / bestcnt;
-                    dim.Pixel(x0, y0, 0) = scale * bestx;
-                    dim.Pixel(x0, y0, 1) = scale * besty;
                 }
             }
+            // while the rows of the matches are still cached
+            refineMatches(fim0, fim1, dim, matches);
+            matches.clear();
         }
-    }
+        good += cgood;
+        unique += cunique;
+    }, 8);
     
-    printf("found %d matches, %d unique (maxdiff=%.2f)\n", good, unique, maxdiff);
+    printf("found %d matches, %d unique (maxdiff=%.2f)\n", (int)good, (int)unique, maxdiff);
+}
+
+
+
+// coarse-to-fine matching
+
+#define PYR_MINSIZE 64      // coarsest level is at least this wide and high
+#define PYR_MAXJUMP 2.0     // codes of a 2x2 block differing more than this are a discontinuity
+#define PYR_MARGIN 3        // widening of the windows from the coarser level, in pixels
+
+// downsample a 2-band code image by 2: each code is the average of the known codes of a 2x2
+// block.  codes are projector coordinates, so they are not scaled.  blocks with fewer than 2
+// known pixels, or straddling a discontinuity, are UNK
+void downsampleCodes(CFloatImage &code, CFloatImage &small)
+{
+    CShape sh = code.Shape();
+    int w = sh.width / 2, h = sh.height / 2;
+    small.ReAllocate(CShape(w, h, 2));
+
+    parallelFor(h, [&](int y0, int y1) {
+        for (int y = y0; y < y1; y++) {
+            for (int x = 0; x < w; x++) {
+                for (int b = 0; b < 2; b++) {
+                    float sum = 0, vmin = 0, vmax = 0;
+                    int cnt = 0;
+                    for (int j = 0; j < 4; j++) {
+                        float c0 = code.Pixel(2*x + (j & 1), 2*y + (j >> 1), 0);
+                        float c1 = code.Pixel(2*x + (j & 1), 2*y + (j >> 1), 1);
+                        if (c0 == UNK || c1 == UNK) // need both codes, as in matchImages
+                            continue;
+                        float v = (b == 0) ? c0 : c1;
+                        vmin = cnt ? min(vmin, v) : v;
+                        vmax = cnt ? max(vmax, v) : v;
+                        sum += v;
+                        cnt++;
+                    }
+                    small.Pixel(x, y, b) = (cnt >= 2 && vmax - vmin <= PYR_MAXJUMP) ? sum / cnt : UNK;
+                }
+            }
+        }
+    }, 16);
+}
+
+// region of the next coarser level (w x h): the 2x2 blocks with a pixel of region, and their
+// neighbors, whose matches give the windows of the region (see windowsFromCoarse)
+void downsampleRegion(CByteImage &region, int w, int h, CByteImage &small)
+{
+    CByteImage blocks(CShape(w, h, 1));
+    for (int y = 0; y < h; y++) {
+        for (int x = 0; x < w; x++) {
+            blocks.Pixel(x, y, 0) = (region.Pixel(2*x, 2*y, 0) || region.Pixel(2*x+1, 2*y, 0) ||
+                                     region.Pixel(2*x, 2*y+1, 0) || region.Pixel(2*x+1, 2*y+1, 0)) ? 255 : 0;
+        }
+    }
+    small.ReAllocate(CShape(w, h, 1));
+    for (int y = 0; y < h; y++) {
+        for (int x = 0; x < w; x++) {
+            int any = 0;
+            for (int yy = max(0, y-1); yy <= min(h-1, y+1) && !any; yy++)
+                for (int xx = max(0, x-1); xx <= min(w-1, x+1) && !any; xx++)
+                    any = blocks.Pixel(xx, yy, 0);
+            small.Pixel(x, y, 0) = any ? 255 : 0;
+        }
+    }
+}
+
+// per-pixel search windows for the w x h level above the disparities cdim of a coarser level:
+// the range of the doubled disparities of the 3x3 coarse pixels around the parent, widened by
+// margin.  bands 0..3 hold dxmin, dxmax, dymin, dymax relative to the pixel.  pixels without
+// any coarse disparity get an empty window (dxmin > dxmax), i.e. they search everything
+void windowsFromCoarse(CFloatImage &cdim, int w, int h, int margin, CIntImage &window)
+{
+    CShape csh = cdim.Shape();
+    int cw = csh.width, ch = csh.height;
+
+    // range of the coarse disparities around each coarse pixel
+    CIntImage crange(CShape(cw, ch, 4));
+    parallelFor(ch, [&](int y0, int y1) {
+        for (int y = y0; y < y1; y++) {
+            for (int x = 0; x < cw; x++) {
+                float dxmin = 0, dxmax = -1, dymin = 0, dymax = -1;
+                for (int yy = max(0, y-1); yy <= min(ch-1, y+1); yy++) {
+                    for (int xx = max(0, x-1); xx <= min(cw-1, x+1); xx++) {
+                        float dx = cdim.Pixel(xx, yy, 0), dy = cdim.Pixel(xx, yy, 1);
+                        if (dx == UNK || dy == UNK)
+                            continue;
+                        if (dxmin > dxmax) {
+                            dxmin = dxmax = dx;
+                            dymin = dymax = dy;
+                        } else {
+                            dxmin = min(dxmin, dx);
+                            dxmax = max(dxmax, dx);
+                            dymin = min(dymin, dy);
+                            dymax = max(dymax, dy);
+                        }
+                    }
+                }
+                int *r = &crange.Pixel(x, y, 0);
+                if (dxmin > dxmax) {
+                    r[0] = 1; // empty
+                    r[1] = 0;
+                    r[2] = r[3] = 0;
+                } else {
+                    r[0] = (int)floor(2 * dxmin) - margin;
+                    r[1] = (int)ceil(2 * dxmax) + margin;
+                    r[2] = (int)floor(2 * dymin) - margin;
+                    r[3] = (int)ceil(2 * dymax) + margin;
+                }
+            }
+        }
+    }, 16);
+
+    window.ReAllocate(CShape(w, h, 4));
+    parallelFor(h, [&](int y0, int y1) {
+        for (int y = y0; y < y1; y++) {
+            for (int x = 0; x < w; x++) {
+                int *r = &crange.Pixel(min(x/2, cw-1), min(y/2, ch-1), 0);
+                int *win = &window.Pixel(x, y, 0);
+                for (int b = 0; b < 4; b++)
+                    win[b] = r[b];
+            }
+        }
+    }, 16);
+}
+
+// match fim0 to fim1 like matchImages, but first at 'levels' coarser levels, each restricting
+// the search of the pixels of the next finer level to the neighborhood of their coarse match.
+// much faster for large disparity ranges, but can miss matches of structures that vanish at
+// the coarse levels (they get UNK instead).  scanline, index1 (for fim1 itself, not the
+// coarser levels) and region0 are passed on to matchImages
+void matchPyramid(CFloatImage &fim0, CFloatImage &fim1, CFloatImage &dim, int dmin, int dmax, int ymin, int ymax,
+                  int levels, int scanline, std::shared_ptr<const MatchIndex> index1, CByteImage *region0)
+{
+    CShape sh = fim0.Shape();
+    if (levels <= 0 || sh.width / 2 < PYR_MINSIZE || sh.height / 2 < PYR_MINSIZE) {
+        matchImages(fim0, fim1, dim, dmin, dmax, ymin, ymax, NULL, scanline, index1, region0);
+        return;
+    }
+
+    CFloatImage c0, c1, cdim;
+    downsampleCodes(fim0, c0);
+    downsampleCodes(fim1, c1);
+    cdim.ReAllocate(c0.Shape());
+    CByteImage cregion;
+    if (region0)
+        downsampleRegion(*region0, c0.Shape().width, c0.Shape().height, cregion);
+    int userange = (dmin < dmax);
+    printf("matching at %d x %d\n", c0.Shape().width, c0.Shape().height);
+    if (userange)
+        matchPyramid(c0, c1, cdim, (int)floor(dmin / 2.0), (int)ceil(dmax / 2.0),
+                     (int)floor(ymin / 2.0), (int)ceil(ymax / 2.0), levels - 1, scanline, nullptr,
+                     region0 ? &cregion : NULL);
+    else
+        matchPyramid(c0, c1, cdim, 0, 0, 0, 0, levels - 1, scanline, nullptr, region0 ? &cregion : NULL);
+
+    CIntImage window;
+    windowsFromCoarse(cdim, sh.width, sh.height, PYR_MARGIN, window);
+    printf("matching at %d x %d\n", sh.width, sh.height);
+    matchImages(fim0, fim1, dim, dmin, dmax, ymin, ymax, &window, scanline, index1, region0);
+}
+
+
+// automatic search ranges
+
+#define AUTO_STEP 8             // the pre-pass matches every AUTO_STEP-th pixel in x and y
+#define AUTO_TRIM 0.005         // fraction of the sparse matches ignored at either end of a range
+#define AUTO_MARGIN 8           // widening of the estimated ranges, in pixels
+#define AUTO_MINMATCHES 100     // fewer sparse matches don't give a range
+
+// value below which (lo) or above which (hi) at most trim of the n counts of hist lie; bin i
+// holds the values floor(v) == i + off
+void histRange(vector<int> &hist, int off, int n, float trim, int &lo, int &hi)
+{
+    int skip = (int)(trim * n), sum = 0;
+    int nb = (int)hist.size();
+    lo = 0;
+    while (lo < nb - 1 && sum + hist[lo] <= skip)
+        sum += hist[lo++];
+    sum = 0;
+    hi = nb - 1;
+    while (hi > 0 && sum + hist[hi] <= skip)
+        sum += hist[hi--];
+    lo += off;
+    hi += off + 1; // values in bin hi go up to hi + 1
 }
 
+// estimate the ranges of x1 - x0 and y1 - y0 of the matches from fim0 to fim1 by matching a
+// sparse grid of pixels (of region0, if given) and taking the bulk of their histograms, widened
+// by AUTO_MARGIN.  the given ranges (if any), scanline and index1 are used as in matchImages,
+// and the estimates stay within given ranges.  returns 0 if there are too few matches
+int estimateRange(CFloatImage &fim0, CFloatImage &fim1, int dmin, int dmax, int ymin, int ymax, int scanline,
+                  std::shared_ptr<const MatchIndex> index1, CByteImage *region0,
+                  int &emin, int &emax, int &eymin, int &eymax)
+{
+    CShape sh = fim0.Shape();
+    int w = sh.width, h = sh.height;
+    CByteImage grid(CShape(w, h, 1));
+    for (int y = 0; y < h; y++) {
+        for (int x = 0; x < w; x++) {
+            int on = (x % AUTO_STEP == AUTO_STEP / 2 && y % AUTO_STEP == AUTO_STEP / 2);
+            grid.Pixel(x, y, 0) = (on && (region0 == NULL || region0->Pixel(x, y, 0))) ? 255 : 0;
+        }
+    }
+    printf("estimating ranges from every %d-th pixel\n", AUTO_STEP);
+    CFloatImage sparse(sh);
+    matchImages(fim0, fim1, sparse, dmin, dmax, ymin, ymax, NULL, scanline, index1, &grid);
+
+    // disparities lie within -w..w, -h..h
+    vector<int> histx(2*w + 1, 0), histy(2*h + 1, 0);
+    int n = 0;
+    for (int y = AUTO_STEP / 2; y < h; y += AUTO_STEP) {
+        for (int x = AUTO_STEP / 2; x < w; x += AUTO_STEP) {
+            float dx = sparse.Pixel(x, y, 0), dy = sparse.Pixel(x, y, 1);
+            if (dx == UNK || dy == UNK)
+                continue;
+            histx[(int)floor(dx) + w]++;
+            histy[(int)floor(dy) + h]++;
+            n++;
+        }
+    }
+    if (n < AUTO_MINMATCHES) {
+        printf("only %d sparse matches, not estimating ranges\n", n);
+        return 0;
+    }
+    histRange(histx, -w, n, AUTO_TRIM, emin, emax);
+    histRange(histy, -h, n, AUTO_TRIM, eymin, eymax);
+    emin -= AUTO_MARGIN;
+    emax += AUTO_MARGIN;
+    eymin -= AUTO_MARGIN;
+    eymax += AUTO_MARGIN;
+    if (dmin < dmax) {
+        emin = max(emin, dmin);
+        emax = min(emax, dmax);
+        eymin = max(eymin, ymin);
+        eymax = min(eymax, ymax);
+    }
+    printf("%d sparse matches give ranges %d..%d, %d..%d\n", n, emin, emax, eymin, eymax);
+    return 1;
+}
 
 
 // compute pair of disparity maps from code images
 // edited 06/06/2018 by Nicholas Mosier to eliminate saving .flo files
-void computeDisparities(CFloatImage &fim0, CFloatImage &fim1, CFloatImage &fout0, CFloatImage &fout1, int dXmin, int dXmax, int dYmin, int dYmax)
+// if levels > 0, match coarse-to-fine with that many coarser levels (see matchPyramid)
+// if rectified, the candidates are searched row by row (see ScanlineIndex)
+// index0 and index1 are search structures of fim0 and fim1 from earlier calls, if any
+// region0 and region1 restrict the pixels of fim0 and fim1 matched (see regionMask), if given
+// if autorange, the ranges are first estimated from sparse matches (see estimateRange), and
+// narrowed to them; if there are too few, the given ranges are used
+void computeDisparities(CFloatImage &fim0, CFloatImage &fim1, CFloatImage &fout0, CFloatImage &fout1, int dXmin, int dXmax, int dYmin, int dYmax,
+                        int levels, int rectified,
+                        std::shared_ptr<const MatchIndex> index0, std::shared_ptr<const MatchIndex> index1,
+                        CByteImage *region0, CByteImage *region1, int autorange)
 {
     if (fim0.Shape() != fim1.Shape())
         throw CError("computeDisparities: all images need to have same size");
+    if ((region0 && !sameSize(*region0, fim0)) || (region1 && !sameSize(*region1, fim1)))
+        throw CError("computeDisparities: regions need to have the size of the images");
+    if (!fim0.Interleaved() || !fim1.Interleaved())
+        throw CError("computeDisparities: code images need to have interleaved bands");
 
-    fout0.ReAllocate(fim0.Shape());
-    fout1.ReAllocate(fim0.Shape());
-    
-    matchImages(fim0, fim1, fout0, -dXmax, -dXmin, -dYmax, -dYmin);
+    // planar, so that the x and y disparities can be used without copying (see splitFloImage)
+    fout0.ReAllocatePlanar(fim0.Shape());
+    fout1.ReAllocatePlanar(fim0.Shape());
+    
+    // direction 0 searches the negated ranges
+    int emin, emax, eymin, eymax;
+    if (autorange && estimateRange(fim0, fim1, -dXmax, -dXmin, -dYmax, -dYmin, rectified, index1, region0,
+                                   emin, emax, eymin, eymax)) {
+        dXmin = -emax;
+        dXmax = -emin;
+        dYmin = -eymax;
+        dYmax = -eymin;
+    }
     
-    matchImages(fim1, fim0, fout1, dXmin, dXmax, dYmin, dYmax);
+    // both directions at once; they only read fim0 and fim1
+    parallelFor(2, [&](int i0, int i1) {
+        for (int i = i0; i < i1; i++) {
+            if (i == 0)
+                matchPyramid(fim0, fim1, fout0, -dXmax, -dXmin, -dYmax, -dYmin, levels, rectified, index1, region0);
+            else
+                matchPyramid(fim1, fim0, fout1, dXmin, dXmax, dYmin, dYmax, levels, rectified, index0, region1);
+        }
+    });
 }
 
 
-// cross check pair of float disp maps
+// cross check the disparity maps of both images in one pass: x0, y0 against x1, y1 into cx0,
+// cy0 and the reverse into cx1, cy1 (see crossCheckRow), both for a row at a time, with rows
+// split across threads
 // thresh = allowable Euclidean distance
-// if xonly==1, ignore y channel
+// if xonly==1, ignore y channel: y0 and y1 are not read (and may be empty), cy0 and cy1 are UNK
 // if halfocc==1, allow half occlusion
-pair<CFloatImage,CFloatImage> runCrossCheck(CFloatImage d0, CFloatImage d1, float thresh, int xonly, int halfocc)
+// region0, region1: the pixels of x0 and x1 to check (NULL: all), see regionMask
+void crossCheckDisparities(CFloatImage &x0, CFloatImage &y0, CFloatImage &x1, CFloatImage &y1, float thresh, int xonly, int halfocc,
+                           CFloatImage &cx0, CFloatImage &cy0, CFloatImage &cx1, CFloatImage &cy1,
+                           CByteImage *region0, CByteImage *region1)
 {
     int verbose=1;
     
-    //    CFloatImage d0, d1;
-    
-    //    ReadFlowFileVerb(d0, in0, verbose);
-    //    ReadFlowFileVerb(d1, in1, verbose);
-    
-    if (d0.Shape() != d1.Shape())
-        throw CError("runCrossCheck: all images need to have same size");
+    CShape sh = x0.Shape();
+    if (sh.nBands != 1 || sh != x1.Shape() || (! xonly && (sh != y0.Shape() || sh != y1.Shape())))
+        throw CError("crossCheckDisparities: all images need to have same size and 1 band");
+    if ((region0 && !sameSize(*region0, x0)) || (region1 && !sameSize(*region1, x1)))
+        throw CError("crossCheckDisparities: regions need to have the size of the images");
     
     if (verbose)
         printf("cross-checking with thresh=%g, xonly=%d, halfocc=%d\n", thresh, xonly, halfocc);
     
-    CFloatImage crossed0 = floatCrossCheck(d0, d1, thresh, xonly, -halfocc);
-    CFloatImage crossed1 = floatCrossCheck(d1, d0, thresh, xonly,  halfocc);
+    cx0.ReAllocate(sh);
+    cy0.ReAllocate(sh);
+    cx1.ReAllocate(sh);
+    cy1.ReAllocate(sh);
+    int w = sh.width, h = sh.height;
+    int b0[4], b1[4];
+    regionBounds(region0, w, h, b0[0], b0[1], b0[2], b0[3]);
+    regionBounds(region1, w, h, b1[0], b1[1], b1[2], b1[3]);
+    CFloatImage *py0 = xonly ? NULL : &y0, *py1 = xonly ? NULL : &y1;
+    
+    parallelFor(h, [&](int ystart, int yend) {
+        for (int y = ystart; y < yend; y++) {
+            crossCheckRow(x0, py0, x1, py1, y, thresh, -halfocc, region0, b0[0], b0[1], b0[2], b0[3],
+                          &cx0.Pixel(0, y, 0), &cy0.Pixel(0, y, 0));
+            crossCheckRow(x1, py1, x0, py0, y, thresh,  halfocc, region1, b1[0], b1[1], b1[2], b1[3],
+                          &cx1.Pixel(0, y, 0), &cy1.Pixel(0, y, 0));
+        }
+    }, 16);
+}
+
+// same for pair of flo images (x and y disparities as 2 bands).  the bands of planar images
+// are checked in place, and the results are planar
+pair<CFloatImage,CFloatImage> runCrossCheck(CFloatImage d0, CFloatImage d1, float thresh, int xonly, int halfocc,
+                                            CByteImage *region0, CByteImage *region1)
+{
+    if (d0.Shape() != d1.Shape())
+        throw CError("runCrossCheck: all images need to have same size");
     
-    return pair<CFloatImage,CFloatImage>(crossed0, crossed1);
-    //    WriteFlowFileVerb(crossed0, out0, verbose);
-    //    WriteFlowFileVerb(crossed1, out1, verbose);
+    pair<CFloatImage,CFloatImage> p0 = splitFloImage(d0), p1 = splitFloImage(d1);
+    CFloatImage cx0, cy0, cx1, cy1;
+    crossCheckDisparities(p0.first, p0.second, p1.first, p1.second, thresh, xonly, halfocc,
+                          cx0, cy0, cx1, cy1, region0, region1);
+    return pair<CFloatImage,CFloatImage>(mergeToFloImage(cx0, cy0, 1), mergeToFloImage(cx1, cy1, 1));
 }
 
 
@@ -573,7 +1285,99 @@ void removeLargeYdisps(CFloatImage img, float ythresh) {
 }
 
 
-void fillDispHoles(CFloatImage img, int band, vector<struct ccomp> comp, CIntImage compimg, CFloatImage& residimg, int maxpixels) {
+// window of pixels around a hole that fillDispHoles fits a plane to (and may change)
+struct holewin
+{
+    int k;                  // component of the hole
+    int x1, x2, y1, y2;     // window
+    int batch;              // holes of a batch have disjoint windows, and are filled in parallel
+};
+
+#define HOLE_CELL 16        // cell size of the grid used for finding overlapping windows
+
+// fit a plane to the known disparities in the window of hole hw.k, and fill the hole if most of
+// them are close to it (see fillDispHoles).  returns whether the hole was filled
+static int fillDispHole(CFloatImage &img, int band, CIntImage &compimg, CFloatImage &residimg, const holewin &hw)
+{
+    int x1 = hw.x1, x2 = hw.x2, y1 = hw.y1, y2 = hw.y2;
+    
+    // normal equations of the plane fit, relative to x1, y1
+    double s1=0, sx=0, sy=0, sz=0, sxx=0, sxy=0, sxz=0, syy=0, syz=0;
+    for (int y=y1; y<=y2; y++) {
+        for (int x=x1; x<=x2; x++) {
+            float z = img.Pixel(x, y, band);
+            if (z != UNK) {
+                double u = x-x1, v = y-y1;
+                s1 += 1;
+                sx += u;
+                sy += v;
+                sz += z;
+                sxx += u * u;
+                sxy += u * v;
+                sxz += u * z;
+                syy += v * v;
+                syz += v * z;
+            }
+        }
+    }
+    float pa=0, pb=0, pc=0;
+    fitPlaneSums(s1, sx, sy, sz, sxx, sxy, sxz, syy, syz, pa, pb, pc);
+    
+    // compute residual
+    static thread_local vector<float> res; // reused for all holes of a thread
+    res.clear();
+    for (int y=y1; y<=y2; y++) {
+        for (int x=x1; x<=x2; x++) {
+            float r = UNK;
+            float z = img.Pixel(x, y, band);
+            if (z != UNK) {
+                float z2 = pa * (x-x1) + pb * (y-y1) + pc;
+                r = z - z2;
+                res.push_back(fabs(r));
+            }
+            residimg.Pixel(x, y, 0) = r;
+        }
+    }
+    float q75thresh = 0.5; // require 75% of border pixels within this
+    float q90thresh = 1.0; // require 90% of border pixels within this
+    int minpts = 10; // require at least this many border pixels
+    int np = (int) res.size();
+    if (np < minpts)
+        return 0;
+    // the quantiles, as in the sorted residuals
+    int i75 = 75 * np / 100, i90 = 90 * np / 100;
+    std::nth_element(res.begin(), res.begin() + i90, res.end());
+    std::nth_element(res.begin(), res.begin() + i75, res.begin() + i90);
+    float q75 = res[i75];
+    float q90 = res[i90];
+    if (q75 > q75thresh || q90 > q90thresh)
+        return 0;
+    
+    for (int y=y1; y<=y2; y++) {
+        for (int x=x1; x<=x2; x++) {
+            float z = img.Pixel(x, y, band);
+            float z2 = pa * (x-x1) + pb * (y-y1) + pc;
+            if (z == UNK) {
+                if (compimg.Pixel(x, y, 0) == hw.k) // this hole, not another one
+                    img.Pixel(x, y, band) = z2; // fill hole
+            } else { // if not hole but residual is high, use plane value instead...  dangerous?
+                if (fabs(z - z2) > q90thresh) {
+                    img.Pixel(x, y, band) = z2; // overwrite outlier
+                }
+            }
+        }
+    }
+    // mark corner of residual image to indicate success
+    residimg.Pixel(x1, y1, 0) = 3.0; // green in rainbow color map
+    return 1;
+}
+
+// fill the holes (UNK components comp, labeled in compimg) of up to maxpixels pixels with a
+// plane fit to the disparities around them.  filling a hole changes the disparities (and the
+// residuals) in its window, so holes with overlapping windows are filled in the order of comp.
+// each hole goes into the batch after those of all earlier holes whose windows share a cell of
+// a coarse grid with its window, and the holes of a batch are filled in parallel
+void fillDispHoles(CFloatImage img, int band, const vector<struct ccomp> &comp, CIntImage compimg, CFloatImage& residimg, int maxpixels) {
     int maxsize = (int)(2.0 * sqrt(maxpixels)); // max dimension of hole (i.e. max aspect ratio = 1:4)
     
     CShape sh = img.Shape();
@@ -583,85 +1387,46 @@ void fillDispHoles(CFloatImage img, int band, vector<struct ccomp> comp, CIntIma
     residimg.ReAllocate(sh);
     residimg.FillPixels(UNK);
     
-    int n = 0;
+    int gw = (width + HOLE_CELL-1) / HOLE_CELL, gh = (height + HOLE_CELL-1) / HOLE_CELL;
+    vector<int> cellbatch(gw * gh, 0); // last batch with a window in each cell
+    vector<holewin> win;
     for (int k=1; k < (int)comp.size(); k++) {
-        struct ccomp cc = comp[k];
-        int debug = 0;
-        //if (abs(cc.x1 - 610) < 50 && abs(cc.y1 - 1580) < 50)
-        //    debug = 1;
+        const struct ccomp &cc = comp[k];
         int dx = cc.x2 - cc.x1;
         int dy = cc.y2 - cc.y1;
         if (dx <= maxsize && dy <= maxsize && cc.n <= maxpixels) {
-            if (debug)
-                printf("k=%3d, n=%3d, x=%4d..%4d, y=%4d..%4d  ", k, cc.n, cc.x1, cc.x2, cc.y1, cc.y2);
             int borderx = max(3, 6-dx); // pixels to include around each hole
             int bordery = max(3, 6-dy); // pixels to include around each hole
-            int x1 = max(cc.x1 - borderx, 0);
-            int x2 = min(cc.x2 + borderx, width-1);
-            int y1 = max(cc.y1 - bordery, 0);
-            int y2 = min(cc.y2 + bordery, height-1);
-            vector<float> vx, vy, vz;
-            for (int y=y1; y<=y2; y++) {
-                for (int x=x1; x<=x2; x++) {
-                    float z = img.Pixel(x, y, band);
-                    if (z != UNK) {
-                        vx.push_back(x-x1);
-                        vy.push_back(y-y1);
-                        vz.push_back(z);
-                    }
-                }
-            }
-            float pa=0, pb=0, pc=0;
-            fitPlane(vx, vy, vz, pa, pb, pc);
-            if (debug)
-                printf("a=%5.2f b=%5.2f c=%6.1f  ", pa, pb, pc);
-            
-            // compute residual
-            vector<float> res;
-            for (int y=y1; y<=y2; y++) {
-                for (int x=x1; x<=x2; x++) {
-                    float r = UNK;
-                    float z = img.Pixel(x, y, band);
-                    if (z != UNK) {
-                        float z2 = pa * (x-x1) + pb * (y-y1) + pc;
-                        r = z - z2;
-                        res.push_back(fabs(r));
-                    }
-                    residimg.Pixel(x, y, 0) = r;
-                }
-            }
-            std::sort(res.begin(), res.end());
-            int np = (int) res.size();
-            float q75 = res[75 * np / 100];
-            float q75thresh = 0.5; // require 75% of border pixels within this
-            float q90 = res[90 * np / 100];
-            float q90thresh = 1.0; // require 90% of border pixels within this
-            int minpts = 10; // require at least this many border pixels
-            int fillhole = (np >= minpts && q75 <= q75thresh && q90 <= q90thresh);
-            if (debug)
-                printf("np=%3d, q75=%5.2f, q90=%5.2f, filling: %s\n", np, q75, q90, fillhole ? "YES" : "NO");
-            if (fillhole) {
-                n++;
-                for (int y=y1; y<=y2; y++) {
-                    for (int x=x1; x<=x2; x++) {
-                        float z = img.Pixel(x, y, band);
-                        float z2 = pa * (x-x1) + pb * (y-y1) + pc;
-                        if (z == UNK) {
-                            if (compimg.Pixel(x, y, 0) == k) // this hole, not another one
-                                img.Pixel(x, y, band) = z2; // fill hole
-                        } else { // if not hole but residual is high, use plane value instead...  dangerous?
-                            if (fabs(z - z2) > q90thresh) {
-                                img.Pixel(x, y, band) = z2; // overwrite outlier
-                            }
-                        }
-                    }
-                }
-                // mark corner of residual image to indicate success
-                residimg.Pixel(x1, y1, 0) = 3.0; // green in rainbow color map
-            }
+            holewin hw;
+            hw.k = k;
+            hw.x1 = max(cc.x1 - borderx, 0);
+            hw.x2 = min(cc.x2 + borderx, width-1);
+            hw.y1 = max(cc.y1 - bordery, 0);
+            hw.y2 = min(cc.y2 + bordery, height-1);
+            hw.batch = 0;
+            for (int cy = hw.y1 / HOLE_CELL; cy <= hw.y2 / HOLE_CELL; cy++)
+                for (int cx = hw.x1 / HOLE_CELL; cx <= hw.x2 / HOLE_CELL; cx++)
+                    hw.batch = max(hw.batch, cellbatch[cy * gw + cx] + 1);
+            for (int cy = hw.y1 / HOLE_CELL; cy <= hw.y2 / HOLE_CELL; cy++)
+                for (int cx = hw.x1 / HOLE_CELL; cx <= hw.x2 / HOLE_CELL; cx++)
+                    cellbatch[cy * gw + cx] = hw.batch;
+            win.push_back(hw);
         }
     }
-    printf("%d / %d holes filled\n", n, (int)comp.size()-1);
+    std::stable_sort(win.begin(), win.end(), [](const holewin &a, const holewin &b) { return a.batch < b.batch; });
+    
+    std::atomic<int> n(0);
+    for (int i0 = 0, i1 = 0; i0 < (int)win.size(); i0 = i1) {
+        while (i1 < (int)win.size() && win[i1].batch == win[i0].batch)
+            i1++;
+        parallelFor(i1 - i0, [&](int jstart, int jend) {
+            int cn = 0; // holes filled in this chunk
+            for (int j = jstart; j < jend; j++)
+                cn += fillDispHole(img, band, compimg, residimg, win[i0 + j]);
+            n += cn;
+        }, 16);
+    }
+    printf("%d / %d holes filled\n", (int)n, (int)comp.size()-1);
 }
 
 void removeSmallComponents(CFloatImage img, int band, vector<struct ccomp> comp, CIntImage compimg, int mincompsize)
@@ -690,11 +1455,57 @@ void removeSmallComponents(CFloatImage img, int band, vector<struct ccomp> comp,
 // 2. run median filters in x and y channels        (if kx > 1 and/or ky > 1)
 // 3. remove small x-disparity components with size < mincompsize
 // 3. fill x-disp holes with size <= maxholesize where surrounding disps fit plane model
+// if region is given (see regionMask), only the bounding box of its pixels (plus the median
+// filter radius) is filtered, and pixels outside of it are UNK.  components and holes are
+// thus cut at the border of the box
+// the bands of planar images are used without copying (see splitNBandImage); the result is planar
 //void runFilter(char *srcfile, char *dstfile, float ythresh, int kx, int ky, int mincompsize, int maxholesize)
-CFloatImage runFilter(CFloatImage img, float ythresh, int kx, int ky, int mincompsize, int maxholesize, char *debugdir = NULL)
+CFloatImage runFilter(CFloatImage img, float ythresh, int kx, int ky, int mincompsize, int maxholesize, char *debugdir = NULL,
+                      CByteImage *region = NULL)
 {
     int verbose=1;
     
+    if (region) {
+        CShape sh = img.Shape();
+        int w = sh.width, h = sh.height, nb = sh.nBands;
+        if (!sameSize(*region, img))
+            throw CError("runFilter: region needs to have the size of the image");
+        int x0, x1, y0, y1;
+        regionBounds(region, w, h, x0, x1, y0, y1);
+        int margin = max(kx, ky) / 2 + 1;
+        x0 = max(0, x0 - margin);
+        y0 = max(0, y0 - margin);
+        x1 = min(w, x1 + margin);
+        y1 = min(h, y1 + margin);
+        CFloatImage out;
+        out.ReAllocatePlanar(sh);
+        out.FillPixels(UNK);
+        if (x0 >= x1 || y0 >= y1)
+            return out;
+        
+        // excluded pixels are UNK while filtering too
+        CFloatImage crop;
+        crop.ReAllocatePlanar(CShape(x1 - x0, y1 - y0, nb));
+        for (int y = y0; y < y1; y++) {
+            for (int x = x0; x < x1; x++) {
+                int inside = region->Pixel(x, y, 0);
+                for (int b = 0; b < nb; b++)
+                    crop.Pixel(x - x0, y - y0, b) = inside ? img.Pixel(x, y, b) : UNK;
+            }
+        }
+        if (verbose) fprintf(stderr, "filtering %d x %d region at %d, %d\n", x1 - x0, y1 - y0, x0, y0);
+        crop = runFilter(crop, ythresh, kx, ky, mincompsize, maxholesize, debugdir);
+        for (int y = y0; y < y1; y++) {
+            for (int x = x0; x < x1; x++) {
+                if (region->Pixel(x, y, 0)) {
+                    for (int b = 0; b < nb; b++)
+                        out.Pixel(x, y, b) = crop.Pixel(x - x0, y - y0, b);
+                }
+            }
+        }
+        return out;
+    }
+    
 //    CFloatImage mergeToNBandImage(vector<CFloatImage*> imgs)
 //    vector<CFloatImage> splitNBandImage(CFloatImage &merged)
     
@@ -744,7 +1555,7 @@ CFloatImage runFilter(CFloatImage img, float ythresh, int kx, int ky, int mincom
     vector<CFloatImage *> img_bands(2);
     img_bands[0] = &imgx;
     img_bands[1] = &imgy;
-    img = mergeToNBandImage(img_bands);
+    img = mergeToNBandImage(img_bands, 1);
     
     
     if (mincompsize > 0) {
@@ -789,12 +1600,22 @@ CFloatImage runFilter(CFloatImage img, float ythresh, int kx, int ky, int mincom
 // Merging
 
 
+// the images (2 bands: x and y disparities) may be interleaved or planar; the result is planar
 //void mergeDisparityMaps(char* output, char** filenames, int count, int mingroup, float maxdiff)
 CFloatImage mergeDisparityMaps(CFloatImage images[], int count, int mingroup, float maxdiff)
 {
     CFloatImage out;
     CShape sh = images[0].Shape();
-    out.ReAllocate(sh);
+    for (int k = 0; k < count; k++) {
+        if (images[k].Shape() != sh || sh.nBands != 2)
+            throw CError("mergeDisparityMaps: all images need to have same size and 2 bands");
+    }
+    out.ReAllocatePlanar(sh);
+    
+    // distance between adjacent pixels of a band, in floats (1 if planar, 2 if interleaved)
+    int step[count];
+    for (int k = 0; k < count; k++)
+        step[k] = sh.width > 1 ? (int)(&images[k].Pixel(1, 0, 0) - &images[k].Pixel(0, 0, 0)) : 1;
     
     for(int j =0; j < sh.height; j++){
         if(j % 100 == 0){
@@ -802,44 +1623,46 @@ CFloatImage mergeDisparityMaps(CFloatImage images[], int count, int mingroup, fl
             fflush(stdout);
         }
         
-        float* row[count];
+        // x and y disparities of row j, indexed by pixel * step
+        float* rowx[count];
+        float* rowy[count];
         for(int k =0; k < count; k++){
-            row[k] = &images[k].Pixel(0,j,0);
+            rowx[k] = &images[k].Pixel(0,j,0);
+            rowy[k] = &images[k].Pixel(0,j,1);
         }
         
-        float* outrow = &out.Pixel(0,j,0);
+        float* outrowx = &out.Pixel(0,j,0);
+        float* outrowy = &out.Pixel(0,j,1);
         
         for(int i =0; i < sh.width; i++){
             
             float newvalx = 0, newvaly = 0;
             int countx = 0, county = 0;
-            int x = i*2;
-            int y = x+1;
             for(int k =0; k < count; k++){
                 
-                if (row[k][x] != UNK) {
-                    newvalx += row[k][x];
+                if (rowx[k][i*step[k]] != UNK) {
+                    newvalx += rowx[k][i*step[k]];
                     countx++;
                 }
                 
-                if (row[k][y] != UNK ) {
-                    newvaly += row[k][y];
+                if (rowy[k][i*step[k]] != UNK ) {
+                    newvaly += rowy[k][i*step[k]];
                     county++;
                 }
                 
             }
             if(countx < mingroup){
-                outrow[x] = UNK;
+                outrowx[i] = UNK;
             }else{
                 newvalx /= countx;
-                outrow[x] = newvalx;
+                outrowx[i] = newvalx;
             }
             
             if(county < mingroup){
-                outrow[y] = UNK;
+                outrowy[i] = UNK;
             }else{
                 newvaly /= county;
-                outrow[y] = newvaly;
+                outrowy[i] = newvaly;
             }
             
             // at this point, outrow[x/y] (and newvalx/y) contains average of all valid pixels
@@ -847,25 +1670,26 @@ CFloatImage mergeDisparityMaps(CFloatImage images[], int count, int mingroup, fl
             
             // this is the old merging code, trying to make sense of it
             for(int k =0; k < count; k++){ // for all imges
-                if(row[k][x] != UNK  && fabs(row[k][x] - newvalx) > maxdiff){ // if find pixel far from average
+                float valx = rowx[k][i*step[k]];
+                if(valx != UNK  && fabs(valx - newvalx) > maxdiff){ // if find pixel far from average
                     vector<float> pixels;
                     for(int z =0; z < count; z++){ // for all imgages again??
-                        if(row[z][x] != UNK){
-                            pixels.push_back(row[z][x]); // collect all pixels
+                        if(rowx[z][i*step[z]] != UNK){
+                            pixels.push_back(rowx[z][i*step[z]]); // collect all pixels
                         }
                     }
                     if((int)pixels.size() < mingroup){ // seems like this shouldn't happen, filtered earlier...
-                        outrow[x] = UNK;
+                        outrowx[i] = UNK;
                         
                     }else{
-                        outrow[x] = robustAverage(pixels, maxdiff, mingroup); // call robust avg (in Utils.cpp)
+                        outrowx[i] = robustAverage(pixels, maxdiff, mingroup); // call robust avg (in Utils.cpp)
                         if ((0)){
                             printf("values were: ");
                             for(int i = 0; i < (int)pixels.size(); i++){
                                 printf(" %.2f",pixels[i]);
                             }
                             printf("\n");
-                            printf("average was: %f\n\n",outrow[x]);
+                            printf("average was: %f\n\n",outrowx[i]);
                         }
                     }
                     break; // and break k loop
@@ -1,7 +1,33 @@
-void computeDisparities(CFloatImage &fim0, CFloatImage &fim1, CFloatImage &fout0, CFloatImage &fout1, int dXmin, int dXmax, int dYmin, int dYmax);
-pair<CFloatImage,CFloatImage> runCrossCheck(CFloatImage d0, CFloatImage d1, float thresh, int xonly, int halfocc);
+#include <memory>
+#include "DisparityRegion.h"
+
+// regions (see DisparityRegion.h): pixels in the rectangle x, y, width, height (width <= 0: whole
+// image) where mask (if given) is nonzero.  255 inside, 0 outside.  only these pixels are
+// matched, checked and filtered
+CByteImage regionMask(CShape sh, int x, int y, int width, int height, CByteImage *mask = NULL);
+
+// whether matchImages preselects candidates on packed 16-bit codes (default; gives the same
+// matches, turn off to compare with the float-only search)
+void setPackedCodeMatching(int on);
+
+// search structures of a code image, for matching other code images against it.  only read
+// while matching, so one index can be shared by calls and threads as long as the code image
+// does not change.  scanline: for rectified pairs with a given range (see computeDisparities)
+struct MatchIndex;
+std::shared_ptr<const MatchIndex> buildMatchIndex(CFloatImage &code, int scanline);
+
+void computeDisparities(CFloatImage &fim0, CFloatImage &fim1, CFloatImage &fout0, CFloatImage &fout1, int dXmin, int dXmax, int dYmin, int dYmax,
+                        int levels = 0, int rectified = 0,
+                        std::shared_ptr<const MatchIndex> index0 = nullptr, std::shared_ptr<const MatchIndex> index1 = nullptr,
+                        CByteImage *region0 = NULL, CByteImage *region1 = NULL, int autorange = 0);
+void crossCheckDisparities(CFloatImage &x0, CFloatImage &y0, CFloatImage &x1, CFloatImage &y1, float thresh, int xonly, int halfocc,
+                           CFloatImage &cx0, CFloatImage &cy0, CFloatImage &cx1, CFloatImage &cy1,
+                           CByteImage *region0 = NULL, CByteImage *region1 = NULL);
+pair<CFloatImage,CFloatImage> runCrossCheck(CFloatImage d0, CFloatImage d1, float thresh, int xonly, int halfocc,
+                                            CByteImage *region0 = NULL, CByteImage *region1 = NULL);
 //CFloatImage runFilter(CFloatImage img, float ythresh, int kx, int ky, int mincompsize, int maxholesize);
-CFloatImage runFilter(CFloatImage img, float ythresh, int kx, int ky, int mincompsize, int maxholesize, char *debugdir = NULL);
+CFloatImage runFilter(CFloatImage img, float ythresh, int kx, int ky, int mincompsize, int maxholesize, char *debugdir = NULL,
+                      CByteImage *region = NULL);
 CFloatImage mergeDisparityMaps(CFloatImage images[], int count, int mingroup, float maxdiff);
 void mergeDisparityMaps2(float maxdiff, int nV, int nR, char* outdfile, char* outsdfile, char* outnfile, char *inmdfile, char **invdfiles, char **inrdfiles);
  // end
@@ -0,0 +1,26 @@
+///////////////////////////////////////////////////////////////////////////
+//
+// NAME
+//  DisparityRegion.h -- the pixels disparities are computed for
+//
+// DESCRIPTION
+//  Restricts matching (disparitiesOfRefinedImgs), cross checking and
+//  filtering to the pixels in a rectangle where an optional foreground
+//  mask (the format of foregroundErase: 0 = erased) is nonzero.  All
+//  other pixels are UNK.  A NULL region means all pixels.
+//
+//  Plain C, so that it can also be used from Swift via processing_wrapper.hpp.
+//  Converted to a byte image by regionMask() (Disparities.cpp).
+//
+///////////////////////////////////////////////////////////////////////////
+
+#ifndef DisparityRegion_h
+#define DisparityRegion_h
+
+typedef struct DisparityRegion {
+    int x, y, width, height;    // rectangle; width <= 0: the whole image
+    const char *maskfile;       // foreground mask of the size of the image, or NULL
+} DisparityRegion;
+
+#endif /* DisparityRegion_h */
+ // end
@@ -0,0 +1,154 @@
+///////////////////////////////////////////////////////////////////////////
+//
+// NAME
+//  FilterSIMD.cpp -- vectorized parts of medianfilter
+//
+// DESCRIPTION
+//  One window per float lane (16, 8 or 4): value i of the windows is one
+//  vector, loaded from row dy at offset dx, and a compare-exchange of values
+//  i and j is a min and a max of two vectors.  UNK (infinity) is larger than
+//  all other values, as with std::sort.  The symmetric hole filling of
+//  median3x3 becomes a masked subtraction for each of the 8 outer values.
+//
+// SEE ALSO
+//  FilterSIMD.h          definition and explanation
+//
+///////////////////////////////////////////////////////////////////////////
+
+#include <math.h>
+#include "RefineSIMD.h"
+#include "FilterSIMD.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define FILTER_X86 1
+#include <immintrin.h>
+#endif
+
+#define NETWORK_MAXWIN (NETWORK_MAXSIZE * NETWORK_MAXSIZE)
+#define HOLES_MAXDIFF 2.0f      // the maxdiff of median3x3 (Utils.cpp)
+
+#ifdef FILTER_X86
+
+AVX512_KERNELS_BEGIN
+
+__attribute__((target("avx512f")))
+static int sortWindowsAVX512(const float *const *rows, int size, int n, const short *net, int ncmp, int holes,
+                             const short *out, int nout, float *dst, int stride)
+{
+    const __m512 unk = _mm512_set1_ps(INFINITY);
+    const __m512 maxdiff = _mm512_set1_ps(HOLES_MAXDIFF);
+    __m512 v[NETWORK_MAXWIN];
+    int x = 0;
+    for (; x + 16 <= n; x += 16) {
+        for (int dy = 0, i = 0; dy < size; dy++)
+            for (int dx = 0; dx < size; dx++, i++)
+                v[i] = _mm512_loadu_ps(rows[dy] + x + dx);
+        if (holes) {
+            // UNK value k gets c - d, with d the difference of the opposite value from the center c
+            for (int k = 0; k < 9; k++) {
+                if (k == 4)
+                    continue;
+                __m512 d = _mm512_sub_ps(v[8 - k], v[4]);
+                __mmask16 m = _mm512_cmp_ps_mask(v[k], unk, _CMP_EQ_OQ) &
+                              _mm512_cmp_ps_mask(_mm512_abs_ps(d), maxdiff, _CMP_LE_OQ);
+                v[k] = _mm512_mask_sub_ps(v[k], m, v[4], d);
+            }
+        }
+        for (int c = 0; c < ncmp; c++) {
+            __m512 a = v[net[2*c]], b = v[net[2*c + 1]];
+            v[net[2*c]] = _mm512_min_ps(a, b);
+            v[net[2*c + 1]] = _mm512_max_ps(a, b);
+        }
+        for (int o = 0; o < nout; o++)
+            _mm512_storeu_ps(dst + o*stride + x, v[out[o]]);
+    }
+    return x;
+}
+
+AVX512_KERNELS_END
+
+__attribute__((target("avx2")))
+static int sortWindowsAVX2(const float *const *rows, int size, int n, const short *net, int ncmp, int holes,
+                           const short *out, int nout, float *dst, int stride)
+{
+    const __m256 unk = _mm256_set1_ps(INFINITY);
+    const __m256 maxdiff = _mm256_set1_ps(HOLES_MAXDIFF);
+    const __m256 sign = _mm256_set1_ps(-0.0f);
+    __m256 v[NETWORK_MAXWIN];
+    int x = 0;
+    for (; x + 8 <= n; x += 8) {
+        for (int dy = 0, i = 0; dy < size; dy++)
+            for (int dx = 0; dx < size; dx++, i++)
+                v[i] = _mm256_loadu_ps(rows[dy] + x + dx);
+        if (holes) {
+            for (int k = 0; k < 9; k++) {
+                if (k == 4)
+                    continue;
+                __m256 d = _mm256_sub_ps(v[8 - k], v[4]);
+                __m256 m = _mm256_and_ps(_mm256_cmp_ps(v[k], unk, _CMP_EQ_OQ),
+                                         _mm256_cmp_ps(_mm256_andnot_ps(sign, d), maxdiff, _CMP_LE_OQ));
+                v[k] = _mm256_blendv_ps(v[k], _mm256_sub_ps(v[4], d), m);
+            }
+        }
+        for (int c = 0; c < ncmp; c++) {
+            __m256 a = v[net[2*c]], b = v[net[2*c + 1]];
+            v[net[2*c]] = _mm256_min_ps(a, b);
+            v[net[2*c + 1]] = _mm256_max_ps(a, b);
+        }
+        for (int o = 0; o < nout; o++)
+            _mm256_storeu_ps(dst + o*stride + x, v[out[o]]);
+    }
+    return x;
+}
+
+__attribute__((target("sse2")))
+static int sortWindowsSSE2(const float *const *rows, int size, int n, const short *net, int ncmp, int holes,
+                           const short *out, int nout, float *dst, int stride)
+{
+    const __m128 unk = _mm_set1_ps(INFINITY);
+    const __m128 maxdiff = _mm_set1_ps(HOLES_MAXDIFF);
+    const __m128 sign = _mm_set1_ps(-0.0f);
+    __m128 v[NETWORK_MAXWIN];
+    int x = 0;
+    for (; x + 4 <= n; x += 4) {
+        for (int dy = 0, i = 0; dy < size; dy++)
+            for (int dx = 0; dx < size; dx++, i++)
+                v[i] = _mm_loadu_ps(rows[dy] + x + dx);
+        if (holes) {
+            for (int k = 0; k < 9; k++) {
+                if (k == 4)
+                    continue;
+                __m128 d = _mm_sub_ps(v[8 - k], v[4]);
+                __m128 m = _mm_and_ps(_mm_cmpeq_ps(v[k], unk), _mm_cmple_ps(_mm_andnot_ps(sign, d), maxdiff));
+                v[k] = _mm_or_ps(_mm_andnot_ps(m, v[k]), _mm_and_ps(m, _mm_sub_ps(v[4], d)));
+            }
+        }
+        for (int c = 0; c < ncmp; c++) {
+            __m128 a = v[net[2*c]], b = v[net[2*c + 1]];
+            v[net[2*c]] = _mm_min_ps(a, b);
+            v[net[2*c + 1]] = _mm_max_ps(a, b);
+        }
+        for (int o = 0; o < nout; o++)
+            _mm_storeu_ps(dst + o*stride + x, v[out[o]]);
+    }
+    return x;
+}
+
+#endif // FILTER_X86
+
+int sortWindowsSIMD(const float *const *rows, int size, int n, const short *net, int ncmp, int holes,
+                    const short *out, int nout, float *dst, int stride)
+{
+    if (size > NETWORK_MAXSIZE || (holes && size != 3))
+        return 0;
+#ifdef FILTER_X86
+    switch (getSIMDLevel()) {
+        case simd_avx512: return sortWindowsAVX512(rows, size, n, net, ncmp, holes, out, nout, dst, stride);
+        case simd_avx2:   return sortWindowsAVX2(rows, size, n, net, ncmp, holes, out, nout, dst, stride);
+        case simd_sse2:   return sortWindowsSSE2(rows, size, n, net, ncmp, holes, out, nout, dst, stride);
+        default: break;
+    }
+#endif
+    return 0;
+}
+ // end
@@ -0,0 +1,37 @@
+///////////////////////////////////////////////////////////////////////////
+//
+// NAME
+//  FilterSIMD.h -- vectorized parts of medianfilter (see Utils.cpp)
+//
+// DESCRIPTION
+//  The small median filters (3x3 and 5x5) sort the windows of the inner
+//  pixels with a sorting network: a fixed sequence of compare-exchanges
+//  (min and max) that does not depend on the values, so that the windows of
+//  4 (SSE2), 8 (AVX2) or 16 (AVX-512) adjacent pixels are sorted at once,
+//  one pixel per float lane.  The networks are built by medianfilter, with
+//  only the compare-exchanges that the values it needs depend on.
+//
+//  Uses the SIMD level of getSIMDLevel() (see RefineSIMD.h), and plain C++
+//  on other architectures.
+//
+// SEE ALSO
+//  FilterSIMD.cpp        Implementation
+//  RefineSIMD.h          SIMD level detection
+//
+///////////////////////////////////////////////////////////////////////////
+
+#ifndef FilterSIMD_h
+#define FilterSIMD_h
+
+#define NETWORK_MAXSIZE 5       // largest window (size x size) sorted with a network
+
+// sort the size x size windows of n adjacent pixels with the compare-exchanges net[2*c],
+// net[2*c+1], c = 0..ncmp-1 (value net[2*c] gets the smaller one), where value dy*size + dx of
+// pixel x = 0..n-1 is rows[dy][x + dx].  stores value out[o] of each sorted window in
+// dst[o*stride + x], o = 0..nout-1.  if holes, the 3x3 windows are first filled as in median3x3.
+// returns the number of pixels done, from the start; the rest is left to the caller
+int sortWindowsSIMD(const float *const *rows, int size, int n, const short *net, int ncmp, int holes,
+                    const short *out, int nout, float *dst, int stride);
+
+#endif /* FilterSIMD_h */
+ // end
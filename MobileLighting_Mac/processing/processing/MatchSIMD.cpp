@@ -0,0 +1,409 @@
+///////////////////////////////////////////////////////////////////////////
+//
+// NAME
+//  MatchSIMD.cpp -- vectorized parts of matchImages
+//
+// DESCRIPTION
+//  Candidate preselection: the (u, v) pair of a pixel is one 32-bit lane.
+//
+//  AVX-512: 16 pixels; u and v are split off into 32-bit lanes, and the
+//           indices of the selected lanes are stored with compressstore.
+//  AVX2:    8 pixels, SSE2: 4 pixels; the absolute differences are
+//           computed with saturating 16-bit subtractions, a pixel is
+//           selected if both of its 16-bit lanes are within t, and the
+//           indices are taken from the bits of movemask.
+//
+//  Subpixel corrections: one match per float lane (16, 8 or 4).  The
+//  quadrant of subpix2d is selected with blends, and its early returns
+//  become masks that zero the corrections at the end.
+//
+// SEE ALSO
+//  MatchSIMD.h           definition and explanation
+//
+///////////////////////////////////////////////////////////////////////////
+
+#include <stdlib.h>
+#include "RefineSIMD.h"
+#include "MatchSIMD.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define MATCH_X86 1
+#include <immintrin.h>
+#endif
+
+// plain version for pixels i0..n-1, used for leftover pixels and on other architectures
+static int selectScalar(const unsigned short *uv, int i0, int n, int qu, int qv, int t, int *sel)
+{
+    int cnt = 0;
+    for (int i = i0; i < n; i++) {
+        if (abs(uv[2*i] - qu) <= t && abs(uv[2*i+1] - qv) <= t)
+            sel[cnt++] = i;
+    }
+    return cnt;
+}
+
+#ifdef MATCH_X86
+
+// the kernels return the number of selected pixels, and in *done the position up to which
+// they did the pixels
+
+AVX512_KERNELS_BEGIN
+
+__attribute__((target("avx512f")))
+static int selectAVX512(const unsigned short *uv, int n, int qu, int qv, int t, int *sel, int *done)
+{
+    const __m512i lo16 = _mm512_set1_epi32(0xffff);
+    const __m512i vqu = _mm512_set1_epi32(qu);
+    const __m512i vqv = _mm512_set1_epi32(qv);
+    const __m512i vt = _mm512_set1_epi32(t);
+    __m512i idx = _mm512_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+    const __m512i step = _mm512_set1_epi32(16);
+    int cnt = 0, i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m512i p = _mm512_loadu_si512((const void *)(uv + 2*i));
+        __m512i du = _mm512_abs_epi32(_mm512_sub_epi32(_mm512_and_si512(p, lo16), vqu));
+        __m512i dv = _mm512_abs_epi32(_mm512_sub_epi32(_mm512_srli_epi32(p, 16), vqv));
+        __mmask16 m = _mm512_cmple_epi32_mask(du, vt) & _mm512_cmple_epi32_mask(dv, vt);
+        _mm512_mask_compressstoreu_epi32((void *)(sel + cnt), m, idx);
+        cnt += __builtin_popcount(m);
+        idx = _mm512_add_epi32(idx, step);
+    }
+    *done = i;
+    return cnt;
+}
+
+AVX512_KERNELS_END
+
+__attribute__((target("avx2")))
+static int selectAVX2(const unsigned short *uv, int n, int qu, int qv, int t, int *sel, int *done)
+{
+    const __m256i q = _mm256_set1_epi32((int)((unsigned)qu | ((unsigned)qv << 16)));
+    const __m256i vt = _mm256_set1_epi16((short)t);
+    const __m256i zero = _mm256_setzero_si256();
+    int cnt = 0, i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m256i p = _mm256_loadu_si256((const __m256i *)(uv + 2*i));
+        __m256i d = _mm256_or_si256(_mm256_subs_epu16(p, q), _mm256_subs_epu16(q, p));
+        // both halves of a lane are 0 iff u and v are within t
+        __m256i ok = _mm256_cmpeq_epi32(_mm256_subs_epu16(d, vt), zero);
+        int m = _mm256_movemask_ps(_mm256_castsi256_ps(ok));
+        while (m) {
+            sel[cnt++] = i + __builtin_ctz(m);
+            m &= m - 1;
+        }
+    }
+    *done = i;
+    return cnt;
+}
+
+__attribute__((target("sse2")))
+static int selectSSE2(const unsigned short *uv, int n, int qu, int qv, int t, int *sel, int *done)
+{
+    const __m128i q = _mm_set1_epi32((int)((unsigned)qu | ((unsigned)qv << 16)));
+    const __m128i vt = _mm_set1_epi16((short)t);
+    const __m128i zero = _mm_setzero_si128();
+    int cnt = 0, i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m128i p = _mm_loadu_si128((const __m128i *)(uv + 2*i));
+        __m128i d = _mm_or_si128(_mm_subs_epu16(p, q), _mm_subs_epu16(q, p));
+        __m128i ok = _mm_cmpeq_epi32(_mm_subs_epu16(d, vt), zero);
+        int m = _mm_movemask_ps(_mm_castsi128_ps(ok));
+        while (m) {
+            sel[cnt++] = i + __builtin_ctz(m);
+            m &= m - 1;
+        }
+    }
+    *done = i;
+    return cnt;
+}
+
+// subpixel corrections: the constants of subpix2d and fitplane4 (Disparities.cpp)
+#define SUBPIX_MAXDIFF 2.0f     // max difference of the plane values from the center value
+#define SUBPIX_MAXRESID 0.2f    // max RMS residual of the planes
+#define SUBPIX_MAXCOR 0.99f     // max correction
+
+AVX512_KERNELS_BEGIN
+
+// avx512f implies FMA, and the compiler may fuse _mm512_mul_ps with an addition; the
+// rounding variant is not fused
+__attribute__((target("avx512f")))
+static inline __m512 mulAVX512(__m512 a, __m512 b)
+{
+    return _mm512_mul_round_ps(a, b, _MM_FROUND_CUR_DIRECTION);
+}
+
+__attribute__((target("avx512f")))
+static inline void quadrantAVX512(const __m512 *f, __mmask16 ix, __mmask16 iy,
+                                  __m512 &f00, __m512 &f10, __m512 &f01, __m512 &f11)
+{
+    // rows iy and iy + 1 of the 3 columns, then columns ix and ix + 1
+    __m512 g0[3], g1[3];
+    for (int x = 0; x < 3; x++) {
+        g0[x] = _mm512_mask_blend_ps(iy, f[3*x], f[3*x+1]);
+        g1[x] = _mm512_mask_blend_ps(iy, f[3*x+1], f[3*x+2]);
+    }
+    f00 = _mm512_mask_blend_ps(ix, g0[0], g0[1]);
+    f10 = _mm512_mask_blend_ps(ix, g0[1], g0[2]);
+    f01 = _mm512_mask_blend_ps(ix, g1[0], g1[1]);
+    f11 = _mm512_mask_blend_ps(ix, g1[1], g1[2]);
+}
+
+// fitplane4 to the quadrant ix, iy of the 3x3 values f; returns the lanes where the fit is
+// good enough for subpix2d
+__attribute__((target("avx512f")))
+static inline __mmask16 fitPlaneAVX512(__m512 val, const __m512 *f, __mmask16 ix, __mmask16 iy,
+                                       __m512 &a, __m512 &b, __m512 &c)
+{
+    __m512 f00, f10, f01, f11;
+    quadrantAVX512(f, ix, iy, f00, f10, f01, f11);
+    const __m512 maxdiff = _mm512_set1_ps(SUBPIX_MAXDIFF);
+    __mmask16 bad = _mm512_cmp_ps_mask(_mm512_abs_ps(_mm512_sub_ps(f00, f[4])), maxdiff, _CMP_GT_OQ) |
+                    _mm512_cmp_ps_mask(_mm512_abs_ps(_mm512_sub_ps(f10, f[4])), maxdiff, _CMP_GT_OQ) |
+                    _mm512_cmp_ps_mask(_mm512_abs_ps(_mm512_sub_ps(f01, f[4])), maxdiff, _CMP_GT_OQ) |
+                    _mm512_cmp_ps_mask(_mm512_abs_ps(_mm512_sub_ps(f11, f[4])), maxdiff, _CMP_GT_OQ);
+    __m512 mi = _mm512_min_ps(_mm512_min_ps(f00, f10), _mm512_min_ps(f01, f11));
+    __m512 ma = _mm512_max_ps(_mm512_max_ps(f00, f10), _mm512_max_ps(f01, f11));
+    bad |= _mm512_cmp_ps_mask(val, mi, _CMP_LT_OQ) | _mm512_cmp_ps_mask(val, ma, _CMP_GT_OQ);
+    
+    const __m512 two = _mm512_set1_ps(2.0f), mtwo = _mm512_set1_ps(-2.0f);
+    const __m512 three = _mm512_set1_ps(3.0f), quarter = _mm512_set1_ps(0.25f);
+    a = mulAVX512(quarter, _mm512_add_ps(_mm512_sub_ps(_mm512_add_ps(mulAVX512(mtwo, f00), mulAVX512(two, f10)),
+                                                       mulAVX512(two, f01)), mulAVX512(two, f11)));
+    b = mulAVX512(quarter, _mm512_add_ps(_mm512_add_ps(_mm512_sub_ps(mulAVX512(mtwo, f00), mulAVX512(two, f10)),
+                                                       mulAVX512(two, f01)), mulAVX512(two, f11)));
+    c = mulAVX512(quarter, _mm512_sub_ps(_mm512_add_ps(_mm512_add_ps(mulAVX512(three, f00), f10), f01), f11));
+    __m512 r00 = _mm512_sub_ps(c, f00);
+    __m512 r10 = _mm512_sub_ps(_mm512_add_ps(a, c), f10);
+    __m512 r01 = _mm512_sub_ps(_mm512_add_ps(b, c), f01);
+    __m512 r11 = _mm512_sub_ps(_mm512_add_ps(_mm512_add_ps(a, b), c), f11);
+    __m512 s = _mm512_add_ps(_mm512_add_ps(_mm512_add_ps(mulAVX512(r00, r00), mulAVX512(r10, r10)),
+                                           mulAVX512(r01, r01)), mulAVX512(r11, r11));
+    __m512 res = _mm512_sqrt_ps(mulAVX512(s, quarter));
+    return ~bad & _mm512_cmp_ps_mask(res, _mm512_set1_ps(SUBPIX_MAXRESID), _CMP_LE_OQ);
+}
+
+__attribute__((target("avx512f")))
+static int subpixAVX512(int n, int stride, const float *vx, const float *vy, const float *fx, const float *fy,
+                        float *corx, float *cory)
+{
+    const __m512 one = _mm512_set1_ps(1.0f), maxcor = _mm512_set1_ps(SUBPIX_MAXCOR);
+    const __m512 sign = _mm512_set1_ps(-0.0f);
+    int i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m512 fxv[9], fyv[9];
+        for (int k = 0; k < 9; k++) {
+            fxv[k] = _mm512_loadu_ps(fx + k*stride + i);
+            fyv[k] = _mm512_loadu_ps(fy + k*stride + i);
+        }
+        __m512 vvx = _mm512_loadu_ps(vx + i), vvy = _mm512_loadu_ps(vy + i);
+        __mmask16 ix = _mm512_cmp_ps_mask(vvx, fxv[4], _CMP_GT_OQ);
+        __mmask16 iy = _mm512_cmp_ps_mask(vvy, fyv[4], _CMP_GT_OQ);
+        __m512 ax, bx, cx, ay, by, cy;
+        __mmask16 ok = fitPlaneAVX512(vvx, fxv, ix, iy, ax, bx, cx) & fitPlaneAVX512(vvy, fyv, ix, iy, ay, by, cy);
+        __m512 det = _mm512_sub_ps(mulAVX512(ax, by), mulAVX512(bx, ay));
+        ok &= _mm512_cmp_ps_mask(det, _mm512_setzero_ps(), _CMP_NEQ_UQ);
+        __m512 tx = _mm512_sub_ps(vvx, cx), ty = _mm512_sub_ps(vvy, cy);
+        __m512 px = _mm512_div_ps(_mm512_sub_ps(mulAVX512(by, tx), mulAVX512(bx, ty)), det);
+        __m512 nay = _mm512_castsi512_ps(_mm512_xor_si512(_mm512_castps_si512(ay), _mm512_castps_si512(sign)));
+        __m512 py = _mm512_div_ps(_mm512_add_ps(mulAVX512(nay, tx), mulAVX512(ax, ty)), det);
+        __m512 cx1 = _mm512_sub_ps(_mm512_add_ps(px, _mm512_maskz_mov_ps(ix, one)), one);
+        __m512 cy1 = _mm512_sub_ps(_mm512_add_ps(py, _mm512_maskz_mov_ps(iy, one)), one);
+        ok &= ~(_mm512_cmp_ps_mask(_mm512_abs_ps(cx1), maxcor, _CMP_GT_OQ) |
+                _mm512_cmp_ps_mask(_mm512_abs_ps(cy1), maxcor, _CMP_GT_OQ));
+        _mm512_storeu_ps(corx + i, _mm512_maskz_mov_ps(ok, cx1));
+        _mm512_storeu_ps(cory + i, _mm512_maskz_mov_ps(ok, cy1));
+    }
+    return i;
+}
+
+AVX512_KERNELS_END
+
+__attribute__((target("avx2")))
+static inline __m256 absAVX2(__m256 a)
+{
+    return _mm256_andnot_ps(_mm256_set1_ps(-0.0f), a);
+}
+
+__attribute__((target("avx2")))
+static inline __m256 fitPlaneAVX2(__m256 val, const __m256 *f, __m256 ix, __m256 iy, __m256 &a, __m256 &b, __m256 &c)
+{
+    __m256 g0[3], g1[3];
+    for (int x = 0; x < 3; x++) {
+        g0[x] = _mm256_blendv_ps(f[3*x], f[3*x+1], iy);
+        g1[x] = _mm256_blendv_ps(f[3*x+1], f[3*x+2], iy);
+    }
+    __m256 f00 = _mm256_blendv_ps(g0[0], g0[1], ix);
+    __m256 f10 = _mm256_blendv_ps(g0[1], g0[2], ix);
+    __m256 f01 = _mm256_blendv_ps(g1[0], g1[1], ix);
+    __m256 f11 = _mm256_blendv_ps(g1[1], g1[2], ix);
+    const __m256 maxdiff = _mm256_set1_ps(SUBPIX_MAXDIFF);
+    __m256 bad = _mm256_or_ps(_mm256_or_ps(_mm256_cmp_ps(absAVX2(_mm256_sub_ps(f00, f[4])), maxdiff, _CMP_GT_OQ),
+                                           _mm256_cmp_ps(absAVX2(_mm256_sub_ps(f10, f[4])), maxdiff, _CMP_GT_OQ)),
+                              _mm256_or_ps(_mm256_cmp_ps(absAVX2(_mm256_sub_ps(f01, f[4])), maxdiff, _CMP_GT_OQ),
+                                           _mm256_cmp_ps(absAVX2(_mm256_sub_ps(f11, f[4])), maxdiff, _CMP_GT_OQ)));
+    __m256 mi = _mm256_min_ps(_mm256_min_ps(f00, f10), _mm256_min_ps(f01, f11));
+    __m256 ma = _mm256_max_ps(_mm256_max_ps(f00, f10), _mm256_max_ps(f01, f11));
+    bad = _mm256_or_ps(bad, _mm256_or_ps(_mm256_cmp_ps(val, mi, _CMP_LT_OQ), _mm256_cmp_ps(val, ma, _CMP_GT_OQ)));
+    
+    const __m256 two = _mm256_set1_ps(2.0f), mtwo = _mm256_set1_ps(-2.0f);
+    const __m256 three = _mm256_set1_ps(3.0f), quarter = _mm256_set1_ps(0.25f);
+    a = _mm256_mul_ps(quarter, _mm256_add_ps(_mm256_sub_ps(_mm256_add_ps(_mm256_mul_ps(mtwo, f00), _mm256_mul_ps(two, f10)),
+                                                           _mm256_mul_ps(two, f01)), _mm256_mul_ps(two, f11)));
+    b = _mm256_mul_ps(quarter, _mm256_add_ps(_mm256_add_ps(_mm256_sub_ps(_mm256_mul_ps(mtwo, f00), _mm256_mul_ps(two, f10)),
+                                                           _mm256_mul_ps(two, f01)), _mm256_mul_ps(two, f11)));
+    c = _mm256_mul_ps(quarter, _mm256_sub_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(three, f00), f10), f01), f11));
+    __m256 r00 = _mm256_sub_ps(c, f00);
+    __m256 r10 = _mm256_sub_ps(_mm256_add_ps(a, c), f10);
+    __m256 r01 = _mm256_sub_ps(_mm256_add_ps(b, c), f01);
+    __m256 r11 = _mm256_sub_ps(_mm256_add_ps(_mm256_add_ps(a, b), c), f11);
+    __m256 s = _mm256_add_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(r00, r00), _mm256_mul_ps(r10, r10)),
+                                           _mm256_mul_ps(r01, r01)), _mm256_mul_ps(r11, r11));
+    __m256 res = _mm256_sqrt_ps(_mm256_mul_ps(s, quarter));
+    return _mm256_andnot_ps(bad, _mm256_cmp_ps(res, _mm256_set1_ps(SUBPIX_MAXRESID), _CMP_LE_OQ));
+}
+
+__attribute__((target("avx2")))
+static int subpixAVX2(int n, int stride, const float *vx, const float *vy, const float *fx, const float *fy,
+                      float *corx, float *cory)
+{
+    const __m256 one = _mm256_set1_ps(1.0f), maxcor = _mm256_set1_ps(SUBPIX_MAXCOR);
+    const __m256 sign = _mm256_set1_ps(-0.0f), zero = _mm256_setzero_ps();
+    int i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m256 fxv[9], fyv[9];
+        for (int k = 0; k < 9; k++) {
+            fxv[k] = _mm256_loadu_ps(fx + k*stride + i);
+            fyv[k] = _mm256_loadu_ps(fy + k*stride + i);
+        }
+        __m256 vvx = _mm256_loadu_ps(vx + i), vvy = _mm256_loadu_ps(vy + i);
+        __m256 ix = _mm256_cmp_ps(vvx, fxv[4], _CMP_GT_OQ);
+        __m256 iy = _mm256_cmp_ps(vvy, fyv[4], _CMP_GT_OQ);
+        __m256 ax, bx, cx, ay, by, cy;
+        __m256 ok = _mm256_and_ps(fitPlaneAVX2(vvx, fxv, ix, iy, ax, bx, cx), fitPlaneAVX2(vvy, fyv, ix, iy, ay, by, cy));
+        __m256 det = _mm256_sub_ps(_mm256_mul_ps(ax, by), _mm256_mul_ps(bx, ay));
+        ok = _mm256_and_ps(ok, _mm256_cmp_ps(det, zero, _CMP_NEQ_UQ));
+        __m256 tx = _mm256_sub_ps(vvx, cx), ty = _mm256_sub_ps(vvy, cy);
+        __m256 px = _mm256_div_ps(_mm256_sub_ps(_mm256_mul_ps(by, tx), _mm256_mul_ps(bx, ty)), det);
+        __m256 py = _mm256_div_ps(_mm256_add_ps(_mm256_mul_ps(_mm256_xor_ps(ay, sign), tx), _mm256_mul_ps(ax, ty)), det);
+        __m256 cx1 = _mm256_sub_ps(_mm256_add_ps(px, _mm256_and_ps(ix, one)), one);
+        __m256 cy1 = _mm256_sub_ps(_mm256_add_ps(py, _mm256_and_ps(iy, one)), one);
+        ok = _mm256_andnot_ps(_mm256_or_ps(_mm256_cmp_ps(absAVX2(cx1), maxcor, _CMP_GT_OQ),
+                                           _mm256_cmp_ps(absAVX2(cy1), maxcor, _CMP_GT_OQ)), ok);
+        _mm256_storeu_ps(corx + i, _mm256_and_ps(ok, cx1));
+        _mm256_storeu_ps(cory + i, _mm256_and_ps(ok, cy1));
+    }
+    return i;
+}
+
+__attribute__((target("sse2")))
+static inline __m128 selectSSE2(__m128 mask, __m128 a, __m128 b) // mask ? b : a, like blendv
+{
+    return _mm_or_ps(_mm_andnot_ps(mask, a), _mm_and_ps(mask, b));
+}
+
+__attribute__((target("sse2")))
+static inline __m128 absSSE2(__m128 a)
+{
+    return _mm_andnot_ps(_mm_set1_ps(-0.0f), a);
+}
+
+__attribute__((target("sse2")))
+static inline __m128 fitPlaneSSE2(__m128 val, const __m128 *f, __m128 ix, __m128 iy, __m128 &a, __m128 &b, __m128 &c)
+{
+    __m128 g0[3], g1[3];
+    for (int x = 0; x < 3; x++) {
+        g0[x] = selectSSE2(iy, f[3*x], f[3*x+1]);
+        g1[x] = selectSSE2(iy, f[3*x+1], f[3*x+2]);
+    }
+    __m128 f00 = selectSSE2(ix, g0[0], g0[1]);
+    __m128 f10 = selectSSE2(ix, g0[1], g0[2]);
+    __m128 f01 = selectSSE2(ix, g1[0], g1[1]);
+    __m128 f11 = selectSSE2(ix, g1[1], g1[2]);
+    const __m128 maxdiff = _mm_set1_ps(SUBPIX_MAXDIFF);
+    __m128 bad = _mm_or_ps(_mm_or_ps(_mm_cmpgt_ps(absSSE2(_mm_sub_ps(f00, f[4])), maxdiff),
+                                     _mm_cmpgt_ps(absSSE2(_mm_sub_ps(f10, f[4])), maxdiff)),
+                           _mm_or_ps(_mm_cmpgt_ps(absSSE2(_mm_sub_ps(f01, f[4])), maxdiff),
+                                     _mm_cmpgt_ps(absSSE2(_mm_sub_ps(f11, f[4])), maxdiff)));
+    __m128 mi = _mm_min_ps(_mm_min_ps(f00, f10), _mm_min_ps(f01, f11));
+    __m128 ma = _mm_max_ps(_mm_max_ps(f00, f10), _mm_max_ps(f01, f11));
+    bad = _mm_or_ps(bad, _mm_or_ps(_mm_cmplt_ps(val, mi), _mm_cmpgt_ps(val, ma)));
+    
+    const __m128 two = _mm_set1_ps(2.0f), mtwo = _mm_set1_ps(-2.0f);
+    const __m128 three = _mm_set1_ps(3.0f), quarter = _mm_set1_ps(0.25f);
+    a = _mm_mul_ps(quarter, _mm_add_ps(_mm_sub_ps(_mm_add_ps(_mm_mul_ps(mtwo, f00), _mm_mul_ps(two, f10)),
+                                                  _mm_mul_ps(two, f01)), _mm_mul_ps(two, f11)));
+    b = _mm_mul_ps(quarter, _mm_add_ps(_mm_add_ps(_mm_sub_ps(_mm_mul_ps(mtwo, f00), _mm_mul_ps(two, f10)),
+                                                  _mm_mul_ps(two, f01)), _mm_mul_ps(two, f11)));
+    c = _mm_mul_ps(quarter, _mm_sub_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(three, f00), f10), f01), f11));
+    __m128 r00 = _mm_sub_ps(c, f00);
+    __m128 r10 = _mm_sub_ps(_mm_add_ps(a, c), f10);
+    __m128 r01 = _mm_sub_ps(_mm_add_ps(b, c), f01);
+    __m128 r11 = _mm_sub_ps(_mm_add_ps(_mm_add_ps(a, b), c), f11);
+    __m128 s = _mm_add_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(r00, r00), _mm_mul_ps(r10, r10)),
+                                     _mm_mul_ps(r01, r01)), _mm_mul_ps(r11, r11));
+    __m128 res = _mm_sqrt_ps(_mm_mul_ps(s, quarter));
+    return _mm_andnot_ps(bad, _mm_cmple_ps(res, _mm_set1_ps(SUBPIX_MAXRESID)));
+}
+
+__attribute__((target("sse2")))
+static int subpixSSE2(int n, int stride, const float *vx, const float *vy, const float *fx, const float *fy,
+                      float *corx, float *cory)
+{
+    const __m128 one = _mm_set1_ps(1.0f), maxcor = _mm_set1_ps(SUBPIX_MAXCOR);
+    const __m128 sign = _mm_set1_ps(-0.0f), zero = _mm_setzero_ps();
+    int i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m128 fxv[9], fyv[9];
+        for (int k = 0; k < 9; k++) {
+            fxv[k] = _mm_loadu_ps(fx + k*stride + i);
+            fyv[k] = _mm_loadu_ps(fy + k*stride + i);
+        }
+        __m128 vvx = _mm_loadu_ps(vx + i), vvy = _mm_loadu_ps(vy + i);
+        __m128 ix = _mm_cmpgt_ps(vvx, fxv[4]);
+        __m128 iy = _mm_cmpgt_ps(vvy, fyv[4]);
+        __m128 ax, bx, cx, ay, by, cy;
+        __m128 ok = _mm_and_ps(fitPlaneSSE2(vvx, fxv, ix, iy, ax, bx, cx), fitPlaneSSE2(vvy, fyv, ix, iy, ay, by, cy));
+        __m128 det = _mm_sub_ps(_mm_mul_ps(ax, by), _mm_mul_ps(bx, ay));
+        ok = _mm_and_ps(ok, _mm_cmpneq_ps(det, zero));
+        __m128 tx = _mm_sub_ps(vvx, cx), ty = _mm_sub_ps(vvy, cy);
+        __m128 px = _mm_div_ps(_mm_sub_ps(_mm_mul_ps(by, tx), _mm_mul_ps(bx, ty)), det);
+        __m128 py = _mm_div_ps(_mm_add_ps(_mm_mul_ps(_mm_xor_ps(ay, sign), tx), _mm_mul_ps(ax, ty)), det);
+        __m128 cx1 = _mm_sub_ps(_mm_add_ps(px, _mm_and_ps(ix, one)), one);
+        __m128 cy1 = _mm_sub_ps(_mm_add_ps(py, _mm_and_ps(iy, one)), one);
+        ok = _mm_andnot_ps(_mm_or_ps(_mm_cmpgt_ps(absSSE2(cx1), maxcor), _mm_cmpgt_ps(absSSE2(cy1), maxcor)), ok);
+        _mm_storeu_ps(corx + i, _mm_and_ps(ok, cx1));
+        _mm_storeu_ps(cory + i, _mm_and_ps(ok, cy1));
+    }
+    return i;
+}
+
+#endif // MATCH_X86
+
+int selectCandidatesSIMD(const unsigned short *uv, int n, unsigned short qu, unsigned short qv, int t, int *sel)
+{
+    int cnt = 0, i = 0;
+#ifdef MATCH_X86
+    switch (getSIMDLevel()) {
+        case simd_avx512: cnt = selectAVX512(uv, n, qu, qv, t, sel, &i); break;
+        case simd_avx2:   cnt = selectAVX2(uv, n, qu, qv, t, sel, &i); break;
+        case simd_sse2:   cnt = selectSSE2(uv, n, qu, qv, t, sel, &i); break;
+        default: break;
+    }
+#endif
+    return cnt + selectScalar(uv, i, n, qu, qv, t, sel + cnt);
+}
+
+int subpixBatchSIMD(int n, int stride, const float *vx, const float *vy, const float *fx, const float *fy,
+                    float *corx, float *cory)
+{
+#ifdef MATCH_X86
+    switch (getSIMDLevel()) {
+        case simd_avx512: return subpixAVX512(n, stride, vx, vy, fx, fy, corx, cory);
+        case simd_avx2:   return subpixAVX2(n, stride, vx, vy, fx, fy, corx, cory);
+        case simd_sse2:   return subpixSSE2(n, stride, vx, vy, fx, fy, corx, cory);
+        default: break;
+    }
+#endif
+    return 0;
+}
+ // end
@@ -0,0 +1,59 @@
+///////////////////////////////////////////////////////////////////////////
+//
+// NAME
+//  MatchSIMD.h -- vectorized parts of matchImages (see Disparities.cpp)
+//
+// DESCRIPTION
+//  For matching, the two codes (u, v) of a pixel are also kept as 16-bit
+//  fixed-point values, interleaved (u0 v0 u1 v1 ...), with PACKED_SCALE
+//  steps per code unit.  This halves the data read per candidate, and lets
+//  a candidate test run on 4 (SSE2), 8 (AVX2) or 16 (AVX-512) candidates
+//  per instruction.  The test only preselects: the packed codes are
+//  rounded, so a difference of at most t steps is accepted, and the caller
+//  computes the float difference of the (few) selected candidates.  With t
+//  a bit larger than the scaled maximal code difference, no match is lost.
+//
+//  The subpixel corrections of the unique matches are computed in batches
+//  after the search, from the 3x3 code neighborhoods of the matches, which
+//  are gathered into one array per neighbor (structure of arrays).  The
+//  corrections are those of subpix2d: the same float operations in the
+//  same order (and no FMA), with selects instead of its branches.
+//
+//  Uses the SIMD level of getSIMDLevel() (see RefineSIMD.h), and plain C++
+//  on other architectures.
+//
+// SEE ALSO
+//  MatchSIMD.cpp         Implementation
+//  RefineSIMD.h          SIMD level detection
+//
+///////////////////////////////////////////////////////////////////////////
+
+#ifndef MatchSIMD_h
+#define MatchSIMD_h
+
+#define PACKED_SCALE 32         // fixed-point steps per code unit
+#define PACKED_MAX 65000        // larger codes are clamped to this (codes up to ~2031)
+#define PACKED_UNK 0xffff       // pixels with unknown u or v; never selected (t < 256)
+
+// fixed-point value of code c (not UNK): rounded, and clamped to 0..PACKED_MAX.
+// clamping never increases differences, so preselection still keeps all matches
+static inline unsigned short packCode(float c)
+{
+    float q = c * PACKED_SCALE + 0.5f;
+    q = (q < 0) ? 0 : (q > PACKED_MAX) ? PACKED_MAX : q;
+    return (unsigned short)q;
+}
+
+// store in sel the indices i of the n packed pixels uv[2*i], uv[2*i+1] whose codes differ by at
+// most t (< 256) from qu and qv.  returns the number of indices stored (sel holds at least n)
+int selectCandidatesSIMD(const unsigned short *uv, int n, unsigned short qu, unsigned short qv, int t, int *sel);
+
+// subpixel corrections corx, cory of n matches (see subpix2d) from the codes vx, vy of the
+// matched pixels and the codes of the 3x3 neighborhoods of their matches: fx[k*stride + i],
+// fy[k*stride + i] for neighbor dx, dy = 0..2 of match i, with k = 3*dx + dy.  returns the
+// number of matches done, from the start; the rest is left to subpix2d
+int subpixBatchSIMD(int n, int stride, const float *vx, const float *vy, const float *fx, const float *fy,
+                    float *corx, float *cory);
+
+#endif /* MatchSIMD_h */
+ // end
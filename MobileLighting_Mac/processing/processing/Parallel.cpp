@@ -0,0 +1,195 @@
+///////////////////////////////////////////////////////////////////////////
+//
+// NAME
+//  Parallel.cpp -- simple thread pool for splitting image loops across cores
+//
+// SEE ALSO
+//  Parallel.h            definition and explanation
+//
+///////////////////////////////////////////////////////////////////////////
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "Parallel.h"
+
+using namespace std;
+
+// fixed set of worker threads executing queued tasks
+class ThreadPool
+{
+public:
+    ThreadPool(int nworkers) : stopping(false) {
+        for (int i = 0; i < nworkers; i++)
+            workers.push_back(thread(&ThreadPool::work, this));
+    }
+
+    ~ThreadPool() {
+        {
+            lock_guard<mutex> lock(mtx);
+            stopping = true;
+        }
+        cv.notify_all();
+        for (int i = 0; i < (int)workers.size(); i++)
+            workers[i].join();
+    }
+
+    // true if called from one of the pool's own threads
+    bool isWorker() const {
+        for (int i = 0; i < (int)workers.size(); i++)
+            if (workers[i].get_id() == this_thread::get_id())
+                return true;
+        return false;
+    }
+
+    void submit(const function<void()> &task) {
+        {
+            lock_guard<mutex> lock(mtx);
+            tasks.push_back(task);
+        }
+        cv.notify_one();
+    }
+
+private:
+    void work() {
+        while (true) {
+            function<void()> task;
+            {
+                unique_lock<mutex> lock(mtx);
+                while (!stopping && tasks.empty())
+                    cv.wait(lock);
+                if (stopping && tasks.empty())
+                    return;
+                task = tasks.front();
+                tasks.pop_front();
+            }
+            task();
+        }
+    }
+
+    vector<thread> workers;
+    deque<function<void()> > tasks;
+    mutex mtx;
+    condition_variable cv;
+    bool stopping;
+};
+
+// the pool is shared with running parallelFor calls, so a resize only drops
+// our reference and the old pool goes away together with its last user
+static shared_ptr<ThreadPool> pool;
+static int nthreads = 0;  // 0 = not yet determined
+static mutex poolMutex;
+
+// a worker cannot join itself, so let another thread tear down its pool
+static void deletePool(ThreadPool *p)
+{
+    if (p->isWorker())
+        thread([p]() { delete p; }).detach();
+    else
+        delete p;
+}
+
+// state of one parallelFor call, shared between the caller and the helper tasks
+struct ForJob
+{
+    const function<void(int, int)> *body;
+    int n, chunk, nchunks;
+    atomic<int> next;   // next chunk to be claimed
+    int ndone;          // number of finished chunks (guarded by mtx)
+    mutex mtx;
+    condition_variable cv;
+    exception_ptr error;
+};
+
+// claim and process chunks until none are left
+static void runChunks(ForJob &job)
+{
+    int k;
+    while ((k = job.next++) < job.nchunks) {
+        int i0 = k * job.chunk;
+        int i1 = min(job.n, i0 + job.chunk);
+        try {
+            (*job.body)(i0, i1);
+        } catch (...) {
+            lock_guard<mutex> lock(job.mtx);
+            if (!job.error)
+                job.error = current_exception();
+        }
+        lock_guard<mutex> lock(job.mtx);
+        if (++job.ndone == job.nchunks)
+            job.cv.notify_all();
+    }
+}
+
+// safe to call while processing is running; current jobs finish on the old pool
+void setNumThreads(int n)
+{
+    lock_guard<mutex> lock(poolMutex);
+    if (n <= 0)
+        n = max(1, (int)thread::hardware_concurrency());
+    if (n == nthreads)
+        return;
+    pool.reset();
+    nthreads = n;
+}
+
+int getNumThreads()
+{
+    lock_guard<mutex> lock(poolMutex);
+    if (nthreads == 0)
+        nthreads = max(1, (int)thread::hardware_concurrency());
+    return nthreads;
+}
+
+void parallelFor(int n, const function<void(int, int)> &body, int grain)
+{
+    if (n <= 0)
+        return;
+    grain = max(1, grain);
+    int nt;
+    shared_ptr<ThreadPool> p;
+    {
+        lock_guard<mutex> lock(poolMutex);
+        if (nthreads == 0)
+            nthreads = max(1, (int)thread::hardware_concurrency());
+        nt = nthreads;
+        if (nt > 1 && n > grain) {
+            if (!pool) // calling thread is the last worker
+                pool = shared_ptr<ThreadPool>(new ThreadPool(nt - 1), deletePool);
+            p = pool;
+        }
+    }
+    if (!p) { // nothing to split
+        body(0, n);
+        return;
+    }
+
+    // use a few chunks per thread to balance uneven rows
+    shared_ptr<ForJob> job = make_shared<ForJob>();
+    job->body = &body;
+    job->n = n;
+    job->nchunks = min((n + grain - 1) / grain, 4 * nt);
+    job->chunk = (n + job->nchunks - 1) / job->nchunks;
+    job->nchunks = (n + job->chunk - 1) / job->chunk;
+    job->next = 0;
+    job->ndone = 0;
+
+    int nhelpers = min(nt - 1, job->nchunks - 1);
+    for (int i = 0; i < nhelpers; i++)
+        p->submit([job]() { runChunks(*job); });
+
+    runChunks(*job);
+
+    unique_lock<mutex> lock(job->mtx);
+    while (job->ndone < job->nchunks)
+        job->cv.wait(lock);
+    if (job->error)
+        rethrow_exception(job->error);
+}
+ // end
@@ -0,0 +1,36 @@
+///////////////////////////////////////////////////////////////////////////
+//
+// NAME
+//  Parallel.h -- simple thread pool for splitting image loops across cores
+//
+// DESCRIPTION
+//  parallelFor(n, body) splits the index range 0..n-1 into chunks and calls
+//  body(i0, i1) for each chunk [i0, i1) on the worker threads of a shared pool.
+//  The calling thread works on chunks as well and returns once all chunks
+//  are done.  Calls may be nested (e.g. from inside a worker).
+//
+//  The loop bodies must be independent (e.g. disjoint rows of an image).
+//  Note that CImage reference counts are not thread-safe, so bodies should
+//  capture images by reference rather than copying them.
+//
+// SEE ALSO
+//  Parallel.cpp          Implementation
+//
+///////////////////////////////////////////////////////////////////////////
+
+#ifndef Parallel_h
+#define Parallel_h
+
+#include <functional>
+
+// set number of threads used by parallelFor; n <= 0 means use all cores
+void setNumThreads(int n);
+
+// current number of threads (1 means everything runs serially)
+int getNumThreads();
+
+// call body(i0, i1) on chunks of 0..n-1, with at least 'grain' indices per chunk
+void parallelFor(int n, const std::function<void(int, int)> &body, int grain = 1);
+
+#endif /* Parallel_h */
+ // end
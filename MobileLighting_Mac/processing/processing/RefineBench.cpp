@@ -0,0 +1,114 @@
+///////////////////////////////////////////////////////////////////////////
+//
+// NAME
+//  RefineBench.cpp -- micro-benchmark for the vectorized refineCodesLine
+//
+// DESCRIPTION
+//  Refines the rows and columns of a synthetic code image (smooth ramps with
+//  noise, steps, and UNK holes) with refineCodesLine and with the vectorized
+//  version at each SIMD level the CPU supports.  Reports the time per pass
+//  and the maximal difference to refineCodesLine, which should be 0.
+//
+//  usage: RefineBench [width height [radius [maxgrad]]]
+//
+// SEE ALSO
+//  RefineSIMD.h          vectorized version
+//
+///////////////////////////////////////////////////////////////////////////
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <chrono>
+#include "imageLib.h"
+#include "Utils.h"
+#include "RefineSIMD.h"
+
+void refineCodesLine(float *v, float *f, int stride, int n0, int rad, float maxgrad);
+
+static double seconds()
+{
+    using namespace std::chrono;
+    return duration<double>(steady_clock::now().time_since_epoch()).count();
+}
+
+static float maxDiff(CFloatImage &a, CFloatImage &b)
+{
+    CShape sh = a.Shape();
+    float maxd = 0;
+    for (int y = 0; y < sh.height; y++) {
+        for (int x = 0; x < sh.width; x++) {
+            float va = a.Pixel(x, y, 0), vb = b.Pixel(x, y, 0);
+            if (va == vb)
+                continue;
+            maxd = __max(maxd, (va == UNK || vb == UNK) ? UNK : fabs(va - vb));
+        }
+    }
+    return maxd;
+}
+
+int main(int argc, char *argv[])
+{
+    int w = 2000, h = 1500, rad = 7;
+    float maxgrad = 0.5;
+    if (argc >= 3) {
+        w = atoi(argv[1]);
+        h = atoi(argv[2]);
+    }
+    if (argc >= 4)
+        rad = atoi(argv[3]);
+    if (argc >= 5)
+        maxgrad = atof(argv[4]);
+
+    CShape sh(w, h, 1);
+    CFloatImage val(sh), fref(sh), fval(sh);
+    srand(1);
+    for (int y = 0; y < h; y++) {
+        for (int x = 0; x < w; x++) {
+            float v = 0.3 * x + 0.1 * y + 40 * ((x / 97 + y / 61) % 3);
+            v += 0.5 * (rand() / (float)RAND_MAX - 0.5);
+            if (rand() % 20 == 0)
+                v = UNK;
+            val.Pixel(x, y, 0) = v;
+        }
+    }
+    int rowstride = (int) (&val.Pixel(0, 1, 0) - &val.Pixel(0, 0, 0));
+    RefineTaps taps(rad, maxgrad);
+    simd_level_t best = detectSIMDLevel();
+    int errors = 0;
+
+    for (int direction = 0; direction < 2; direction++) {
+        printf("%s, %d x %d, rad %d:\n", direction == 0 ? "rows" : "columns", w, h, rad);
+        double t = seconds();
+        if (direction == 0) {
+            for (int y = 0; y < h; y++)
+                refineCodesLine(&val.Pixel(0, y, 0), &fref.Pixel(0, y, 0), 1, w, rad, maxgrad);
+        } else {
+            for (int x = 0; x < w; x++)
+                refineCodesLine(&val.Pixel(x, 0, 0), &fref.Pixel(x, 0, 0), rowstride, h, rad, maxgrad);
+        }
+        t = seconds() - t;
+        printf("  %-16s %8.2f ms\n", "refineCodesLine", 1000 * t);
+
+        for (int level = simd_none; level <= best; level++) {
+            setSIMDLevel((simd_level_t)level);
+            fval.FillPixels(0);
+            t = seconds();
+            if (direction == 0) {
+                for (int y = 0; y < h; y++)
+                    refineCodesRowSIMD(&val.Pixel(0, y, 0), &fval.Pixel(0, y, 0), w, taps);
+            } else {
+                for (int y = 0; y < h; y++)
+                    refineCodesColumnsSIMD(&val.Pixel(0, y, 0), &fval.Pixel(0, y, 0), rowstride, w, y, h, taps);
+            }
+            t = seconds() - t;
+            float d = maxDiff(fref, fval);
+            printf("  %-16s %8.2f ms   max diff %g\n", simdLevelName((simd_level_t)level), 1000 * t, d);
+            if (d != 0)
+                errors++;
+        }
+    }
+    setSIMDLevel(best);
+    return errors ? 1 : 0;
+}
+ // end
@@ -0,0 +1,72 @@
+///////////////////////////////////////////////////////////////////////////
+//
+// NAME
+//  RefineParams.h -- parameters of the code refinement done by refine() (Decode.cpp)
+//
+// DESCRIPTION
+//  All settings of refine() are passed in a RefineParams struct, so that
+//  refinements with different settings can run concurrently (e.g. by
+//  refineBatch, or in parameter sweeps).  Start from defaultRefineParams()
+//  and change the fields of interest.
+//
+//  Plain C, so that it can also be used from Swift via processing_wrapper.hpp.
+//
+//  Created from the globals formerly in Debug.h (Nicholas Mosier, 06/2018).
+//
+///////////////////////////////////////////////////////////////////////////
+
+#ifndef RefineParams_h
+#define RefineParams_h
+
+// algorithm used by refineCodes
+typedef enum {
+    refine_old,         // along rows or columns, whichever is closer to the given angle
+    refine_angle,       // along rows, columns, or diagonals, whichever is closest to the given angle
+    refine_planar       // fit planes over square windows
+} refine_mode_t;
+
+// which images refine() writes: none, only the final -4refined2 image (the one read by
+// disparitiesOfRefinedImgs), or also the intermediate -1filtered ... -3refined1 images
+typedef enum {
+    artifacts_none,
+    artifacts_final,
+    artifacts_all
+} refine_artifacts_t;
+
+typedef struct RefineParams {
+    // filter to remove isolated pixels with different code values
+    int filter_radius;
+    float filter_fraction;          // fraction of window that needs to be within filter_maxdiff
+    float filter_maxdiff;
+
+    // filling of code holes, in code direction, perpendicular, and in code direction again
+    int fill_maxwidth;              // longest holes filled
+    float fill_maxborderdiff[3];    // largest difference of values at both ends, for each pass
+
+    // refinement of code values
+    refine_mode_t mode;
+    int refine_radius;
+    float maxgrad0;                 // expected maximum gradient of code values per pixel in code direction
+    float maxgrad1;                 // expected maximum gradient of code values per pixel in perpendicular direction
+    int plane_windowsize;           // # of pixels for width & height of window considered (refine_planar)
+    int plane_minsupport;
+    float plane_maxdiff;
+
+    // how to run and what to write
+    int tiled;                      // run all stages tile by tile (same results, see refineTiled)
+    refine_artifacts_t artifacts;
+    int async_writes;               // write images on a background thread (see writeImageAsync)
+} RefineParams;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+RefineParams defaultRefineParams(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* RefineParams_h */
+ // end
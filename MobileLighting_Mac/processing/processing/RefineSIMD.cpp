@@ -0,0 +1,283 @@
+///////////////////////////////////////////////////////////////////////////
+//
+// NAME
+//  RefineSIMD.cpp -- vectorized version of refineCodesLine (see Decode.cpp)
+//
+// DESCRIPTION
+//  Each kernel refines L centre pixels v[0..L-1] whose neighbor at offset r0
+//  along their line is v[i + r0*stride].  The lines are either one image row
+//  (stride 1, lanes at consecutive positions) or L adjacent columns (lanes at
+//  the same position).  The bounds check for offset r0 is done once for all
+//  lanes: lanes are at positions pos .. pos+span of lines of length n.  For
+//  rows, the kernels are only used where all offsets are in bounds.
+//
+//  To give the same results as refineCodesLine, the kernels use the same
+//  float operations in the same order (and no FMA).
+//
+// SEE ALSO
+//  RefineSIMD.h          definition and explanation
+//
+///////////////////////////////////////////////////////////////////////////
+
+#include <math.h>
+#include <algorithm>
+#include <atomic>
+#include "imageLib.h"
+#include "Utils.h"
+#include "RefineSIMD.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define REFINE_X86 1
+#include <immintrin.h>
+#endif
+
+RefineTaps::RefineTaps(int rad, float maxgrad)
+{
+    this->rad = rad;
+    minsupport = rad;
+    maxdiff.resize(2 * rad + 1);
+    weight.resize(2 * rad + 1);
+    for (int r0 = -rad; r0 <= rad; r0++) {
+        // same expressions as in refineCodesLine
+        maxdiff[r0 + rad] = fabs(r0) * maxgrad + 1;
+        weight[r0 + rad] = 1.0  - (fabs(r0) / (rad + 1.0));
+    }
+}
+
+// scalar version for a single pixel at position pos, used at borders and for leftover lanes
+static inline void refinePixel(const float *v, float *f, int stride, int pos, int n, const RefineTaps &t)
+{
+    float v0 = v[0];
+    f[0] = v0;
+    if (v0 == UNK)
+        return;
+    float sum = 0;
+    float sumw = 0;
+    int cnt = 0;
+    for (int r0 = -t.rad; r0 <= t.rad; r0++) {
+        float maxdiff = t.maxdiff[r0 + t.rad];
+        int p1 = pos + r0;
+        const float *v1 = v + r0 * stride;
+        int mirror = 0;
+        if (p1 < 0 || p1 >= n || fabs(v0 - *v1) > maxdiff || *v1 == UNK) {
+            p1 = pos - r0;
+            v1 = v - r0 * stride;
+            mirror = 1;
+        }
+        if (p1 < 0 || p1 >= n || fabs(v0 - *v1) > maxdiff || *v1 == UNK)
+            continue;
+        float vv = (mirror ? (v0 - *v1) : (*v1 - v0));
+        float w = t.weight[r0 + t.rad];
+        sum += w * vv;
+        sumw += w;
+        cnt++;
+    }
+    if (cnt >= t.minsupport)
+        f[0] = v0 + sum/sumw;
+}
+
+#ifdef REFINE_X86
+
+__attribute__((target("avx512f")))
+static void refineLanesAVX512(const float *v, float *f, int stride, int pos, int n, int span, const RefineTaps &t)
+{
+    const __m512 unk = _mm512_set1_ps(UNK);
+    const __m512 one = _mm512_set1_ps(1);
+    __m512 v0 = _mm512_loadu_ps(v);
+    __m512 sum = _mm512_setzero_ps(), sumw = _mm512_setzero_ps(), cnt = _mm512_setzero_ps();
+    for (int r0 = -t.rad; r0 <= t.rad; r0++) {
+        __m512 md = _mm512_set1_ps(t.maxdiff[r0 + t.rad]);
+        __m512 w = _mm512_set1_ps(t.weight[r0 + t.rad]);
+        __mmask16 ok = 0;
+        __m512 d = _mm512_setzero_ps();
+        if (pos + r0 >= 0 && pos + span + r0 < n) {
+            __m512 v1 = _mm512_loadu_ps(v + r0 * stride);
+            d = _mm512_sub_ps(v1, v0);
+            ok = _mm512_cmp_ps_mask(_mm512_abs_ps(d), md, _CMP_NGT_UQ)
+               & _mm512_cmp_ps_mask(v1, unk, _CMP_NEQ_UQ);
+        }
+        if (pos - r0 >= 0 && pos + span - r0 < n) { // mirrored
+            __m512 v1 = _mm512_loadu_ps(v - r0 * stride);
+            __m512 dm = _mm512_sub_ps(v0, v1);
+            __mmask16 okm = _mm512_cmp_ps_mask(_mm512_abs_ps(dm), md, _CMP_NGT_UQ)
+                          & _mm512_cmp_ps_mask(v1, unk, _CMP_NEQ_UQ);
+            d = _mm512_mask_blend_ps(ok, dm, d);
+            ok |= okm;
+        }
+        sum = _mm512_mask_add_ps(sum, ok, sum, _mm512_mul_ps(w, d));
+        sumw = _mm512_mask_add_ps(sumw, ok, sumw, w);
+        cnt = _mm512_mask_add_ps(cnt, ok, cnt, one);
+    }
+    __m512 res = _mm512_add_ps(v0, _mm512_div_ps(sum, sumw));
+    __mmask16 good = _mm512_cmp_ps_mask(cnt, _mm512_set1_ps(t.minsupport), _CMP_GE_OQ)
+                   & _mm512_cmp_ps_mask(v0, unk, _CMP_NEQ_UQ);
+    _mm512_storeu_ps(f, _mm512_mask_blend_ps(good, v0, res));
+}
+
+__attribute__((target("avx2")))
+static void refineLanesAVX2(const float *v, float *f, int stride, int pos, int n, int span, const RefineTaps &t)
+{
+    const __m256 unk = _mm256_set1_ps(UNK);
+    const __m256 one = _mm256_set1_ps(1);
+    const __m256 absmask = _mm256_castsi256_ps(_mm256_set1_epi32(0x7fffffff));
+    __m256 v0 = _mm256_loadu_ps(v);
+    __m256 sum = _mm256_setzero_ps(), sumw = _mm256_setzero_ps(), cnt = _mm256_setzero_ps();
+    for (int r0 = -t.rad; r0 <= t.rad; r0++) {
+        __m256 md = _mm256_set1_ps(t.maxdiff[r0 + t.rad]);
+        __m256 w = _mm256_set1_ps(t.weight[r0 + t.rad]);
+        __m256 ok = _mm256_setzero_ps();
+        __m256 d = _mm256_setzero_ps();
+        if (pos + r0 >= 0 && pos + span + r0 < n) {
+            __m256 v1 = _mm256_loadu_ps(v + r0 * stride);
+            d = _mm256_sub_ps(v1, v0);
+            ok = _mm256_and_ps(_mm256_cmp_ps(_mm256_and_ps(d, absmask), md, _CMP_NGT_UQ),
+                               _mm256_cmp_ps(v1, unk, _CMP_NEQ_UQ));
+        }
+        if (pos - r0 >= 0 && pos + span - r0 < n) { // mirrored
+            __m256 v1 = _mm256_loadu_ps(v - r0 * stride);
+            __m256 dm = _mm256_sub_ps(v0, v1);
+            __m256 okm = _mm256_and_ps(_mm256_cmp_ps(_mm256_and_ps(dm, absmask), md, _CMP_NGT_UQ),
+                                       _mm256_cmp_ps(v1, unk, _CMP_NEQ_UQ));
+            d = _mm256_blendv_ps(dm, d, ok);
+            ok = _mm256_or_ps(ok, okm);
+        }
+        sum = _mm256_add_ps(sum, _mm256_and_ps(ok, _mm256_mul_ps(w, d)));
+        sumw = _mm256_add_ps(sumw, _mm256_and_ps(ok, w));
+        cnt = _mm256_add_ps(cnt, _mm256_and_ps(ok, one));
+    }
+    __m256 res = _mm256_add_ps(v0, _mm256_div_ps(sum, sumw));
+    __m256 good = _mm256_and_ps(_mm256_cmp_ps(cnt, _mm256_set1_ps(t.minsupport), _CMP_GE_OQ),
+                                _mm256_cmp_ps(v0, unk, _CMP_NEQ_UQ));
+    _mm256_storeu_ps(f, _mm256_blendv_ps(v0, res, good));
+}
+
+// SSE2 has no blend instruction, select with and/andnot/or instead
+static inline __m128 selectSSE(__m128 mask, __m128 a, __m128 b)
+{
+    return _mm_or_ps(_mm_and_ps(mask, a), _mm_andnot_ps(mask, b)); // mask ? a : b
+}
+
+__attribute__((target("sse2")))
+static void refineLanesSSE2(const float *v, float *f, int stride, int pos, int n, int span, const RefineTaps &t)
+{
+    const __m128 unk = _mm_set1_ps(UNK);
+    const __m128 one = _mm_set1_ps(1);
+    const __m128 absmask = _mm_castsi128_ps(_mm_set1_epi32(0x7fffffff));
+    __m128 v0 = _mm_loadu_ps(v);
+    __m128 sum = _mm_setzero_ps(), sumw = _mm_setzero_ps(), cnt = _mm_setzero_ps();
+    for (int r0 = -t.rad; r0 <= t.rad; r0++) {
+        __m128 md = _mm_set1_ps(t.maxdiff[r0 + t.rad]);
+        __m128 w = _mm_set1_ps(t.weight[r0 + t.rad]);
+        __m128 ok = _mm_setzero_ps();
+        __m128 d = _mm_setzero_ps();
+        if (pos + r0 >= 0 && pos + span + r0 < n) {
+            __m128 v1 = _mm_loadu_ps(v + r0 * stride);
+            d = _mm_sub_ps(v1, v0);
+            ok = _mm_and_ps(_mm_cmpngt_ps(_mm_and_ps(d, absmask), md), _mm_cmpneq_ps(v1, unk));
+        }
+        if (pos - r0 >= 0 && pos + span - r0 < n) { // mirrored
+            __m128 v1 = _mm_loadu_ps(v - r0 * stride);
+            __m128 dm = _mm_sub_ps(v0, v1);
+            __m128 okm = _mm_and_ps(_mm_cmpngt_ps(_mm_and_ps(dm, absmask), md), _mm_cmpneq_ps(v1, unk));
+            d = selectSSE(ok, d, dm);
+            ok = _mm_or_ps(ok, okm);
+        }
+        sum = _mm_add_ps(sum, _mm_and_ps(ok, _mm_mul_ps(w, d)));
+        sumw = _mm_add_ps(sumw, _mm_and_ps(ok, w));
+        cnt = _mm_add_ps(cnt, _mm_and_ps(ok, one));
+    }
+    __m128 res = _mm_add_ps(v0, _mm_div_ps(sum, sumw));
+    __m128 good = _mm_and_ps(_mm_cmpge_ps(cnt, _mm_set1_ps(t.minsupport)), _mm_cmpneq_ps(v0, unk));
+    _mm_storeu_ps(f, selectSSE(good, res, v0));
+}
+
+#endif // REFINE_X86
+
+
+typedef void (*refine_lanes_fn)(const float *v, float *f, int stride, int pos, int n, int span, const RefineTaps &t);
+
+// level forced by setSIMDLevel, -1 if not set.  atomic, as worker threads read it while
+// another thread may set it
+static std::atomic<int> simdLevel(-1);
+
+simd_level_t detectSIMDLevel()
+{
+#ifdef REFINE_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f"))
+        return simd_avx512;
+    if (__builtin_cpu_supports("avx2"))
+        return simd_avx2;
+    if (__builtin_cpu_supports("sse2"))
+        return simd_sse2;
+#endif
+    return simd_none;
+}
+
+simd_level_t getSIMDLevel()
+{
+    static simd_level_t detected = detectSIMDLevel();
+    int level = simdLevel.load();
+    if (level < 0)
+        return detected;
+    return min((simd_level_t)level, detected);
+}
+
+void setSIMDLevel(simd_level_t level)
+{
+    simdLevel = level;
+}
+
+const char *simdLevelName(simd_level_t level)
+{
+    switch (level) {
+        case simd_avx512: return "AVX-512";
+        case simd_avx2:   return "AVX2";
+        case simd_sse2:   return "SSE2";
+        default:          return "scalar";
+    }
+}
+
+// kernel for current level and its number of lanes
+static refine_lanes_fn getKernel(int &lanes)
+{
+    switch (getSIMDLevel()) {
+#ifdef REFINE_X86
+        case simd_avx512: lanes = 16; return refineLanesAVX512;
+        case simd_avx2:   lanes = 8;  return refineLanesAVX2;
+        case simd_sse2:   lanes = 4;  return refineLanesSSE2;
+#endif
+        default:          lanes = 1;  return NULL;
+    }
+}
+
+void refineCodesRowSIMD(float *v, float *f, int n, const RefineTaps &taps)
+{
+    int lanes;
+    refine_lanes_fn kernel = getKernel(lanes);
+    int rad = taps.rad;
+    int x = 0;
+    if (kernel != NULL) {
+        // scalar near the left border, vectors where all offsets are in bounds
+        for (; x < min(rad, n); x++)
+            refinePixel(&v[x], &f[x], 1, x, n, taps);
+        for (; x + lanes - 1 + rad < n; x += lanes)
+            kernel(&v[x], &f[x], 1, x, n, lanes - 1, taps);
+    }
+    for (; x < n; x++)
+        refinePixel(&v[x], &f[x], 1, x, n, taps);
+}
+
+void refineCodesColumnsSIMD(float *v, float *f, int stride, int ncols, int pos, int n, const RefineTaps &taps)
+{
+    int lanes;
+    refine_lanes_fn kernel = getKernel(lanes);
+    int x = 0;
+    if (kernel != NULL) {
+        for (; x + lanes <= ncols; x += lanes)
+            kernel(&v[x], &f[x], stride, pos, n, 0, taps);
+    }
+    for (; x < ncols; x++)
+        refinePixel(&v[x], &f[x], stride, pos, n, taps);
+}
+ // end
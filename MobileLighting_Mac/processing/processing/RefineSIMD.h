@@ -0,0 +1,73 @@
+///////////////////////////////////////////////////////////////////////////
+//
+// NAME
+//  RefineSIMD.h -- vectorized version of refineCodesLine (see Decode.cpp)
+//
+// DESCRIPTION
+//  Refines several centre pixels at once: adjacent pixels of a row, or the
+//  same position in adjacent columns.  Uses AVX-512 (16 pixels), AVX2 (8) or
+//  SSE2 (4), picked at run time from what the CPU supports, and plain C++
+//  on other architectures.  UNK pixels are masked out.  The arithmetic is
+//  the same as in refineCodesLine, so results are identical.
+//
+// SEE ALSO
+//  RefineSIMD.cpp        Implementation
+//  RefineBench.cpp       micro-benchmark and comparison with refineCodesLine
+//
+///////////////////////////////////////////////////////////////////////////
+
+#ifndef RefineSIMD_h
+#define RefineSIMD_h
+
+#include <vector>
+
+enum simd_level_t {
+    simd_none,
+    simd_sse2,
+    simd_avx2,
+    simd_avx512
+};
+
+// best level supported by this CPU
+simd_level_t detectSIMDLevel();
+
+// level currently used (defaults to detectSIMDLevel())
+simd_level_t getSIMDLevel();
+
+// force a (lower) level, e.g. simd_none for verification; clipped to what the CPU supports
+void setSIMDLevel(simd_level_t level);
+
+const char *simdLevelName(simd_level_t level);
+
+// GCC's avx512fintrin.h passes undefined vectors as the unused sources of masked builtins, which
+// GCC 12 reports as (maybe) uninitialized once inlined into a kernel, depending on the
+// optimization level.  these bracket the AVX-512 kernels to silence the false positives
+#if defined(__GNUC__) && !defined(__clang__)
+#define AVX512_KERNELS_BEGIN _Pragma("GCC diagnostic push") _Pragma("GCC diagnostic ignored \"-Wmaybe-uninitialized\"") \
+                             _Pragma("GCC diagnostic ignored \"-Wuninitialized\"")
+#define AVX512_KERNELS_END _Pragma("GCC diagnostic pop")
+#else
+#define AVX512_KERNELS_BEGIN
+#define AVX512_KERNELS_END
+#endif
+
+// per-offset constants of refineCodesLine, precomputed once per line direction
+struct RefineTaps
+{
+    int rad;
+    int minsupport;             // how many "good" values are needed to trust the average
+    std::vector<float> maxdiff; // maximal difference for offset r0, indexed r0 + rad
+    std::vector<float> weight;  // tent filter weight for offset r0, indexed r0 + rad
+
+    RefineTaps(int rad, float maxgrad);
+};
+
+// refine a line of n contiguous values (e.g. an image row), same as refineCodesLine with stride 1
+void refineCodesRowSIMD(float *v, float *f, int n, const RefineTaps &taps);
+
+// refine ncols adjacent columns at position pos of their lines of length n, whose
+// neighboring values are 'stride' floats apart.  v and f point to the first column
+void refineCodesColumnsSIMD(float *v, float *f, int stride, int ncols, int pos, int n, const RefineTaps &taps);
+
+#endif /* RefineSIMD_h */
+ // end
@@ -483,6 +483,7 @@ void removeBad(CFloatImage ndisp, CByteImage badmap)
 
 // takes disparity map and two code maps and recovers projection matrix for projector
 // then reprojects projector's disparities into camera disparities
+// the bands of planar flo images are used in place (see splitFloImage), and the result is planar
 //void reproject(char *dispFile, char *codeFile, char* outFile, char* errFile, char* matfile)
 CFloatImage reproject(CFloatImage dispflo, CFloatImage codeflo, char* errFile, char* matfile, char *logfile)
 {
@@ -554,10 +555,11 @@ CFloatImage reproject(CFloatImage dispflo, CFloatImage codeflo, char* errFile, c
     fclose(fp);
     printf("Wrote %s\n", matfile);
 
-    CFloatImage ndisp(sh);
-    CFloatImage blank;
-    blank.ReAllocate(sh);
-    blank.FillPixels(UNK);
+    // x disparities are computed into band 0 of the result, its y disparities are UNK
+    CFloatImage nflo;
+    nflo.ReAllocatePlanar(CShape(sh.width, sh.height, 2));
+    CFloatImage ndisp = nflo.BandView(0);
+    nflo.BandView(1).FillPixels(UNK);
 
     FILE *log = fopen(logfile, "w");
     
@@ -565,9 +567,8 @@ CFloatImage reproject(CFloatImage dispflo, CFloatImage codeflo, char* errFile, c
     compareDisp("before", disp, ndisp, 1.0, NULL, log);
     removeBad(ndisp, badmap);
     compareDisp("after ", disp, ndisp, 1.0, errFile, log);
-    ndisp = mergeToFloImage(ndisp,blank);
 
     fclose(log);
-    return ndisp;
+    return nflo;
 }
  // end
@@ -16,9 +16,19 @@
 #include <vector>
 #include <algorithm>
 #include <math.h>
+#include <string.h>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
 #include "opencv2/opencv.hpp"
 #include "Utils.h"
 #include "flowIO.h"
+#include "Parallel.h"
+#include "FilterSIMD.h"
 
 
 
@@ -103,6 +113,41 @@ float median2(float* v, int n)
         return (v[n/2 - 1] + v[n/2]) / 2.0;
 }
 
+// median of the known values of the sorted values v of a full 3x3 window (UNK last), with
+// careful averaging (see median3x3)
+static float median3x3Sorted(float* v)
+{
+    float maxdiff = 2.0;
+    int k = 9;
+    while (k > 0 && v[k-1] == UNK)
+        k--;
+    // now v[0] .. v[k-1] are not UNK
+    if (k < 4) // if less than 4 good vals (6 or more UNK), make UNK  (could use 5 here, but fills more holes)
+        return UNK;
+    if (k % 2 == 0) {
+        float v1 = v[k/2 - 1];
+        float v2 = v[k/2];
+        if (fabs(v1 - v2) <= maxdiff)
+            return (v1 + v2) / 2.0;
+        else
+            return v1;
+    } else {
+        float v1 = v[k/2 - 1];
+        float v2 = v[k/2];
+        float v3 = v[k/2 + 1];
+        float d12 = fabs(v1 - v2);
+        float d23 = fabs(v2 - v3);
+        if (d12 <= maxdiff && d23 <= maxdiff)
+            return (v1 + v2 + v3) / 3.0;
+        else if (d12 <= maxdiff)
+            return (v1 + v2) / 2.0;
+        else if (d23 <= maxdiff)
+            return (v2 + v3) / 2.0;
+        else
+            return v2;
+    }
+}
+
 // special case for 3x3 filter with "symmetric hole filling" and careful averaging
 float median3x3(float* v, int n)
 {
@@ -125,34 +170,7 @@ float median3x3(float* v, int n)
             }
         }
         std::sort(v, v+n);
-        int k = n;
-        while (k > 0 && v[k-1] == UNK)
-            k--;
-        // now v[0] .. v[k-1] are not UNK
-        if (k < 4) // if less than 4 good vals (6 or more UNK), make UNK  (could use 5 here, but fills more holes)
-            return UNK;
-        if (k % 2 == 0) {
-            float v1 = v[k/2 - 1];
-            float v2 = v[k/2];
-            if (fabs(v1 - v2) <= maxdiff)
-                return (v1 + v2) / 2.0;
-            else
-                return v1;
-        } else {
-            float v1 = v[k/2 - 1];
-            float v2 = v[k/2];
-            float v3 = v[k/2 + 1];
-            float d12 = fabs(v1 - v2);
-            float d23 = fabs(v2 - v3);
-            if (d12 <= maxdiff && d23 <= maxdiff)
-                return (v1 + v2 + v3) / 3.0;
-            else if (d12 <= maxdiff)
-                return (v1 + v2) / 2.0;
-            else if (d23 <= maxdiff)
-                return (v2 + v3) / 2.0;
-            else
-                return v2;
-        }
+        return median3x3Sorted(v);
     }
     // end special case n == 9
     // otherwise do the standard median computation
@@ -178,50 +196,300 @@ float median3x3(float* v, int n)
  */
 
 
+static void copyBand(CFloatImage &src, int sb, CFloatImage &dst, int db);
+
+// median of the window of radius rad around pixel x, y of band (clipped at the border), as
+// medianfilter does for each pixel; v holds (2*rad+1)^2 values
+static float medianAt(CFloatImage &band, int x, int y, int rad, int k, float *v)
+{
+    CShape sh = band.Shape();
+    int x1 = max(0, x-rad);
+    int x2 = min(sh.width-1, x+rad);
+    int y1 = max(0, y-rad);
+    int y2 = min(sh.height-1, y+rad);
+    int j = 0;
+    for (int yy = y1; yy <= y2; yy++) {
+        for (int xx = x1; xx <= x2; xx++) {
+            v[j++] = band.Pixel(xx, yy, 0); // include UNK!
+        }
+    }
+    if (k==3)
+        return median3x3(v, j); // special case with "symmetric hole filling"
+    return median(v, j);
+}
+
+// compare-exchanges for sorting n values (see sortWindowsSIMD): Batcher's odd-even merge sort
+// of the next power of 2.  the values past n count as larger than all others, so that their
+// compare-exchanges either do nothing or just move them, which is done by renumbering.  only the
+// compare-exchanges that the values at the sorted positions 'wanted' depend on are kept
+struct SortingNetwork
+{
+    vector<short> cmp;  // pairs of value indices (smaller, larger)
+    vector<short> out;  // the values at the wanted positions after sorting
+};
+
+static SortingNetwork sortingNetwork(int n, vector<int> wanted)
+{
+    int N = 1;
+    while (N < n)
+        N *= 2;
+    vector<int> at(N);  // the value at each position
+    for (int i = 0; i < N; i++)
+        at[i] = i;
+    vector<short> cmp;
+    for (int p = 1; p < N; p *= 2) {
+        for (int k = p; k >= 1; k /= 2) {
+            for (int j = k % p; j + k < N; j += 2*k) {
+                for (int i = 0; i < min(k, N - j - k); i++) {
+                    int a = i + j, b = i + j + k;
+                    if (a / (2*p) != b / (2*p) || at[b] >= n)
+                        continue;
+                    if (at[a] >= n) {
+                        swap(at[a], at[b]);
+                        continue;
+                    }
+                    cmp.push_back(at[a]);
+                    cmp.push_back(at[b]);
+                }
+            }
+        }
+    }
+    
+    // keep what the wanted values depend on, going backwards
+    SortingNetwork net;
+    vector<int> need(n, 0);
+    for (int i = 0; i < (int)wanted.size(); i++) {
+        net.out.push_back(at[wanted[i]]);
+        need[at[wanted[i]]] = 1;
+    }
+    for (int c = (int)cmp.size()/2 - 1; c >= 0; c--) {
+        int a = cmp[2*c], b = cmp[2*c + 1];
+        if (need[a] || need[b]) {
+            need[a] = need[b] = 1;
+            net.cmp.push_back(b);
+            net.cmp.push_back(a);
+        }
+    }
+    reverse(net.cmp.begin(), net.cmp.end());
+    return net;
+}
+
+// the networks of medianfilter: all values of 3x3 windows (for median3x3), or just the median
+static const SortingNetwork &medianNetwork(int size, int all)
+{
+    static const SortingNetwork sort3 = sortingNetwork(9, {0, 1, 2, 3, 4, 5, 6, 7, 8});
+    static const SortingNetwork median3 = sortingNetwork(9, {4});
+    static const SortingNetwork median5 = sortingNetwork(25, {12});
+    return (size == 3) ? (all ? sort3 : median3) : median5;
+}
+
+// median filter of the inner pixels x0..x1-1 of row y (full windows) with a sorting network,
+// into out[x - x0].  pixels left over by sortWindowsSIMD are done one at a time
+static void medianRowNetwork(CFloatImage &band, int y, int rad, int k, int x0, int x1, vector<float> &sorted,
+                             float *v, float *out)
+{
+    int size = 2*rad + 1, n = x1 - x0;
+    const SortingNetwork &net = medianNetwork(size, k == 3);
+    int nout = (int)net.out.size();
+    const float *rows[NETWORK_MAXSIZE];
+    for (int dy = 0; dy < size; dy++)
+        rows[dy] = &band.Pixel(x0 - rad, y - rad + dy, 0);
+    sorted.resize(nout * n);
+    int done = sortWindowsSIMD(rows, size, n, &net.cmp[0], (int)net.cmp.size()/2, k == 3,
+                               &net.out[0], nout, &sorted[0], n);
+    for (int i = 0; i < done; i++) {
+        if (k == 3) {
+            float s[9];
+            for (int o = 0; o < 9; o++)
+                s[o] = sorted[o*n + i];
+            out[i] = median3x3Sorted(s);
+        } else {
+            out[i] = sorted[i];
+        }
+    }
+    for (int i = done; i < n; i++)
+        out[i] = medianAt(band, x0 + i, y, rad, k, v);
+}
+
+#define MEDIAN_KEYS 65536       // quantized values for the sliding histograms; the last one is UNK
+#define MEDIAN_COARSE 256       // keys per bin of the coarse histogram
+
+// key of value v for values lo..lo + (MEDIAN_KEYS-2)/scale.  larger values never get smaller
+// keys, so the median has the median key
+static inline int medianKey(float v, float lo, float scale)
+{
+    if (!(v < UNK)) // UNK (or NaN)
+        return MEDIAN_KEYS - 1;
+    float q = (v - lo) * scale;
+    return (q < 0) ? 0 : (q > MEDIAN_KEYS - 2) ? MEDIAN_KEYS - 2 : (int)q;
+}
+
+// histograms of the keys in a window: of each key, and of each MEDIAN_COARSE keys.  med is the
+// key of the values at the sorted position last looked for, and below the number of smaller keys
+struct MedianHist
+{
+    vector<int> fine, coarse;
+    int med, below;
+    vector<float> vals; // values with the median key
+    
+    MedianHist(int size) : fine(MEDIAN_KEYS, 0), coarse(MEDIAN_KEYS / MEDIAN_COARSE, 0), med(0), below(0),
+                           vals(size * size) {}
+    
+    void add(int key, int cnt) {
+        fine[key] += cnt;
+        coarse[key / MEDIAN_COARSE] += cnt;
+        if (key < med)
+            below += cnt;
+    }
+    
+    // move med to the key at sorted position r, skipping whole coarse bins where possible
+    void find(int r) {
+        while (below + fine[med] <= r) {
+            int c = med / MEDIAN_COARSE;
+            if (med % MEDIAN_COARSE == 0 && below + coarse[c] <= r) {
+                below += coarse[c];
+                med += MEDIAN_COARSE;
+            } else {
+                below += fine[med++];
+            }
+        }
+        while (below > r) {
+            int c = med / MEDIAN_COARSE - 1;
+            if (med % MEDIAN_COARSE == 0 && below - coarse[c] > r) {
+                below -= coarse[c];
+                med -= MEDIAN_COARSE;
+            } else {
+                below -= fine[--med];
+            }
+        }
+    }
+};
+
+// median filter of the inner pixels x0..x1-1 of row y (full windows) into out[x - x0], with the
+// sliding histogram h of the keys (in keys, one per pixel of band): going to the next pixel
+// updates it by a column, and the median key is searched from that of the previous pixel.  the
+// median is then selected among the values of the window with that key.  h is empty again at
+// the end
+static void medianRowHist(CFloatImage &band, const unsigned short *keys, int y, int rad, int x0, int x1,
+                          MedianHist &h, float *out)
+{
+    int w = band.Shape().width, size = 2*rad + 1, r = size*size / 2;
+    const unsigned short *krow = &keys[(y - rad) * w];
+    for (int x = x0 - rad; x <= x0 + rad; x++) {
+        for (int dy = 0; dy < size; dy++)
+            h.add(krow[dy*w + x], 1);
+    }
+    for (int x = x0; x < x1; x++) {
+        if (x > x0) {
+            for (int dy = 0; dy < size; dy++) {
+                h.add(krow[dy*w + x - rad - 1], -1);
+                h.add(krow[dy*w + x + rad], 1);
+            }
+        }
+        h.find(r);
+        int key = h.med, cnt = h.fine[key], m = 0;
+        if (key == MEDIAN_KEYS - 1) {
+            out[x - x0] = UNK;
+            continue;
+        }
+        int same = 1; // all values with the key are equal (e.g. in flat regions)
+        for (int dy = 0; dy < size && m < cnt; dy++) {
+            const unsigned short *kr = &krow[dy*w + x - rad];
+            const float *vr = &band.Pixel(x - rad, y - rad + dy, 0);
+            for (int i = 0; i < size; i++) {
+                if (kr[i] == key) {
+                    h.vals[m] = vr[i];
+                    same &= (vr[i] == h.vals[0]);
+                    m++;
+                }
+            }
+        }
+        int rr = r - h.below;
+        if (!same)
+            nth_element(h.vals.begin(), h.vals.begin() + rr, h.vals.begin() + m);
+        out[x - x0] = h.vals[rr];
+    }
+    for (int x = x1 - 1 - rad; x <= x1 - 1 + rad; x++) {
+        for (int dy = 0; dy < size; dy++)
+            h.add(krow[dy*w + x], -1);
+    }
+}
+
 // k x k median filter of band b in float image, assume k is odd
+// the windows are clipped at the border, and UNK counts as larger than all values, except for
+// k == 3, where the known values of full windows are used (see median3x3).  the inner pixels
+// are done with sorting networks (see FilterSIMD.h) up to 5x5, and with sliding histograms of
+// quantized values above (see medianRowHist).  rows are split across threads
 void medianfilter(CFloatImage src, CFloatImage &dst, int k, int b)
 {
     CShape sh = src.Shape();
     dst.ReAllocate(sh);
     int width = sh.width, height = sh.height;
-    int x, y, xx, yy;
-    int rad = k / 2;
-    
-    vector<float> v;
-    v.resize(k*k);
-    
-    for (y = 0; y < height; y++) {
-        int y1 = max(0, y-rad);
-        int y2 = min(height-1, y+rad);
-        for (x = 0; x < width; x ++) {
-            if (k <= 1) {
-                dst.Pixel(x, y, b) = src.Pixel(x, y, b);
-                continue;
+    int rad = k / 2, size = 2*rad + 1;
+    
+    // band b as rows of adjacent values
+    CFloatImage band = src.BandView(b);
+    if (!band.Planar()) {
+        band = CFloatImage(width, height, 1);
+        copyBand(src, b, band, 0);
+    }
+    
+    if (k <= 1) {
+        copyBand(band, 0, dst, b);
+        return;
+    }
+    
+    int x0 = rad, x1 = width - rad;
+    int network = (size <= NETWORK_MAXSIZE);
+    
+    // keys of the values for the histograms, for the range of the known values
+    vector<unsigned short> keys;
+    float lo = 0, scale = 0;
+    if (!network && x0 < x1) {
+        float hi = 0;
+        int first = 1;
+        for (int y = 0; y < height; y++) {
+            float *row = &band.Pixel(0, y, 0);
+            for (int x = 0; x < width; x++) {
+                if (!(row[x] < UNK) || !(row[x] > -UNK))
+                    continue;
+                lo = (first || row[x] < lo) ? row[x] : lo;
+                hi = (first || row[x] > hi) ? row[x] : hi;
+                first = 0;
             }
-            int x1 = max(0, x-rad);
-            int x2 = min(width-1, x+rad);
-            int j = 0;
-            for (yy = y1; yy <= y2; yy++) {
-                for (xx = x1; xx <= x2; xx++) {
-                    float f = src.Pixel(xx, yy, b);
-                    v[j++] = f; // include UNK!
-                    //v.push_back(f); // slower
-                }
+        }
+        scale = (hi > lo) ? (MEDIAN_KEYS - 2) / (hi - lo) : 0;
+        keys.resize(width * height);
+        parallelFor(height, [&](int ystart, int yend) {
+            for (int y = ystart; y < yend; y++) {
+                float *row = &band.Pixel(0, y, 0);
+                for (int x = 0; x < width; x++)
+                    keys[y * width + x] = medianKey(row[x], lo, scale);
+            }
+        }, 64);
+    }
+    
+    parallelFor(height, [&](int ystart, int yend) {
+        vector<float> v(size * size), out(width), sorted;
+        unique_ptr<MedianHist> hist(network ? NULL : new MedianHist(size));
+        for (int y = ystart; y < yend; y++) {
+            int inner = (y >= rad && y < height - rad && x0 < x1);
+            if (inner) {
+                if (network)
+                    medianRowNetwork(band, y, rad, k, x0, x1, sorted, &v[0], &out[0]);
+                else
+                    medianRowHist(band, &keys[0], y, rad, x0, x1, *hist, &out[0]);
+                for (int x = x0; x < x1; x++)
+                    dst.Pixel(x, y, b) = out[x - x0];
             }
-            float m = 0;
-            if (k==3)
-                m = median3x3(&v[0], j); // special case with "symmetric hole filling"
-            else
-                m = median(&v[0], j);
-            //float m = median(v); // slower
-            dst.Pixel(x, y, b) = m;
-            if (/* DISABLES CODE */ (0) && x == 182 && y == 975) {
-                for (int i=0; i < (int)v.size(); i++)
-                    printf("%5.1f ", v[i]);
-                printf("\nk=%d, rad = %d, v.size = %d, med = %g\n", k, rad, (int)v.size(), m);
+            for (int x = 0; x < width; x++) {
+                if (inner && x == x0)
+                    x = x1;
+                if (x < width)
+                    dst.Pixel(x, y, b) = medianAt(band, x, y, rad, k, &v[0]);
             }
         }
-    }
+    }, 16);
 }
 
 
@@ -229,122 +497,179 @@ void medianfilter(CFloatImage src, CFloatImage &dst, int k, int b)
 
 // connected components using union-find algorithm
 // derived from connected2.cpp, cs453/adm/hw2
+//
+// the rows are split into bands that are labeled in parallel, and the components are then
+// merged across the first row of each band.  a label is an index into one parent array; the
+// labels of a band start at the index of its first pixel, since a band has at most as many
+// labels as pixels.  the root of a tree is its smallest label, so the components are numbered
+// in the order of their first pixels.  the size and bounding box of a component are kept with
+// its root while labeling, so no second pass over the pixels is needed for them
 
-//int parent[MAXLABEL];   // the index of the parent node (0 if root)
-//int plabel[MAXLABEL];   // consecutive labels of root nodes
-
-// finds root label of tree by following parent links
-int ccfind(int i, int *parent)
+// labels of one band of rows
+struct ccband
 {
-    int j = i;
-    while (parent[j] != 0) {
-        j = parent[j];
-    }
-    if (j != i)
-        parent[i] = j; // for efficiency, update pointer
-    return j;
-}
+    int nlabels;                // labels y0*w .. y0*w + nlabels-1, with y0 the first row
+    vector<struct ccomp> comp;  // size and bbox of each label, valid for roots
+};
 
-// creates union by making second tree subtree of first
-int ccunion(int i, int j, int *parent)
+struct cclabels
 {
-    //printf("unionizing %d, %d\n", i, j);
-    int ii = ccfind(i, parent);
-    int jj = ccfind(j, parent);
-    if (ii != jj)
-        parent[jj] = ii;
-    return ii;
-}
-
-// extended union function that also handles the 0-label
-int cccombine(int i, int j, int *parent) {
-    if (i == 0)
+    int w;
+    vector<int> parent;         // the parent of each label (itself if root)
+    vector<int> bandstart;      // first row of the band of each row
+    vector<struct ccband> band; // indexed by first row
+    
+    cclabels(int w, int h) : w(w), parent(w * h), bandstart(h), band(h) {}
+    
+    struct ccomp &comp(int i) {
+        int y0 = bandstart[i / w];
+        return band[y0].comp[i - y0*w];
+    }
+    
+    // finds root label of tree by following parent links, then points them all to it
+    int find(int i) {
+        int j = i;
+        while (parent[j] != j)
+            j = parent[j];
+        while (parent[i] != j) {
+            int k = parent[i];
+            parent[i] = j;
+            i = k;
+        }
         return j;
-    else {
-        if (j == 0)
-            return i;
-        else
-            return ccunion(i, j, parent);
     }
-}
+    
+    // creates union by making the tree with the larger root a subtree of the other
+    int unite(int i, int j) {
+        int ii = find(i);
+        int jj = find(j);
+        if (ii == jj)
+            return ii;
+        if (jj < ii)
+            swap(ii, jj);
+        parent[jj] = ii;
+        struct ccomp &c = comp(ii), &d = comp(jj);
+        c.n += d.n;
+        c.x1 = min(c.x1, d.x1);
+        c.x2 = max(c.x2, d.x2);
+        c.y1 = min(c.y1, d.y1);
+        c.y2 = max(c.y2, d.y2);
+        return ii;
+    }
+};
 
-// First version: connected components of target value UNK
-// Compute connected components of band b in float image using integer image 'components' 
-// using the union-find method.  Use numNeighbors (4 or 8) neighbors.  
-// return a vector of all the componenents found.
-vector<struct ccomp> computeUnkComponents(CFloatImage img, int b, CIntImage &components) {
+// Compute connected components of band b in float image using integer image 'components':
+// the pixels with value v for which member(v) holds, where 4-neighbors with values v, u are
+// connected if joins(v, u).  Return a vector of all the components found, with the component
+// k at index k (index 0 is not used, and is 0 in 'components')
+template <class Member, class Joins>
+static vector<struct ccomp> labelComponents(CFloatImage &img, int b, CIntImage &components,
+                                            Member member, Joins joins)
+{
     CShape sh = img.Shape();
     int w = sh.width, h = sh.height;
     sh.nBands = 1;
     components.ReAllocate(sh);
+    int step = w > 1 ? (int)(&img.Pixel(1, 0, b) - &img.Pixel(0, 0, b)) : 1;
     
-    float targetVal = UNK; // find holes
-    int numNeighbors = 4;  // 4 or 8
-    
-    vector<int> parent;
-    parent.push_back(0); // index 0 is not used
-    
-    int x, y;
-    int label = 0;
-    
-    // first pass
-    for (y = 0; y < h; y++) {
-        for (x = 0; x < w; x++) {
-            float val = img.Pixel(x, y, b);
-            if (val == targetVal) {
-                int *pp = &parent[0];
-                int c1 = (x > 0 ? components.Pixel(x-1, y,   0) : 0);
-                int c2 = (y > 0 ? components.Pixel(x,   y-1, 0) : 0);
-                int c = cccombine(c1, c2, pp);
-                if (numNeighbors == 8 && y > 0) {
-                    int c3 = (x > 0   ? components.Pixel(x-1, y-1, 0) : 0);
-                    int c4 = (x < w-1 ? components.Pixel(x+1, y-1, 0) : 0);
-                    c = cccombine(c, c3, pp);
-                    c = cccombine(c, c4, pp);
+    cclabels lab(w, h);
+    
+    // first pass: label each band (-1 if not a component)
+    parallelFor(h, [&](int y0, int y1) {
+        struct ccband &band = lab.band[y0];
+        int label = y0 * w;
+        for (int y = y0; y < y1; y++) {
+            lab.bandstart[y] = y0;
+            float *row = &img.Pixel(0, y, b);
+            float *up = (y > y0) ? &img.Pixel(0, y-1, b) : NULL;
+            int *crow = &components.Pixel(0, y, 0);
+            int *cup = (y > y0) ? &components.Pixel(0, y-1, 0) : NULL;
+            for (int x = 0; x < w; x++) {
+                float val = row[x*step];
+                if (!member(val)) {
+                    crow[x] = -1;
+                    continue;
                 }
-                if (c == 0) { // new component
-                    //parent[label] = 0;
-                    label++;
-                    parent.push_back(0); // new component at index label
-                    components.Pixel(x, y, 0) = label;
-                } else { // use combined label
-                    components.Pixel(x, y, 0) = c;
+                int c = -1;
+                if (x > 0 && crow[x-1] >= 0 && joins(val, row[(x-1)*step])) // connected to left
+                    c = crow[x-1];
+                if (up && cup[x] >= 0 && joins(val, up[x*step])) // connected to top
+                    c = (c < 0) ? cup[x] : lab.unite(c, cup[x]);
+                if (c < 0) { // new component
+                    struct ccomp cc = {1, x, x, y, y};
+                    lab.parent[label] = label;
+                    band.comp.push_back(cc);
+                    c = label++;
+                } else {
+                    struct ccomp &cc = lab.comp(lab.find(c));
+                    cc.n++;
+                    cc.x1 = min(x, cc.x1);
+                    cc.x2 = max(x, cc.x2);
+                    cc.y2 = y;
                 }
-            } else { // val != targetVal
-                components.Pixel(x, y, 0) = 0;  // not a component
+                crow[x] = c;
             }
         }
+        band.nlabels = label - y0*w;
+    }, 16);
+    
+    // merge the components that continue across the first row of a band
+    for (int y = 1; y < h; y++) {
+        if (lab.bandstart[y] != y)
+            continue;
+        float *row = &img.Pixel(0, y, b);
+        float *up = &img.Pixel(0, y-1, b);
+        int *crow = &components.Pixel(0, y, 0);
+        int *cup = &components.Pixel(0, y-1, 0);
+        for (int x = 0; x < w; x++) {
+            if (crow[x] >= 0 && cup[x] >= 0 && joins(row[x*step], up[x*step]))
+                lab.unite(crow[x], cup[x]);
+        }
     }
     
-    // count unique components:
+    // assign consecutive labels to the roots, in order, and replace the parent of every other
+    // label (which is smaller) by the label of its root
     int n = 0;
-    vector<int> plabel;
-    plabel.resize(parent.size());
     struct ccomp emptycomp = {0, w, -1, h, -1};
     vector<struct ccomp> comp;
     comp.push_back(emptycomp); // index 0 is not used
-    
-    for (int i = 1; i <= label; i++)
-        if (parent[i] == 0) {
-            plabel[i] = ++n;
-            comp.push_back(emptycomp);
-        }
-    
-    // second pass: process unions, assign consecutive labels, compute size and bbox
-    for (y = 0; y < h; y++) {
-        for (x = 0; x < w; x++) {
-            int c = components.Pixel(x, y, 0);
-            if (c > 0) {
-                int k = plabel[ccfind(c, &parent[0])];
-                components.Pixel(x, y, 0) = k;
-                comp[k].n++;
-                comp[k].x1 = min(x, comp[k].x1);
-                comp[k].x2 = max(x, comp[k].x2);
-                comp[k].y1 = min(y, comp[k].y1);
-                comp[k].y2 = max(y, comp[k].y2);
+    for (int y0 = 0; y0 < h; y0++) {
+        if (lab.bandstart[y0] != y0)
+            continue;
+        struct ccband &band = lab.band[y0];
+        int *parent = &lab.parent[y0 * w];
+        for (int i = 0; i < band.nlabels; i++) {
+            if (parent[i] == y0*w + i) {
+                comp.push_back(band.comp[i]);
+                parent[i] = ++n;
+            } else {
+                parent[i] = lab.parent[parent[i]];
             }
         }
     }
+    
+    // second pass: assign the consecutive labels to the pixels
+    parallelFor(h, [&](int y0, int y1) {
+        for (int y = y0; y < y1; y++) {
+            int *crow = &components.Pixel(0, y, 0);
+            for (int x = 0; x < w; x++)
+                crow[x] = (crow[x] >= 0) ? lab.parent[crow[x]] : 0;
+        }
+    }, 64);
+    
+    return comp;
+}
+
+// First version: connected components of target value UNK
+// Compute connected components of band b in float image using integer image 'components' 
+// using the union-find method.  Use 4 neighbors.  
+// return a vector of all the componenents found.
+vector<struct ccomp> computeUnkComponents(CFloatImage img, int b, CIntImage &components) {
+    float targetVal = UNK; // find holes
+    vector<struct ccomp> comp = labelComponents(img, b, components,
+                                                [=](float val) { return val == targetVal; },
+                                                [=](float, float nval) { return nval == targetVal; });
+    int n = (int)comp.size() - 1;
     printf("found %d componenents\n", n-1);
     
     return comp;
@@ -355,78 +680,11 @@ vector<struct ccomp> computeUnkComponents(CFloatImage img, int b, CIntImage &com
 // Compute connected components of band b in float image using integer image 'components' 
 // using the union-find method.  Use 4 neighbors.  
 // return a vector of all the components found.
-// TODO: avoid code duplication....
 vector<struct ccomp> computeDispComponents(CFloatImage img, int b, CIntImage &components, float thresh) {
-    CShape sh = img.Shape();
-    int w = sh.width, h = sh.height;
-    sh.nBands = 1;
-    components.ReAllocate(sh);
-    
-    vector<int> parent;
-    parent.push_back(0); // index 0 is not used
-    
-    int x, y;
-    int label = 0;
-    
-    // first pass
-    for (y = 0; y < h; y++) {
-        for (x = 0; x < w; x++) {
-            float val = img.Pixel(x, y, b);
-            if (val != UNK) {
-                float val1 = (x > 0 ? img.Pixel(x-1, y,   b) : UNK);
-                float val2 = (y > 0 ? img.Pixel(x  , y-1, b) : UNK);
-                int c = 0;
-                int c1 = (x > 0 ? components.Pixel(x-1, y,   0) : 0);
-                int c2 = (y > 0 ? components.Pixel(x,   y-1, 0) : 0);
-                int *pp = &parent[0];
-                if (fabs(val1 - val) <= thresh) // current pixel is connected to left
-                    c = c1;
-                if (fabs(val2 - val) <= thresh) // current pixel is connected to top
-                    c = cccombine(c, c2, pp);
-                if (c == 0) { // new component
-                    //parent[label] = 0;
-                    label++;
-                    parent.push_back(0); // new component at index label
-                    components.Pixel(x, y, 0) = label;
-                } else { // use combined label
-                    components.Pixel(x, y, 0) = c;
-                }
-            } else { // val == UNK
-                components.Pixel(x, y, 0) = 0;  // not a component
-            }
-        }
-    }
-    // rest is same as before; TODO: factor code
-    
-    // count unique components:
-    int n = 0;
-    vector<int> plabel;
-    plabel.resize(parent.size());
-    struct ccomp emptycomp = {0, w, -1, h, -1};
-    vector<struct ccomp> comp;
-    comp.push_back(emptycomp); // index 0 is not used
-    
-    for (int i = 1; i <= label; i++)
-        if (parent[i] == 0) {
-            plabel[i] = ++n;
-            comp.push_back(emptycomp);
-        }
-    
-    // second pass: process unions, assign consecutive labels, compute size and bbox
-    for (y = 0; y < h; y++) {
-        for (x = 0; x < w; x++) {
-            int c = components.Pixel(x, y, 0);
-            if (c > 0) {
-                int k = plabel[ccfind(c, &parent[0])];
-                components.Pixel(x, y, 0) = k;
-                comp[k].n++;
-                comp[k].x1 = min(x, comp[k].x1);
-                comp[k].x2 = max(x, comp[k].x2);
-                comp[k].y1 = min(y, comp[k].y1);
-                comp[k].y2 = max(y, comp[k].y2);
-            }
-        }
-    }
+    vector<struct ccomp> comp = labelComponents(img, b, components,
+                                                [](float val) { return val != UNK; },
+                                                [=](float val, float nval) { return fabs(nval - val) <= thresh; });
+    int n = (int)comp.size() - 1;
     printf("found %d components\n", n);
     
     return comp;
@@ -461,6 +719,16 @@ void fitPlane(vector<float> vx, vector<float> vy, vector<float> vz, float &a, fl
     b = det * ( (-sxy*s1+sx*sy)*sxz+(sxx*s1-sx*sx)*syz+(-sxx*sy+sxy*sx)*sz );
     c = det * ( (sxy*sy-sx*syy)*sxz+(-sxx*sy+sxy*sx)*syz+(sxx*syy-sxy*sxy)*sz );
 }
+
+// same, but from accumulated sums (e.g. running sums over a sliding window)
+void fitPlaneSums(double s1, double sx, double sy, double sz, double sxx, double sxy, double sxz,
+                  double syy, double syz, float &a, float &b, float &c)
+{
+    double det = 1.0 / (sxx*syy*s1-sxx*sy*sy-sxy*sxy*s1+2.0*sxy*sx*sy-sx*sx*syy);
+    a = det * ( (syy*s1-sy*sy)*sxz+(-sxy*s1+sx*sy)*syz+(sxy*sy-sx*syy)*sz );
+    b = det * ( (-sxy*s1+sx*sy)*sxz+(sxx*s1-sx*sx)*syz+(-sxx*sy+sxy*sx)*sz );
+    c = det * ( (sxy*sy-sx*syy)*sxz+(-sxx*sy+sxy*sx)*syz+(sxx*syy-sxy*sxy)*sz );
+}
 // I generated the above equations using the following Maple program:
 // restart; with(linalg);
 // A := matrix( 3, 3, [sxx, sxy, sx, sxy, syy, sy, sx, sy, s1]);
@@ -670,11 +938,35 @@ float robustAverage(vector<float> nums, float maxdiff, int mingroup){
  
  */
 
-CFloatImage mergeToFloImage(CFloatImage &x, CFloatImage &y)
+// copy band sb of src into band db of dst (same width and height), a row at a time if both
+// bands are stored as rows of adjacent values
+static void copyBand(CFloatImage &src, int sb, CFloatImage &dst, int db)
+{
+    CShape sh = src.Shape();
+    int rows = src.Planar() && dst.Planar();
+    for (int j = 0; j < sh.height; j++) {
+        if (rows) {
+            memcpy(&dst.Pixel(0, j, db), &src.Pixel(0, j, sb), sh.width * sizeof(float));
+            continue;
+        }
+        for (int i = 0; i < sh.width; i++)
+            dst.Pixel(i, j, db) = src.Pixel(i, j, sb);
+    }
+}
+
+CFloatImage mergeToFloImage(CFloatImage &x, CFloatImage &y, int planar)
 {
     CShape sh = CShape(x.Shape().width, x.Shape().height, 2);
-    CFloatImage merged(sh);
+    CFloatImage merged;
+    
+    if (planar) {
+        merged.ReAllocatePlanar(sh);
+        copyBand(x, 0, merged, 0);
+        copyBand(y, 0, merged, 1);
+        return merged;
+    }
     
+    merged.ReAllocate(sh);
     for(int j = 0; j < sh.height; j++){
         for(int i = 0 ; i < sh.width; i++){
             merged.Pixel(i,j,0) = x.Pixel(i,j,0);
@@ -687,6 +979,9 @@ CFloatImage mergeToFloImage(CFloatImage &x, CFloatImage &y)
 
 pair<CFloatImage, CFloatImage> splitFloImage(CFloatImage &merged)
 {
+    if (merged.Planar())
+        return pair<CFloatImage, CFloatImage>(merged.BandView(0), merged.BandView(1));
+    
     CShape sh = CShape(merged.Shape().width, merged.Shape().height, 1);
     CFloatImage x(sh);
     CFloatImage y(sh);
@@ -716,12 +1011,141 @@ void WriteBand(CFloatImage& img, int band, float scale, const char* filename, in
     WriteImageVerb(dst, filename, verbose);
 }
 
+void transposeBlock(const float *src, int sstride, float *dst, int dstride, int nx, int ny)
+{
+    const int T = 8;
+    for (int y0 = 0; y0 < ny; y0 += T) {
+        int y1 = min(ny, y0 + T);
+        for (int x0 = 0; x0 < nx; x0 += T) {
+            int x1 = min(nx, x0 + T);
+            for (int y = y0; y < y1; y++) {
+                for (int x = x0; x < x1; x++)
+                    dst[x * dstride + y] = src[y * sstride + x];
+            }
+        }
+    }
+}
+
+// background thread for writeImageAsync.  CImage reference counts are not thread-safe,
+// so only deep copies are queued, whose only reference is then handed to the writer
+class ImageWriter
+{
+public:
+    ImageWriter() : pending(0), stopping(false) {}
+
+    ~ImageWriter() {
+        {
+            lock_guard<mutex> lock(mtx);
+            stopping = true;
+        }
+        cv.notify_all();
+        if (worker.joinable())
+            worker.join();
+    }
+
+    void add(CFloatImage &img, const char *filename, int verbose) {
+        Job job;
+        job.img.ReAllocate(img.Shape());
+        CShape sh = img.Shape();
+        int rowsize = sh.width * sh.nBands * sizeof(float);
+        if (img.Interleaved()) {
+            for (int y = 0; y < sh.height; y++)
+                memcpy(&job.img.Pixel(0, y, 0), &img.Pixel(0, y, 0), rowsize);
+        } else { // planar image or band view
+            for (int b = 0; b < sh.nBands; b++)
+                copyBand(img, b, job.img, b);
+        }
+        job.filename = filename;
+        job.verbose = verbose;
+        {
+            lock_guard<mutex> lock(mtx);
+            if (!worker.joinable())
+                worker = thread(&ImageWriter::work, this);
+            jobs.push_back(job);
+            pending++;
+            job.img.DeAllocate(); // drop this thread's reference before the writer can see the job
+        }
+        cv.notify_all();
+    }
+
+    void flush() {
+        unique_lock<mutex> lock(mtx);
+        while (pending > 0)
+            done.wait(lock);
+        if (error) {
+            exception_ptr e = error;
+            error = nullptr;
+            rethrow_exception(e);
+        }
+    }
+
+private:
+    struct Job {
+        CFloatImage img;
+        string filename;
+        int verbose;
+    };
+
+    void work() {
+        while (true) {
+            Job job;
+            {
+                unique_lock<mutex> lock(mtx);
+                while (!stopping && jobs.empty())
+                    cv.wait(lock);
+                if (jobs.empty())
+                    return;
+                job = jobs.front();
+                jobs.pop_front();
+            }
+            try {
+                WriteImageVerb(job.img, job.filename.c_str(), job.verbose);
+            } catch (...) {
+                lock_guard<mutex> lock(mtx);
+                if (!error)
+                    error = current_exception();
+            }
+            job.img.DeAllocate();
+            lock_guard<mutex> lock(mtx);
+            pending--;
+            done.notify_all();
+        }
+    }
+
+    thread worker;
+    deque<Job> jobs;
+    int pending;        // number of queued or unfinished jobs
+    bool stopping;
+    exception_ptr error;
+    mutex mtx;
+    condition_variable cv, done;
+};
+
+static ImageWriter imageWriter;
+
+void writeImageAsync(CFloatImage &img, const char* filename, int verbose)
+{
+    imageWriter.add(img, filename, verbose);
+}
+
+void flushImageWrites()
+{
+    imageWriter.flush();
+}
+
 
-CFloatImage mergeToNBandImage(vector<CFloatImage*> imgs)
+CFloatImage mergeToNBandImage(vector<CFloatImage*> imgs, int planar)
 {
     CFloatImage merged;
     CShape sh = CShape(imgs[0]->Shape().width, imgs[0]->Shape().height, (int) imgs.size());
     
+    if (planar) {
+        merged.ReAllocatePlanar(sh);
+        for (int k = 0; k < sh.nBands; k++)
+            copyBand(*imgs[k], 0, merged, k);
+        return merged;
+    }
+    
     merged.ReAllocate(sh);
     merged.ClearPixels();
     
@@ -742,6 +1166,12 @@ vector<CFloatImage> splitNBandImage(CFloatImage &merged)
     
     vector<CFloatImage> imgs;
     
+    if (merged.Planar()) {
+        for (int k = 0; k < n; k++)
+            imgs.push_back(merged.BandView(k));
+        return imgs;
+    }
+    
     for(int i = 0; i < n; i++){
         CFloatImage im;
         im.ReAllocate(sh);
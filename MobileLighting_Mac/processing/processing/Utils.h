@@ -48,6 +48,8 @@ void medianfilter(CFloatImage src, CFloatImage &dst, int k, int b);
 
 
 // connected components
+// both versions label rows in parallel (see labelComponents in Utils.cpp); components are
+// numbered 1..n in the order of their first pixels, and the pixels of no component are 0
 
 struct ccomp
 {
@@ -69,22 +71,41 @@ int atoiSafe(char *s);
 float robustAverage(vector<float> nums, float maxdiff, int mingroup);
 
 //Combine 2 single channel float image into one .flo image
-CFloatImage mergeToFloImage(CFloatImage &x, CFloatImage &y);
+// if planar, the bands are stored as planes (see ReAllocatePlanar), as splitFloImage can then
+// share them instead of copying.  the matching code (computeDisparities) needs interleaved bands
+CFloatImage mergeToFloImage(CFloatImage &x, CFloatImage &y, int planar = 0);
 
 // split .flo image into to float images
+// the bands of a planar image are returned as views sharing its memory (see BandView)
 pair<CFloatImage,CFloatImage> splitFloImage(CFloatImage &merged);
 
 // save one band of a flo image
 void WriteBand(CFloatImage& img, int band, float scale, const char* filename, int verbose);
 
+// copy the ny x nx block at src (rows sstride floats apart) transposed to dst (rows dstride apart),
+// in small tiles so that both sides are read and written in cache-friendly order
+void transposeBlock(const float *src, int sstride, float *dst, int dstride, int nx, int ny);
+
+// write a copy of img on a background thread (write-behind), so the caller can go on computing.
+// errors are reported (rethrown) by the next flushImageWrites()
+void writeImageAsync(CFloatImage &img, const char* filename, int verbose);
+
+// wait until all images queued by writeImageAsync are written
+void flushImageWrites();
+
 
 // plane fit z ~ ax + by + c, where x, y, z are given as vectors
 void fitPlane(vector<float> vx, vector<float> vy, vector<float> vz, float &a, float &b, float &c);
 
+// same, but from accumulated sums s1 = # points, sx = sum of x, sxy = sum of x*y, etc.
+void fitPlaneSums(double s1, double sx, double sy, double sz, double sxx, double sxy, double sxz,
+                  double syy, double syz, float &a, float &b, float &c);
+
 
 void ReadFlowFileVerb(CFloatImage& img, const char* filename, int verbose);
 void WriteFlowFileVerb(CFloatImage img, const char* filename, int verbose);
 
-CFloatImage mergeToNBandImage(vector<CFloatImage*> imgs);
+// same for any number of bands
+CFloatImage mergeToNBandImage(vector<CFloatImage*> imgs, int planar = 0);
 vector<CFloatImage> splitNBandImage(CFloatImage &merged);
  // end
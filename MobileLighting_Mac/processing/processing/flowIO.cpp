@@ -111,6 +111,16 @@ void WriteFlowFile(CFloatImage img, const char* filename)
     if (nBands != 2)
 	throw CError("WriteFlowFile(%s): image must have 2 bands", filename);
 
+    // the rows are written as stored, so write a copy of planar images
+    if (! img.Interleaved()) {
+	CFloatImage copy(sh);
+	for (int y = 0; y < height; y++)
+	    for (int x = 0; x < width; x++)
+		for (int b = 0; b < nBands; b++)
+		    copy.Pixel(x, y, b) = img.Pixel(x, y, b);
+	img = copy;
+    }
+
     FILE *stream = fopen(filename, "wb");
     if (stream == 0)
         throw CError("WriteFlowFile: could not open %s", filename);
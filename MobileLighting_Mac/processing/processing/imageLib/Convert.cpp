@@ -76,12 +76,30 @@ extern void ScaleAndOffset(CImageOf<T1>& src, CImageOf<T2>& dst, float scale, fl
     //    src.MaxVal() * scale + offset <= maxVal)
     //    minVal = maxVal = 0;
 
-    // Process each row
-    for (int y = 0; y < sShape.height; y++)
+    // Process each row (of each band, if the bands are planes)
+    if (src.Interleaved() && dst.Interleaved())
+    {
+        for (int y = 0; y < sShape.height; y++)
+        {
+            int n = sShape.width * sShape.nBands;
+            ScaleAndOffsetLine(&src.Pixel(0, y, 0), &dst.Pixel(0, y, 0),
+                               n, scale, offset, minVal, maxVal);
+        }
+    }
+    else if (src.Planar() && dst.Planar())
     {
-        int n = sShape.width * sShape.nBands;
-        ScaleAndOffsetLine(&src.Pixel(0, y, 0), &dst.Pixel(0, y, 0),
-                           n, scale, offset, minVal, maxVal);
+        for (int b = 0; b < sShape.nBands; b++)
+            for (int y = 0; y < sShape.height; y++)
+                ScaleAndOffsetLine(&src.Pixel(0, y, b), &dst.Pixel(0, y, b),
+                                   sShape.width, scale, offset, minVal, maxVal);
+    }
+    else
+    {
+        for (int y = 0; y < sShape.height; y++)
+            for (int x = 0; x < sShape.width; x++)
+                for (int b = 0; b < sShape.nBands; b++)
+                    ScaleAndOffsetLine(&src.Pixel(x, y, b), &dst.Pixel(x, y, b),
+                                       1, scale, offset, minVal, maxVal);
     }
 }
 
@@ -96,6 +114,8 @@ extern CImageOf<T> ConvertToRGBA(CImageOf<T> src)
     // Make sure the source is a gray image
     if (sShape.nBands != 1)
         throw CError("ConvertToRGBA: can only convert from 1-band (gray) image");
+    if (! src.Interleaved())
+        throw CError("ConvertToRGBA: can only convert from image with adjacent pixels");
 
     // Allocate the new image
     CShape dShape(sShape.width, sShape.height, 4);
@@ -125,6 +145,8 @@ extern CImageOf<T> ConvertToGray(CImageOf<T> src)
     // Make sure the source is a color image
     if (sShape.nBands != 4 || src.alphaChannel != 3)
         throw CError("ConvertToGray: can only convert from 4-band (RGBA) image");
+    if (! src.Interleaved())
+        throw CError("ConvertToGray: can only convert from image with interleaved bands");
 
     // Allocate the new image
     CShape dShape(sShape.width, sShape.height, 1);
@@ -176,10 +198,12 @@ extern void BandSelect(CImageOf<T>& src, CImageOf<T>& dst, int sBand, int dBand)
     // Process each row
     for (int y = 0; y < sShape.height; y++)
     {
-        T* srcP = &src.Pixel(0, y, 0);
-        T* dstP = &dst.Pixel(0, y, 0);
-        for (int x = 0; x < sShape.width; x++, srcP += sB, dstP += dB)
-            dstP[dBand] = srcP[sBand];
+        T* srcP = &src.Pixel(0, y, sBand);
+        T* dstP = &dst.Pixel(0, y, dBand);
+        int sS = (sShape.width > 1) ? &src.Pixel(1, y, sBand) - srcP : 0;
+        int dS = (sShape.width > 1) ? &dst.Pixel(1, y, dBand) - dstP : 0;
+        for (int x = 0; x < sShape.width; x++, srcP += sS, dstP += dS)
+            *dstP = *srcP;
     }
 }
 
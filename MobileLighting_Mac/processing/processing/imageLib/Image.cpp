@@ -51,6 +51,7 @@ void CImage::SetDefaults()
     m_bandSize = 0;         // size of each band in bytes
     m_pixSize = 0;          // stride between pixels in bytes
     m_rowSize = 0;          // stride between rows in bytes
+    m_bandStride = 0;       // stride between bands in bytes
     m_memStart = 0;         // start of addressable memory
     alphaChannel = 3;       // which channel contains alpha (for compositing)
 
@@ -76,11 +77,25 @@ CImage::CImage(CShape s, const type_info& ti, int cS)
 void CImage::ReAllocate(CShape s, const type_info& ti, int bandSize,
                         bool evenIfSameShape)
 {
-    if (! evenIfSameShape && s == m_shape && ti == *m_pTI && bandSize == m_bandSize)
+    if (! evenIfSameShape && s == m_shape && ti == *m_pTI && bandSize == m_bandSize &&
+        Interleaved())
         return;
     ReAllocate(s, ti, bandSize, 0, true, 0);
 }
 
+void CImage::ReAllocatePlanar(CShape s, const type_info& ti, int bandSize,
+                              bool evenIfSameShape)
+{
+    if (! evenIfSameShape && s == m_shape && ti == *m_pTI && bandSize == m_bandSize &&
+        Planar())
+        return;
+
+    // Allocate the bands as one tall 1-band image, one plane after the other
+    ReAllocate(CShape(s.width, s.height * s.nBands, 1), ti, bandSize, 0, true, 0);
+    m_shape      = s;                       // image shape (dimensions)
+    m_bandStride = m_rowSize * s.height;    // stride between bands in bytes
+}
+
 void CImage::ReAllocate(CShape s, const type_info& ti, int bandSize,
                         void *memory, bool deleteWhenDone, int rowSize)
 {
@@ -89,6 +104,7 @@ void CImage::ReAllocate(CShape s, const type_info& ti, int bandSize,
     m_pTI       = &ti;                      // pointer to type_info class
     m_bandSize  = bandSize;                 // size of each band in bytes
     m_pixSize   = m_bandSize * s.nBands;    // stride between pixels in bytes
+    m_bandStride = m_bandSize;              // stride between bands in bytes
 
     // Do the real allocation work
     m_rowSize   = (rowSize) ? rowSize :     // stride between rows in bytes
@@ -126,6 +142,16 @@ void CImage::SetSubImage(int x, int y, int width, int height)
     m_shape.height = y1 - y;                    // actual height
 }
 
+void CImage::SetBandView(int band)
+{
+    if (band < 0 || band >= m_shape.nBands)
+        throw CError("CImage::SetBandView: band %d is invalid", band);
+
+    // Adjust the start of memory pointer; the strides stay the same
+    m_memStart = (char *) PixelAddress(0, 0, band);
+    m_shape.nBands = 1;
+}
+
 void CImage::SetPixels(void *val_ptr)
 {
     // Fill the image with a value
@@ -136,11 +162,23 @@ void CImage::SetPixels(void *val_ptr)
     for (int b = 0; b < m_bandSize; b++)
         all_same = all_same && (vc[b] == vc[0]);
 
-    // Iterate over the rows
-    int nC = m_shape.width * m_shape.nBands;
+    // Band views of interleaved images: set one value at a time
+    if (! Planar() && ! Interleaved())
+    {
+        for (int y = 0; y < m_shape.height; y++)
+            for (int x = 0; x < m_shape.width; x++)
+                for (int b = 0; b < m_shape.nBands; b++)
+                    memcpy(PixelAddress(x, y, b), vc, m_bandSize);
+        return;
+    }
+
+    // Iterate over the rows (of each band, if the bands are planes)
+    int nP = Interleaved() ? 1 : m_shape.nBands;
+    int nC = m_shape.width * m_shape.nBands / nP;
+    for (int p = 0; p < nP; p++)
     for (int y = 0; y < m_shape.height; y++)
     {
-        uchar *rp = (uchar *) PixelAddress(0, y, 0);
+        uchar *rp = (uchar *) PixelAddress(0, y, p);
         if (all_same)
             memset(rp, vc[0], nC * m_bandSize);
         else if (m_bandSize == sizeof(int))
@@ -15,6 +15,11 @@
 //  number of bands (channels) per pixel.  For example, traditional RGBA
 //  images can be represented using a 4-channel unsigned_8 image.
 //
+//  The bands of a pixel are normally stored next to each other (interleaved).
+//  Images allocated with ReAllocatePlanar() store each band as a plane of
+//  its own instead, so that BandView() can share one band with an ordinary
+//  1-band image (rows of adjacent values) without copying it.
+//
 //  Images are normally allocated on the stack (NOT on the heap, i.e.,
 //  "new Image" should not be used).  They can be freely returned from
 //  functions and put into other data structures.  Assignment and copy
@@ -123,15 +128,21 @@ public:
                     void *memory, bool deleteWhenDone, int rowSize);
     void ReAllocate(CShape s, const type_info& ti, int bandSize,
                     bool evenIfSameShape = false);
+    void ReAllocatePlanar(CShape s, const type_info& ti, int bandSize,
+                          bool evenIfSameShape = false);
     void DeAllocate(void);      // release the memory & set to default values
 
     CShape Shape(void)              { return m_shape; }
     const type_info& PixType(void)  { return *m_pTI; }
     int BandSize(void)              { return m_bandSize; }
+    bool Planar(void)               { return m_pixSize == m_bandSize; }
+    bool Interleaved(void)          { return m_pixSize == m_bandSize * m_shape.nBands &&
+                                             (m_shape.nBands == 1 || m_bandStride == m_bandSize); }
 
     void* PixelAddress(int x, int y, int band);
 
     void SetSubImage(int xO, int yO, int width, int height);   // sub-image sharing memory
+    void SetBandView(int band);     // single band sharing memory
 
 protected:
     void SetPixels(void *val_ptr);  // Fill the image with a value
@@ -144,6 +155,7 @@ private:
     int m_bandSize;         // size of each band in bytes
     int m_pixSize;          // stride between pixels in bytes
     int m_rowSize;          // stride between rows in bytes
+    int m_bandStride;       // stride between bands in bytes
     char* m_memStart;       // start of addressable memory
     CRefCntMem m_memory;    // reference counted memory
 public:
@@ -153,7 +165,7 @@ public:
 inline void* CImage::PixelAddress(int x, int y, int band)
 {
     // This could also go into the implementation file (CImage.cpp):
-    return (void *) &m_memStart[y * m_rowSize + x * m_pixSize + band * m_bandSize];
+    return (void *) &m_memStart[y * m_rowSize + x * m_pixSize + band * m_bandStride];
 }
 
 
@@ -170,10 +182,12 @@ public:
 
     void ReAllocate(CShape s, bool evenIfSameShape = false);
     void ReAllocate(CShape s, T *memory, bool deleteWhenDone, int rowSize);
+    void ReAllocatePlanar(CShape s, bool evenIfSameShape = false);
 
     T& Pixel(int x, int y, int band);
 
     CImageOf SubImage(int x, int y, int width, int height);   // sub-image sharing memory
+    CImageOf BandView(int band);    // single band sharing memory
 
     void FillPixels(T val);     // fill the image with a constant value
     void ClearPixels(void);     // fill the image with a 0 value
@@ -208,6 +222,12 @@ inline void CImageOf<T>::ReAllocate(CShape s, T *memory,
 {
     CImage::ReAllocate(s, typeid(T), sizeof(T), memory, deleteWhenDone, rowSize);
 }
+
+template <class T>
+inline void CImageOf<T>::ReAllocatePlanar(CShape s, bool evenIfSameShape)
+{
+    CImage::ReAllocatePlanar(s, typeid(T), sizeof(T), evenIfSameShape);
+}
     
 template <class T>
 inline T& CImageOf<T>::Pixel(int x, int y, int band)
@@ -224,6 +244,15 @@ inline CImageOf<T> CImageOf<T>::SubImage(int x, int y, int width, int height)
     return retval;
 }
 
+template <class T>
+inline CImageOf<T> CImageOf<T>::BandView(int band)
+{
+    // single band sharing memory
+    CImageOf<T> retval = *this;
+    retval.SetBandView(band);
+    return retval;
+}
+
 template <class T>
 inline void CImageOf<T>::FillPixels(T val)
 {
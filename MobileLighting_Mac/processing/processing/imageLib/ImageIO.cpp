@@ -703,12 +703,32 @@ void ReadImage (CImage& img, const char* filename)
 }
 
 
+static void CopyInterleaved(CImage& src, CImage& dst)
+{
+    // Copy src into a new image with interleaved bands (the layout of the files)
+    CShape sh = src.Shape();
+    int bandSize = src.BandSize();
+    dst.ReAllocate(sh, src.PixType(), bandSize, true);
+    for (int y = 0; y < sh.height; y++)
+        for (int x = 0; x < sh.width; x++)
+            for (int b = 0; b < sh.nBands; b++)
+                memcpy(dst.PixelAddress(x, y, b), src.PixelAddress(x, y, b), bandSize);
+}
 
 // new 12/2/2013 DS: if filename == '-', write to stdout in .pgm / .ppm format
 void WriteImage(CImage& img, const char* filename)
 {
     if (filename == NULL)
 	throw CError("WriteImage: empty filename");
+
+    // The writers go by rows of pixels: write planar images and band views as a copy
+    if (! img.Interleaved())
+    {
+        CImage copy;
+        CopyInterleaved(img, copy);
+        WriteImage(copy, filename);
+        return;
+    }
     
     if (strcmp(filename, "-") == 0) { // write to stdout
         if (img.PixType() == typeid(uchar)) {
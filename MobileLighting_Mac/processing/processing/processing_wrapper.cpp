@@ -13,6 +13,7 @@
 #include "Decode.h"
 #include "ShowShadows.hpp"
 #include "TransformPFM.hpp"
+#include "Parallel.h"
 #include "calibration/track_markers.hpp"
 #include "calibration/calib_utils.hpp"
 #include "calibration/compute_params.hpp"
@@ -31,6 +32,9 @@
 #include <stdio.h>
 #include <string>
 #include <time.h>
+#include <mutex>
+#include <memory>
+#include <sys/stat.h>
 
 using namespace std;
 using namespace cv;
@@ -39,6 +43,95 @@ using namespace aruco;
 
 #define BUFFERSIZE 1000
 
+// modification time (with sub-second part) and size of a file, which tell whether it changed
+struct FileStamp
+{
+    time_t sec;
+    long nsec;
+    off_t size;
+    
+    bool operator==(const FileStamp &o) const { return sec == o.sec && nsec == o.nsec && size == o.size; }
+};
+
+static FileStamp fileStamp(const char *path)
+{
+    FileStamp s = {0, 0, 0};
+    struct stat st;
+    if (stat(path, &st) == 0) {
+        s.sec = st.st_mtime;
+#ifdef __APPLE__
+        s.nsec = st.st_mtimespec.tv_nsec;
+#else
+        s.nsec = st.st_mtim.tv_nsec;
+#endif
+        s.size = st.st_size;
+    }
+    return s;
+}
+
+// code images read by disparitiesOfRefinedImgs, with their search structures, kept as long as
+// their files don't change (e.g. when pairs are rerun with other settings).  entries are shared
+// (and never changed) rather than copied, as the reference counts of CImage are not thread-safe
+struct CachedCodes
+{
+    string ufile, vfile;
+    FileStamp ustamp, vstamp;
+    int scanline;
+    mutable CFloatImage merged;     // only read; mutable as CImage has no const accessors
+    shared_ptr<const MatchIndex> index;
+};
+#define CODECACHE_SIZE 2            // a pair
+static vector<shared_ptr<const CachedCodes> > codeCache; // least recently used first
+static std::mutex codeCacheMutex;
+
+// merged code image of ufile and vfile and its search structures, read and built if not cached
+static shared_ptr<const CachedCodes> cachedCodeImage(const char *ufile, const char *vfile, int scanline, int verbose)
+{
+    std::lock_guard<std::mutex> lock(codeCacheMutex);
+    FileStamp ustamp = fileStamp(ufile), vstamp = fileStamp(vfile);
+    for (size_t i = 0; i < codeCache.size(); i++) {
+        shared_ptr<const CachedCodes> c = codeCache[i];
+        if (c->ufile == ufile && c->vfile == vfile && c->ustamp == ustamp && c->vstamp == vstamp &&
+            c->scanline == scanline) {
+            if (verbose)
+                printf("reusing %s, %s\n", ufile, vfile);
+            codeCache.erase(codeCache.begin() + i);
+            codeCache.push_back(c);
+            return c;
+        }
+    }
+    
+    CFloatImage x, y;
+    ReadImageVerb(x, ufile, verbose);
+    ReadImageVerb(y, vfile, verbose);
+    shared_ptr<CachedCodes> c = make_shared<CachedCodes>();
+    c->ufile = ufile;
+    c->vfile = vfile;
+    c->ustamp = ustamp;
+    c->vstamp = vstamp;
+    c->scanline = scanline;
+    c->merged = mergeToFloImage(x, y);
+    c->index = buildMatchIndex(c->merged, scanline);
+    if (codeCache.size() >= CODECACHE_SIZE)
+        codeCache.erase(codeCache.begin());
+    codeCache.push_back(c);
+    return c;
+}
+
+// the pixels of region (see DisparityRegion) in an image of shape sh.  returns 0 (and leaves
+// mask alone) if region is NULL or covers the whole image without a mask
+static int regionImage(const DisparityRegion *region, CShape sh, CByteImage &mask)
+{
+    if (region == NULL || (region->width <= 0 && region->maskfile == NULL))
+        return 0;
+    CByteImage fg;
+    if (region->maskfile != NULL)
+        ReadImageVerb(fg, region->maskfile, 1);
+    mask = regionMask(sh, region->x, region->y, region->width, region->height,
+                      region->maskfile != NULL ? &fg : NULL);
+    return 1;
+}
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -64,6 +157,11 @@ extern "C" {
     }
 
     // Non-calibration processing
+    // number of threads used by the processing functions; n <= 0 uses all cores
+    void setProcessingThreads(int n) {
+        setNumThreads(n);
+    }
+
     void transformPfm( char *pfmPath, char *transformation ) {
         transformpfm(pfmPath,transformation);
     }
@@ -72,8 +170,70 @@ extern "C" {
         writeshadowimgs(decodedDir, outDir, projs, nProjs, pos);
     }
 
+    // decode numIm thresholded images (bit 0 first) with the code table in codefile (minSW.dat)
+    // into outdir/result<posID><u|v>-0initial.pfm.  returns 0 on success, -1 on error (printed)
+    int decodeThresholdedIms(char *outdir, char *codefile, int direction, char **imList, int numIm, char *posID) {
+        try {
+            decodeThresholded(outdir, codefile, direction, imList, numIm, posID);
+        } catch (CError &err) {
+            fprintf(stderr, "decode %s: %s\n", codefile, err.message);
+            return -1;
+        }
+        return 0;
+    }
+
+    // same from the normal and inverted raw exposures of each bit, thresholded like on the
+    // phone (angle: stripe angle from the metadata, thresh: e.g. 0.035)
+    int decodeExposureIms(char *outdir, char *codefile, int direction, char **normalList, char **invertedList, int numIm, double angle, float thresh, char *posID) {
+        try {
+            decodeExposures(outdir, codefile, direction, normalList, invertedList, numIm, angle, thresh, posID);
+        } catch (CError &err) {
+            fprintf(stderr, "decode %s: %s\n", codefile, err.message);
+            return -1;
+        }
+        return 0;
+    }
+
     void refineDecodedIm(char *outdir, int direction, char* decodedIm, double angle, char *posID) {
         refine(outdir, direction, decodedIm, angle, posID);	// returns final CFloatImage, ignore
+        flushImageWrites(); // callers expect the images on disk
+    }
+
+    // same, with given parameters (start from defaultRefineParams())
+    void refineDecodedImParams(char *outdir, int direction, char* decodedIm, double angle, char *posID, RefineParams params) {
+        refine(outdir, direction, decodedIm, angle, posID, params);
+        flushImageWrites();
+    }
+
+    // refine count decoded images; job i has the arguments outdirs[i], directions[i], ... of
+    // refineDecodedIm, and parameters params[i] (defaults if params is NULL).  runs up to
+    // nworkers jobs at once (<= 0: one per core), as long as their estimated memory fits into
+    // maxMemoryMB (<= 0: no limit).  status[i] is set to 0 if job i succeeded, -1 if it failed.
+    // returns the number of failed jobs
+    int refineDecodedImBatch(char **outdirs, int *directions, char **decodedIms, double *angles, char **posIDs,
+                             RefineParams *params, int count, int nworkers, int maxMemoryMB, int *status) {
+        vector<RefineJob> jobs(count);
+        for (int i = 0; i < count; i++) {
+            jobs[i].outdir = outdirs[i];
+            jobs[i].direction = directions[i];
+            jobs[i].decodedIm = decodedIms[i];
+            jobs[i].angle = angles[i];
+            jobs[i].posID = posIDs[i];
+            jobs[i].params = (params != NULL) ? params[i] : defaultRefineParams();
+        }
+        vector<int> st = refineBatch(jobs, nworkers, maxMemoryMB);
+        flushImageWrites();
+        int nfailed = 0;
+        for (int i = 0; i < count; i++) {
+            status[i] = st[i];
+            nfailed += (st[i] != 0);
+        }
+        return nfailed;
+    }
+
+    void clearDisparityCache() {
+        std::lock_guard<std::mutex> lock(codeCacheMutex);
+        codeCache.clear();
     }
 
     void computeMaps(char *impath, char *intr, char *extr) {
@@ -96,13 +256,12 @@ extern "C" {
         }
     }
 
-    void disparitiesOfRefinedImgs(char *posdir0, char *posdir1, char *outdir0, char *outdir1, int pos0, int pos1, int rectified, int dXmin, int dXmax, int dYmin, int dYmax) {
+    void disparitiesOfRefinedImgs(char *posdir0, char *posdir1, char *outdir0, char *outdir1, int pos0, int pos1, int rectified, int dXmin, int dXmax, int dYmin, int dYmax, int pyramidLevels, int autoRange,
+                                  const DisparityRegion *region0, const DisparityRegion *region1) {
         // in0, in1 are flo images, need to create
         // so inputs should be to directories?
         int verbose = 1;
         
-        CFloatImage x, y;
-        CFloatImage merged0, merged1;
         CFloatImage fdisp0, fdisp1;
         char filename[BUFFERSIZE]; //, in0[1000], in1[1000];
         
@@ -115,20 +274,24 @@ extern "C" {
             sprintf(rightID, "%d", pos1);
         }
         
-        // first create necessary FLO files for computeDisparities()
+        // first create necessary FLO files for computeDisparities(), or take them from the cache
+        // the search structures computeDisparities will use (for the matches after the
+        // estimation of the ranges, if autoRange)
+        int scanline = rectified && (dXmin < dXmax || autoRange);
+        char vfilename[BUFFERSIZE];
         sprintf(filename, "%s/result%su-4refined2.pfm", posdir0, leftID);
-        ReadImageVerb(x, filename, 1);
-        sprintf(filename, "%s/result%sv-4refined2.pfm", posdir0, leftID);
-        ReadImageVerb(y, filename, 1);
-        merged0 = mergeToFloImage(x, y);
+        sprintf(vfilename, "%s/result%sv-4refined2.pfm", posdir0, leftID);
+        shared_ptr<const CachedCodes> codes0 = cachedCodeImage(filename, vfilename, scanline, 1);
 
         sprintf(filename, "%s/result%su-4refined2.pfm", posdir1, rightID);
-        ReadImageVerb(x, filename, 0);
-        sprintf(filename, "%s/result%sv-4refined2.pfm", posdir1, rightID);
-        ReadImageVerb(y, filename, 0);
-        merged1 = mergeToFloImage(x, y);
+        sprintf(vfilename, "%s/result%sv-4refined2.pfm", posdir1, rightID);
+        shared_ptr<const CachedCodes> codes1 = cachedCodeImage(filename, vfilename, scanline, 0);
 
-        computeDisparities(merged0, merged1, fdisp0, fdisp1, dXmin, dXmax, dYmin, dYmax);
+        CByteImage r0, r1;
+        int use0 = regionImage(region0, codes0->merged.Shape(), r0);
+        int use1 = regionImage(region1, codes1->merged.Shape(), r1);
+        computeDisparities(codes0->merged, codes1->merged, fdisp0, fdisp1, dXmin, dXmax, dYmin, dYmax, pyramidLevels, rectified,
+                           codes0->index, codes1->index, use0 ? &r0 : NULL, use1 ? &r1 : NULL, autoRange);
         
         // now need to separate L(fdisp(0|1)) into u,v files corresponding to x-, y- disparities.
         // pair<CFloatImage,CFloatImage> splitFloImage(CFloatImage &merged);
@@ -153,37 +316,26 @@ extern "C" {
         WriteImageVerb(fy1, py1, verbose);
     }
 
-    void crosscheckDisparities(char *posdir0, char *posdir1, int pos0, int pos1, float thresh, int xonly, int halfocc, char *in_suffix, char *out_suffix) {
+    void crosscheckDisparities(char *posdir0, char *posdir1, int pos0, int pos1, float thresh, int xonly, int halfocc, char *in_suffix, char *out_suffix,
+                               const DisparityRegion *region0, const DisparityRegion *region1) {
         CFloatImage x0,x1,y0,y1;
         char buffer[BUFFERSIZE];
         sprintf(buffer, "%s/disp%d%dx-%s.pfm", posdir0, pos0, pos1, in_suffix);
         ReadImageVerb(x0, buffer, 1);
         sprintf(buffer, "%s/disp%d%dx-%s.pfm", posdir1, pos0, pos1, in_suffix);
         ReadImageVerb(x1, buffer, 1);
-        if (xonly) {
-            // create blank images for ydisps
-            CShape sh = x0.Shape();
-            y0.ReAllocate(sh);
-            y1.ReAllocate(sh);
-            y0.FillPixels(UNK);
-            y1.FillPixels(UNK);
-        } else {
+        if (! xonly) { // ydisps are not needed otherwise
             sprintf(buffer, "%s/disp%d%dy-%s.pfm", posdir0, pos0, pos1, in_suffix);
             ReadImageVerb(y0, buffer, 1);
             sprintf(buffer, "%s/disp%d%dy-%s.pfm", posdir1, pos0, pos1, in_suffix);
             ReadImageVerb(y1, buffer, 1);
         }
-        CFloatImage d0 = mergeToFloImage(x0, y0);
-        CFloatImage d1 = mergeToFloImage(x1, y1);
-        pair<CFloatImage,CFloatImage> outputs = runCrossCheck(d0, d1, thresh, xonly, halfocc);
-        pair<CFloatImage,CFloatImage> crosscheck0, crosscheck1;
-        crosscheck0 = splitFloImage(outputs.first);
-        crosscheck1 = splitFloImage(outputs.second);
+        CByteImage r0, r1;
+        int use0 = regionImage(region0, x0.Shape(), r0);
+        int use1 = regionImage(region1, x1.Shape(), r1);
         CFloatImage ccx0, ccy0, ccx1, ccy1;
-        ccx0 = crosscheck0.first;
-        ccx1 = crosscheck1.first;
-        ccy0 = crosscheck0.second;
-        ccy1 = crosscheck1.second;
+        crossCheckDisparities(x0, y0, x1, y1, thresh, xonly, halfocc, ccx0, ccy0, ccx1, ccy1,
+                              use0 ? &r0 : NULL, use1 ? &r1 : NULL);
         sprintf(buffer, "%s/disp%d%dx-%s.pfm", posdir0, pos0, pos1, out_suffix);
         WriteImageVerb(ccx0, buffer, 1);
         sprintf(buffer, "%s/disp%d%dx-%s.pfm", posdir1, pos0, pos1, out_suffix);
@@ -194,7 +346,8 @@ extern "C" {
         WriteImageVerb(ccy1, buffer, 1);
     }
 
-    void filterDisparities(char *dispx, char *dispy, char *outx, char *outy, int pos0, int pos1, float ythresh, int kx, int ky, int mincompsize, int maxholesize) {
+    void filterDisparities(char *dispx, char *dispy, char *outx, char *outy, int pos0, int pos1, float ythresh, int kx, int ky, int mincompsize, int maxholesize,
+                           const DisparityRegion *region) {
         assert (dispx != NULL);
         assert (outx != NULL);
         
@@ -206,9 +359,11 @@ extern "C" {
         } else {
             ReadImageVerb(y, dispy, 1);
         }
-        CFloatImage merged = mergeToFloImage(x, y);
+        CFloatImage merged = mergeToFloImage(x, y, 1);
         
-        CFloatImage mergedResult = runFilter(merged, ythresh, kx, ky, mincompsize, maxholesize);
+        CByteImage r;
+        int use = regionImage(region, merged.Shape(), r);
+        CFloatImage mergedResult = runFilter(merged, ythresh, kx, ky, mincompsize, maxholesize, NULL, use ? &r : NULL);
         pair<CFloatImage,CFloatImage> imgpair = splitFloImage(mergedResult);
         x = imgpair.first;
         y = imgpair.second;
@@ -229,7 +384,7 @@ extern "C" {
                 y.ReAllocate(x.Shape());
                 y.FillPixels(INFINITY);
             }
-            flo = mergeToFloImage(x, y);
+            flo = mergeToFloImage(x, y, 1);
             images[i] = flo;
         }
         CFloatImage result = mergeDisparityMaps(images, count, mingroup, maxdiff);
@@ -247,8 +402,8 @@ extern "C" {
         ReadImageVerb(dispy, dispy_file, 1);
         ReadImageVerb(codex, codex_file, 1);
         ReadImageVerb(codey, codey_file, 1);
-        disp = mergeToFloImage(dispx, dispy);
-        code = mergeToFloImage(codex, codey);
+        disp = mergeToFloImage(dispx, dispy, 1);
+        code = mergeToFloImage(codex, codey, 1);
         
         CFloatImage floresult = reproject(disp, code, err_file, mat_file, log_file);
         pair<CFloatImage,CFloatImage> splitresult = splitFloImage(floresult);
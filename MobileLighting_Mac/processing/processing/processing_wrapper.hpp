@@ -1,18 +1,30 @@
 #ifndef processing_wrapper_hpp
 #define processing_wrapper_hpp
 
+#include "RefineParams.h"
+#include "DisparityRegion.h"
+
 #pragma GCC visibility push(default)
 
 // Processing
+void setProcessingThreads(int n);
 void transformPfm(char *pfmPath, char *transformation);
 void writeShadowImgs(char *decodedDir, char *outDir, int projs[], int nProjs, int pos);
+int decodeThresholdedIms(char *outdir, char *codefile, int direction, char **imList, int numIm, char *posID);
+int decodeExposureIms(char *outdir, char *codefile, int direction, char **normalList, char **invertedList, int numIm, double angle, float thresh, char *posID);
 void refineDecodedIm(char *outdir, int direction, char* decodedIm, double angle, char *posID);
-void disparitiesOfRefinedImgs(char *posdir0, char *posdir1, char *outdir0, char *outdir1, int pos0, int pos1, int rectified, int dXmin, int dXmax, int dYmin, int dYmax);
+void refineDecodedImParams(char *outdir, int direction, char* decodedIm, double angle, char *posID, RefineParams params);
+int refineDecodedImBatch(char **outdirs, int *directions, char **decodedIms, double *angles, char **posIDs, RefineParams *params, int count, int nworkers, int maxMemoryMB, int *status);
+void disparitiesOfRefinedImgs(char *posdir0, char *posdir1, char *outdir0, char *outdir1, int pos0, int pos1, int rectified, int dXmin, int dXmax, int dYmin, int dYmax, int pyramidLevels, int autoRange,
+                              const DisparityRegion *region0, const DisparityRegion *region1);
+void clearDisparityCache(void);   // frees the code images kept by disparitiesOfRefinedImgs
 void computeMaps(char *impath, char *intr, char *extr);
 void rectifyDecoded(int camera, char *impath, char *outpath);
 void rectifyAmbient(int camera, char *impath, char *outpath);
-void crosscheckDisparities(char *posdir0, char *posdir1, int pos0, int pos1, float thresh, int xonly, int halfocc, char *in_suffix, char *out_suffix);
-void filterDisparities(char *dispx, char *dispy, char *outx, char *outy, int pos0, int pos1, float ythresh, int kx, int ky, int mincompsize, int maxholesize);
+void crosscheckDisparities(char *posdir0, char *posdir1, int pos0, int pos1, float thresh, int xonly, int halfocc, char *in_suffix, char *out_suffix,
+                           const DisparityRegion *region0, const DisparityRegion *region1);
+void filterDisparities(char *dispx, char *dispy, char *outx, char *outy, int pos0, int pos1, float ythresh, int kx, int ky, int mincompsize, int maxholesize,
+                       const DisparityRegion *region);
 void mergeDisparities(char *imgsx[], char *imgsy[], char *outx, char *outy, int count, int mingroup, float maxdiff);
 void reprojectDisparities(char *dispx_file, char *dispy_file, char *codex_file, char *codey_file, char *outx_file, char *outy_file, char *err_file, char *mat_file, char *log_file);
 void mergeDisparityMaps2(float maxdiff, int nV, int nR, char* outdfile, char* outsdfile, char* outnfile, char *inmdfile, char **invdfiles, char **inrdfiles);